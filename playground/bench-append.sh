@@ -0,0 +1,49 @@
+#!/bin/bash
+# Log style appends of 100 bytes, with and without write combining, on
+# raid 1 and raid 5. Each file is appended to through one open descriptor
+# and read back after close.
+#
+# usage: ./bench-append.sh [files] [disks]
+
+FILES=${1:-32}
+DISKS=${2:-3}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+for mode in 1 5; do
+	IMGS=""
+	for i in $(seq 1 $DISKS); do
+		IMGS="$IMGS bench$i.img"
+	done
+
+	for opt in --no-write-combine ""; do
+		for d in $IMGS; do
+			rm -f $d
+			truncate -s 64M $d
+		done
+		../solution/mkfs -r $mode $(for d in $IMGS; do echo -n "-d $d "; done) -i 1024 -b 65536 || exit 1
+
+		../solution/wfs $IMGS -s mnt $opt || exit 1
+		python3 - $FILES "raid $mode, $DISKS disks, ${opt:-write combining}" <<'PYEOF'
+import os, sys, time
+files, label = int(sys.argv[1]), sys.argv[2]
+line = b"x" * 99 + b"\n"
+start = time.time()
+for i in range(files):
+    fd = os.open(f"mnt/log{i}", os.O_WRONLY | os.O_CREAT | os.O_APPEND, 0o644)
+    for _ in range(360):
+        os.write(fd, line)
+    os.close(fd)
+elapsed = time.time() - start
+for i in range(files):
+    assert open(f"mnt/log{i}", "rb").read() == line * 360
+print(f"{label}: {files * 360 / elapsed:.0f} appends/s")
+PYEOF
+		fusermount -u mnt
+	done
+done
+
+rm -f bench*.img
@@ -0,0 +1,71 @@
+#!/bin/bash
+# Reads of a working set that fits in a --cache image, with the disk images
+# on slow storage and the cache on fast storage. Every pass starts from a
+# fresh mount, the first one with the cache fills it and the later ones,
+# after a remount, are served from it.
+#
+# usage: ./bench-cache.sh [disk dir] [cache dir] [files] [passes]
+
+DISK_DIR=${1:-.}
+CACHE_DIR=${2:-/dev/shm}
+FILES=${3:-256}
+PASSES=${4:-3}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+rate() {
+	python3 -c "print(f'{$1 / ($3 - $2) / 1e6:.1f} MB/s')"
+}
+
+# Host page cache would hide the slow disks, dropping it needs root
+drop_caches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+}
+
+head -c 36352 /dev/urandom > /tmp/bench-src.$$
+BYTES=$((FILES * 36352))
+CACHE=$CACHE_DIR/bench-cache.$$.img
+
+for mode in 0 1 5; do
+	IMGS=""
+	for i in 1 2 3; do
+		IMGS="$IMGS $DISK_DIR/bench$i.img"
+	done
+
+	for opt in "" --cache=$CACHE; do
+		for d in $IMGS; do
+			rm -f $d
+			truncate -s 128M $d
+		done
+		rm -f $CACHE
+		truncate -s 64M $CACHE
+		../solution/mkfs -r $mode $(for d in $IMGS; do echo -n "-d $d "; done) -i 2048 -b 131072 || exit 1
+		label="raid $mode, $([ -n "$opt" ] && echo cache || echo no cache)"
+
+		../solution/wfs $IMGS -s mnt $opt || exit 1
+		# directories hold at most 96 entries
+		for i in $(seq 0 $((FILES / 64))); do mkdir mnt/d$i; done
+		for i in $(seq 0 $((FILES - 1))); do
+			cat /tmp/bench-src.$$ > mnt/d$((i / 64))/f$i
+		done
+		fusermount -u mnt
+
+		for p in $(seq 1 $PASSES); do
+			drop_caches
+			../solution/wfs $IMGS -s mnt $opt || exit 1
+			start=$(date +%s.%N)
+			for i in $(seq 0 $((FILES - 1))); do
+				cat mnt/d$((i / 64))/f$i > /dev/null
+			done
+			end=$(date +%s.%N)
+			fusermount -u mnt
+			echo "$label, pass $p: read $(rate $BYTES $start $end)"
+		done
+	done
+done
+
+rm -f $DISK_DIR/bench*.img $CACHE /tmp/bench-src.$$
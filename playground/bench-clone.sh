@@ -0,0 +1,54 @@
+#!/bin/bash
+# Copying files inside the mount with cp against wfs-clone, with and
+# without block reference counts. Without them wfs-clone still copies the
+# blocks inside wfs instead of reading and writing through FUSE.
+#
+# usage: ./bench-clone.sh [files] [disks]
+
+FILES=${1:-64}
+DISKS=${2:-2}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+rate() {
+	python3 -c "print(f'{$1 / ($3 - $2) / 1e6:.1f} MB/s')"
+}
+
+for features in "" "-O reflink"; do
+	IMGS=""
+	for i in $(seq 1 $DISKS); do
+		rm -f bench$i.img
+		truncate -s 64M bench$i.img
+		IMGS="$IMGS bench$i.img"
+	done
+	../solution/mkfs -r 1 $(for d in $IMGS; do echo -n "-d $d "; done) -i 1024 -b 65536 $features || exit 1
+
+	../solution/wfs $IMGS -s mnt || exit 1
+	mkdir mnt/src mnt/cp mnt/clone
+	head -c 36000 /dev/urandom > /tmp/bench-src.$$
+	for i in $(seq 1 $FILES); do
+		cat /tmp/bench-src.$$ > mnt/src/f$i
+	done
+
+	for tool in cp clone; do
+		start=$(date +%s.%N)
+		for i in $(seq 1 $FILES); do
+			if [ $tool = cp ]; then
+				cp mnt/src/f$i mnt/cp/f$i
+			else
+				../solution/wfs-clone mnt/src/f$i mnt/clone/f$i || exit 1
+			fi
+		done
+		end=$(date +%s.%N)
+		echo "raid 1 ${features:-without reflink}: $tool $(rate $((FILES * 36000)) $start $end)"
+	done
+
+	cmp -s mnt/src/f1 mnt/clone/f1 || echo "clone differs from source"
+	df mnt | tail -1
+	fusermount -u mnt
+done
+
+rm -f bench*.img /tmp/bench-src.$$
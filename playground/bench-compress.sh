@@ -0,0 +1,74 @@
+#!/bin/bash
+# Capacity and throughput with and without compression, on compressible
+# text (json log lines) and on random data that compression skips.
+# Files are written through the mount, the array is remounted and the
+# files are read back whole, then read at random offsets.
+#
+# usage: ./bench-compress.sh [files] [random reads]
+
+FILES=${1:-64}
+OPS=${2:-5000}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+rate() {
+	python3 -c "print(f'{$1 / ($3 - $2) / 1e6:.1f} MB/s')"
+}
+
+python3 - > /tmp/bench-json.$$ <<'EOF'
+import json, random
+rnd = random.Random(537)
+out = ""
+while len(out) < 36000:
+    out += json.dumps({"ts": 1700000000 + len(out), "level": rnd.choice(["info", "warn", "debug"]),
+                       "path": f"/api/v1/items/{rnd.randrange(1000)}", "status": rnd.choice([200, 200, 404]),
+                       "ms": rnd.randrange(500)}) + "\n"
+print(out[:35999])
+EOF
+head -c 36000 /dev/urandom > /tmp/bench-random.$$
+
+for features in "" "-O compress"; do
+	for data in json random; do
+		rm -f bench1.img bench2.img
+		truncate -s 64M bench1.img
+		truncate -s 64M bench2.img
+		../solution/mkfs -r 1 -d bench1.img -d bench2.img -i 1024 -b 65536 $features || exit 1
+
+		# directories hold at most 96 entries
+		../solution/wfs bench1.img bench2.img -s mnt || exit 1
+		start=$(date +%s.%N)
+		for i in $(seq 0 $((FILES - 1))); do
+			[ $((i % 64)) -eq 0 ] && mkdir mnt/d$((i / 64))
+			cat /tmp/bench-$data.$$ > mnt/d$((i / 64))/f$i
+		done
+		end=$(date +%s.%N)
+		used=$(df -k mnt | tail -1 | awk '{print $3}')
+		fusermount -u mnt
+		echo "${features:-uncompressed} $data: write $(rate $((FILES * 36000)) $start $end), ${used}K used"
+
+		../solution/wfs bench1.img bench2.img -s mnt || exit 1
+		start=$(date +%s.%N)
+		cat mnt/d*/* > /dev/null
+		end=$(date +%s.%N)
+		echo "${features:-uncompressed} $data: read  $(rate $((FILES * 36000)) $start $end)"
+
+		python3 - $FILES $OPS <<'EOF'
+import os, random, sys, time
+files, ops = int(sys.argv[1]), int(sys.argv[2])
+fds = [os.open(f"mnt/d{i // 64}/f{i}", os.O_RDONLY) for i in range(files)]
+rnd = random.Random(537)
+start = time.time()
+for _ in range(ops):
+    os.pread(fds[rnd.randrange(files)], 512, rnd.randrange(70) * 512)
+print(f"  random read {ops / (time.time() - start):.0f} ops/s")
+for fd in fds:
+    os.close(fd)
+EOF
+		fusermount -u mnt
+	done
+done
+
+rm -f bench*.img /tmp/bench-json.$$ /tmp/bench-random.$$
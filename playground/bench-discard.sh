@@ -0,0 +1,55 @@
+#!/bin/bash
+# Host space of churned raid 0 and raid 1 arrays with and without online
+# discard, and after an offline wfs-trim. Files are written and most of
+# them deleted again, in rounds, so the array ends up mostly free.
+#
+# usage: ./bench-discard.sh [rounds] [disks]
+
+ROUNDS=${1:-8}
+DISKS=${2:-2}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+allocated() {
+	du -ck $IMGS | tail -1 | cut -f1
+}
+
+head -c 36000 /dev/urandom > /tmp/bench-src.$$
+
+for mode in 0 1; do
+	IMGS=""
+	for i in $(seq 1 $DISKS); do
+		IMGS="$IMGS bench$i.img"
+	done
+
+	for opt in "" --discard; do
+		for d in $IMGS; do
+			rm -f $d
+			truncate -s 64M $d
+		done
+		../solution/mkfs -r $mode $(for d in $IMGS; do echo -n "-d $d "; done) -i 1024 -b 65536 || exit 1
+		label="raid $mode, $DISKS disks, ${opt:-no discard}"
+
+		../solution/wfs $IMGS -s mnt $opt || exit 1
+		start=$(date +%s.%N)
+		for r in $(seq 1 $ROUNDS); do
+			# directories hold at most 96 entries
+			mkdir mnt/r$r
+			for i in $(seq 0 63); do
+				cat /tmp/bench-src.$$ > mnt/r$r/f$i
+			done
+			rm -f mnt/r$r/f[1-9]*
+		done
+		end=$(date +%s.%N)
+		fusermount -u mnt
+		echo "$label: $(python3 -c "print(f'{$end - $start:.2f}')")s churn, $(allocated) KiB allocated"
+	done
+
+	../solution/wfs-trim $IMGS > /dev/null || exit 1
+	echo "raid $mode, $DISKS disks, after wfs-trim: $(allocated) KiB allocated"
+done
+
+rm -f bench*.img /tmp/bench-src.$$
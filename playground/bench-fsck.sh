@@ -0,0 +1,49 @@
+#!/bin/bash
+# Offline check time of a populated raid 1 array: the python metadata
+# checker from tests/ against wfs-fsck on one thread and on every core.
+#
+# usage: ./bench-fsck.sh [files] [disks]
+
+FILES=${1:-2048}
+DISKS=${2:-2}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+elapsed() {
+	python3 -c "print(f'{($2 - $1) * 1000:.0f} ms')"
+}
+
+IMGS=""
+for i in $(seq 1 $DISKS); do
+	rm -f bench$i.img
+	truncate -s 256M bench$i.img
+	IMGS="$IMGS bench$i.img"
+done
+../solution/mkfs -r 1 $(for d in $IMGS; do echo -n "-d $d "; done) -i 16384 -b 262144 || exit 1
+
+# directories hold at most 96 entries
+../solution/wfs $IMGS -s mnt || exit 1
+head -c 8000 /dev/urandom > /tmp/bench-src.$$
+for i in $(seq 0 $((FILES - 1))); do
+	[ $((i % 64)) -eq 0 ] && mkdir mnt/d$((i / 64))
+	cat /tmp/bench-src.$$ > mnt/d$((i / 64))/f$i
+done
+fusermount -u mnt
+
+start=$(date +%s.%N)
+python3 ../tests/wfs-check-metadata.py --mode raid1 --disks $IMGS > /dev/null
+end=$(date +%s.%N)
+echo "wfs-check-metadata.py: $(elapsed $start $end)"
+
+for threads in 1 $(nproc); do
+	start=$(date +%s.%N)
+	../solution/wfs-fsck -t $threads $IMGS > /dev/null
+	rc=$?
+	end=$(date +%s.%N)
+	echo "wfs-fsck, $threads threads: $(elapsed $start $end), exit $rc"
+done
+
+rm -f bench*.img /tmp/bench-src.$$
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Populating a fresh array with a prepared tree: cp -r through the mount
+# against wfs-import writing the images directly, on raid 1 and raid 5.
+#
+# usage: ./bench-import.sh [files] [disks]
+
+FILES=${1:-2048}
+DISKS=${2:-3}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+rate() {
+	python3 -c "print(f'{$1 / ($3 - $2) / 1e6:.1f} MB/s')"
+}
+
+# directories hold at most 96 entries
+rm -rf /tmp/bench-tree.$$
+for i in $(seq 0 $((FILES - 1))); do
+	[ $((i % 64)) -eq 0 ] && mkdir -p /tmp/bench-tree.$$/d$((i / 64))
+	head -c 30000 /dev/urandom > /tmp/bench-tree.$$/d$((i / 64))/f$i
+done
+BYTES=$((FILES * 30000))
+
+for mode in 1 5; do
+	IMGS=""
+	for i in $(seq 1 $DISKS); do
+		IMGS="$IMGS bench$i.img"
+	done
+
+	for tool in cp wfs-import; do
+		for d in $IMGS; do
+			rm -f $d
+			truncate -s 256M $d
+		done
+		../solution/mkfs -r $mode $(for d in $IMGS; do echo -n "-d $d "; done) -i 4096 -b 262144 || exit 1
+
+		start=$(date +%s.%N)
+		if [ $tool = cp ]; then
+			../solution/wfs $IMGS -s mnt || exit 1
+			cp -r /tmp/bench-tree.$$/. mnt/
+			fusermount -u mnt
+		else
+			../solution/wfs-import /tmp/bench-tree.$$ $IMGS > /dev/null || exit 1
+		fi
+		sync
+		end=$(date +%s.%N)
+		echo "raid $mode, $DISKS disks, $tool: $(rate $BYTES $start $end)"
+	done
+done
+
+rm -rf bench*.img /tmp/bench-tree.$$
@@ -0,0 +1,39 @@
+#!/bin/bash
+# Mount time and resident memory of wfs as the inode count grows. The
+# inode region is most of the image, mount should not read it.
+#
+# usage: ./bench-mount.sh [inode counts...]
+
+COUNTS=${*:-1024 16384 131072 524288}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+for inodes in $COUNTS; do
+	rm -f bench1.img bench2.img
+	truncate -s $((inodes * 512 + 64 * 1024 * 1024)) bench1.img
+	truncate -s $((inodes * 512 + 64 * 1024 * 1024)) bench2.img
+	../solution/mkfs -r 1 -d bench1.img -d bench2.img -i $inodes -b 65536 || exit 1
+
+	# Drop the images from the page cache so the mount reads from disk
+	sync
+	echo 3 | sudo -n tee /proc/sys/vm/drop_caches > /dev/null 2>&1
+
+	start=$(date +%s.%N)
+	../solution/wfs bench1.img bench2.img -s mnt || exit 1
+	stat mnt > /dev/null
+	end=$(date +%s.%N)
+	rss=$(ps -o rss= -p $(pgrep -n -f "wfs bench1.img"))
+
+	# First write after mount, only the touched inode and bitmap bytes are mirrored
+	wstart=$(date +%s.%N)
+	echo hello > mnt/f
+	wend=$(date +%s.%N)
+	fusermount -u mnt
+
+	python3 -c "print(f'$inodes inodes: mount {($end - $start) * 1000:.1f} ms, first write {($wend - $wstart) * 1000:.1f} ms, ${rss}K resident')"
+done
+
+rm -f bench*.img
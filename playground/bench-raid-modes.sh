@@ -0,0 +1,51 @@
+#!/bin/bash
+# Write and read throughput of each raid mode on the same array size.
+# Every mode writes the same set of files through the mount, then the
+# array is remounted and the files are read back.
+#
+# usage: ./bench-raid-modes.sh [disks] [files] [modes...]
+
+DISKS=${1:-4}
+FILES=${2:-256}
+shift $(( $# < 2 ? $# : 2 ))
+MODES=${*:-0 1 5}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+rate() {
+	python3 -c "print(f'{$1 / ($3 - $2) / 1e6:.1f} MB/s')"
+}
+
+for mode in $MODES; do
+	IMGS=""
+	for i in $(seq 1 $DISKS); do
+		rm -f bench$i.img
+		truncate -s 64M bench$i.img
+		IMGS="$IMGS bench$i.img"
+	done
+	../solution/mkfs -r $mode $(for d in $IMGS; do echo -n "-d $d "; done) -i 1024 -b 65536 || exit 1
+
+	# directories hold at most 96 entries
+	../solution/wfs $IMGS -s mnt || exit 1
+	head -c 36000 /dev/urandom > /tmp/bench-src.$$
+	start=$(date +%s.%N)
+	for i in $(seq 0 $((FILES - 1))); do
+		[ $((i % 64)) -eq 0 ] && mkdir mnt/d$((i / 64))
+		cat /tmp/bench-src.$$ > mnt/d$((i / 64))/f$i
+	done
+	end=$(date +%s.%N)
+	fusermount -u mnt
+	echo "raid $mode, $DISKS disks: write $(rate $((FILES * 36000)) $start $end)"
+
+	../solution/wfs $IMGS -s mnt || exit 1
+	start=$(date +%s.%N)
+	cat mnt/d*/* > /dev/null
+	end=$(date +%s.%N)
+	fusermount -u mnt
+	echo "raid $mode, $DISKS disks: read  $(rate $((FILES * 36000)) $start $end)"
+done
+
+rm -f bench*.img /tmp/bench-src.$$
@@ -0,0 +1,86 @@
+#!/bin/bash
+# Fragmentation-after-churn benchmark for raid 0.
+# Fills the array with small files, deletes every other one, then writes
+# large files into the holes and measures sequential read bandwidth after
+# a remount. Also reports how many consecutive file blocks landed on the
+# same disk, which is what stops a read from using every spindle.
+#
+# usage: ./bench-raid0-churn.sh [disks] [large files]
+
+DISKS=${1:-4}
+FILES=${2:-64}
+IMGS=""
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+cd ../solution
+make
+
+for i in $(seq 1 $DISKS); do
+	rm -f ../playground/bench$i.img
+	truncate -s 64M ../playground/bench$i.img
+	IMGS="$IMGS ../playground/bench$i.img"
+done
+
+./mkfs -r 0 $(for d in $IMGS; do echo -n "-d $d "; done) -i 1024 -b 65536 || exit 1
+cd ../playground
+IMGS=$(echo $IMGS | sed 's#\.\./playground/##g')
+
+# Churn: small files of 1-3 blocks, then free every other one
+# (a directory holds at most 96 entries, so spread them out)
+../solution/wfs $IMGS -s mnt || exit 1
+python3 -c '
+import os
+for d in range(10):
+    os.mkdir(f"mnt/churn{d}")
+    for i in range(60):
+        with open(f"mnt/churn{d}/small{i}", "wb") as f:
+            f.write(os.urandom(512 * (1 + i % 3) - 100))
+for d in range(10):
+    for i in range(0, 60, 2):
+        os.unlink(f"mnt/churn{d}/small{i}")
+'
+mkdir mnt/large
+for i in $(seq 1 $FILES); do
+	head -c 36000 /dev/urandom > mnt/large/f$i
+done
+fusermount -u mnt
+
+# Layout: fraction of consecutive blocks that stay on the same disk
+python3 - $IMGS <<'EOF'
+import struct, sys
+imgs = {}
+for path in sys.argv[1:]:
+    data = open(path, 'rb').read()
+    imgs[struct.unpack('<i', data[52:56])[0]] = data
+n = len(imgs)
+ninodes, nblocks, ibit, dbit, iblk, dblk = struct.unpack('<QQqqqq', imgs[0][:48])
+bitmap = imgs[0][ibit:dbit]
+same = total = 0
+for ino in range(ninodes):
+    if not bitmap[ino // 8] & (1 << ino % 8):
+        continue
+    inode = imgs[0][iblk + ino * 512:iblk + ino * 512 + 120]
+    if struct.unpack('<i', inode[4:8])[0] & 0o170000 != 0o100000:
+        continue
+    ptrs = list(struct.unpack('<8q', inode[56:120]))
+    seq = [b for b in ptrs[:7] if b >= 0]
+    if ptrs[7] >= 0:
+        ind = imgs[ptrs[7] % n][dblk + (ptrs[7] // n) * 512:][:512]
+        seq += [b for b in struct.unpack('<64q', ind) if b >= 0]
+    for a, b in zip(seq, seq[1:]):
+        total += 1
+        same += (a % n) == (b % n)
+print(f"consecutive blocks on the same disk: {same}/{total}")
+EOF
+
+# Sequential read bandwidth on a fresh mount
+../solution/wfs $IMGS -s mnt || exit 1
+start=$(date +%s.%N)
+bytes=$(cat mnt/large/* | wc -c)
+end=$(date +%s.%N)
+fusermount -u mnt
+python3 -c "print(f'sequential read: {$bytes / ($end - $start) / 1e6:.1f} MB/s ({$bytes} bytes)')"
+
+rm -f bench*.img
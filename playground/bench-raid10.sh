@@ -0,0 +1,74 @@
+#!/bin/bash
+# Sequential and random I/O of raid 10 against raid 1 at 4, 6 and 8 disks.
+# Sequential: write then read back whole files. Random: 512 byte writes
+# and reads at random offsets of random files, through the mount.
+#
+# usage: ./bench-raid10.sh [files] [random ops]
+
+FILES=${1:-256}
+OPS=${2:-20000}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+rate() {
+	python3 -c "print(f'{$1 / ($3 - $2) / 1e6:.1f} MB/s')"
+}
+
+for disks in 4 6 8; do
+	for mode in 1 10; do
+		IMGS=""
+		for i in $(seq 1 $disks); do
+			rm -f bench$i.img
+			truncate -s 64M bench$i.img
+			IMGS="$IMGS bench$i.img"
+		done
+		../solution/mkfs -r $mode $(for d in $IMGS; do echo -n "-d $d "; done) -i 1024 -b 65536 || exit 1
+
+		# Sequential, directories hold at most 96 entries
+		../solution/wfs $IMGS -s mnt || exit 1
+		head -c 36000 /dev/urandom > /tmp/bench-src.$$
+		start=$(date +%s.%N)
+		for i in $(seq 0 $((FILES - 1))); do
+			[ $((i % 64)) -eq 0 ] && mkdir mnt/d$((i / 64))
+			cat /tmp/bench-src.$$ > mnt/d$((i / 64))/f$i
+		done
+		end=$(date +%s.%N)
+		fusermount -u mnt
+		echo "raid $mode, $disks disks: sequential write $(rate $((FILES * 36000)) $start $end)"
+
+		../solution/wfs $IMGS -s mnt || exit 1
+		start=$(date +%s.%N)
+		cat mnt/d*/* > /dev/null
+		end=$(date +%s.%N)
+		echo "raid $mode, $disks disks: sequential read  $(rate $((FILES * 36000)) $start $end)"
+
+		# Random, same seed for every run so all modes see the same offsets
+		python3 - $FILES $OPS <<'EOF'
+import os, random, sys, time
+files, ops = int(sys.argv[1]), int(sys.argv[2])
+paths = [f"mnt/d{i // 64}/f{i}" for i in range(files)]
+fds = [os.open(p, os.O_RDWR) for p in paths]
+block = os.urandom(512)
+for kind in ("write", "read"):
+    rnd = random.Random(537)
+    start = time.time()
+    for _ in range(ops):
+        fd = fds[rnd.randrange(files)]
+        off = rnd.randrange(70) * 512
+        if kind == "write":
+            os.pwrite(fd, block, off)
+        else:
+            os.pread(fd, 512, off)
+    elapsed = time.time() - start
+    print(f"  random {kind:5} {ops / elapsed:.0f} ops/s")
+for fd in fds:
+    os.close(fd)
+EOF
+		fusermount -u mnt
+	done
+done
+
+rm -f bench*.img /tmp/bench-src.$$
@@ -0,0 +1,57 @@
+#!/bin/bash
+# Cold cache sequential reads with and without readahead hints, on raid 0
+# and raid 1. The page cache is dropped before each read so the data
+# comes from the disk images. Dropping caches needs root or passwordless
+# sudo.
+#
+# usage: ./bench-readahead.sh [files] [disks]
+
+FILES=${1:-256}
+DISKS=${2:-4}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+rate() {
+	python3 -c "print(f'{$1 / ($3 - $2) / 1e6:.1f} MB/s')"
+}
+
+drop_caches() {
+	sync
+	echo 3 | sudo -n tee /proc/sys/vm/drop_caches > /dev/null || exit 1
+}
+
+for mode in 0 1; do
+	IMGS=""
+	for i in $(seq 1 $DISKS); do
+		rm -f bench$i.img
+		truncate -s 64M bench$i.img
+		IMGS="$IMGS bench$i.img"
+	done
+	../solution/mkfs -r $mode $(for d in $IMGS; do echo -n "-d $d "; done) -i 1024 -b 65536 || exit 1
+
+	# directories hold at most 96 entries
+	../solution/wfs $IMGS -s mnt || exit 1
+	head -c 36000 /dev/urandom > /tmp/bench-src.$$
+	for i in $(seq 0 $((FILES - 1))); do
+		[ $((i % 64)) -eq 0 ] && mkdir mnt/d$((i / 64))
+		cat /tmp/bench-src.$$ > mnt/d$((i / 64))/f$i
+	done
+	fusermount -u mnt
+
+	for opt in --no-readahead ""; do
+		drop_caches
+		../solution/wfs $IMGS -s mnt $opt || exit 1
+		start=$(date +%s.%N)
+		for f in mnt/d*/*; do
+			dd if=$f of=/dev/null bs=4096 status=none
+		done
+		end=$(date +%s.%N)
+		fusermount -u mnt
+		echo "raid $mode, $DISKS disks, ${opt:-readahead}: cold sequential read $(rate $((FILES * 36000)) $start $end)"
+	done
+done
+
+rm -f bench*.img /tmp/bench-src.$$
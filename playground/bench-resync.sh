@@ -0,0 +1,63 @@
+#!/bin/bash
+# Recovery of a raid 1 array after wfs is killed in the middle of writes.
+# The next mount resyncs only the regions the write-intent bitmap marks,
+# compared here against a full compare of the mirrors with cmp.
+#
+# usage: ./bench-resync.sh [size] [disks]
+
+SIZE=${1:-1G}
+DISKS=${2:-2}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+elapsed() {
+	python3 -c "print(f'{($2 - $1) * 1000:.0f} ms')"
+}
+
+IMGS=""
+for i in $(seq 1 $DISKS); do
+	rm -f bench$i.img
+	truncate -s $SIZE bench$i.img
+	IMGS="$IMGS bench$i.img"
+done
+BLOCKS=$(( $(stat -c %s bench1.img) / 512 * 3 / 4 / 32 * 32 ))
+../solution/mkfs -r 1 $(for d in $IMGS; do echo -n "-d $d "; done) -i 4096 -b $BLOCKS || exit 1
+
+# directories hold at most 96 entries
+../solution/wfs $IMGS -s mnt || exit 1
+head -c 36000 /dev/urandom > /tmp/bench-src.$$
+for i in $(seq 0 1023); do
+	[ $((i % 64)) -eq 0 ] && mkdir mnt/d$((i / 64))
+	cat /tmp/bench-src.$$ > mnt/d$((i / 64))/f$i
+done
+fusermount -u mnt
+
+# Crash while rewriting a few files
+../solution/wfs $IMGS -s mnt || exit 1
+for i in $(seq 0 15); do
+	cat /tmp/bench-src.$$ > mnt/d0/f$i
+done
+pkill -9 -x wfs
+sleep 1
+fusermount -u mnt 2>/dev/null
+
+start=$(date +%s.%N)
+../solution/wfs $IMGS -f -s mnt > /tmp/bench-out.$$ &
+while ! mountpoint -q mnt; do sleep 0.01; done
+end=$(date +%s.%N)
+echo "mount after crash: $(elapsed $start $end)"
+fusermount -u mnt
+wait
+grep Resynced /tmp/bench-out.$$
+
+start=$(date +%s.%N)
+for d in $IMGS; do
+	[ $d = bench1.img ] || cmp -l bench1.img $d > /dev/null
+done
+end=$(date +%s.%N)
+echo "full compare of the mirrors: $(elapsed $start $end)"
+
+rm -f bench*.img /tmp/bench-src.$$ /tmp/bench-out.$$
@@ -0,0 +1,71 @@
+#!/bin/bash
+# Whole file writes and reads in 128 KiB requests, with and without the
+# zero copy read_buf/write_buf paths, on raid 0 and raid 1. Reports the
+# throughput and the CPU time wfs itself spends per GB moved.
+#
+# usage: ./bench-zerocopy.sh [files] [disks]
+
+FILES=${1:-1024}
+DISKS=${2:-2}
+
+fusermount -u mnt 2>/dev/null
+rm -rf mnt
+mkdir mnt
+(cd ../solution && make) || exit 1
+
+rate() {
+	python3 -c "print(f'{$1 / ($3 - $2) / 1e6:.1f} MB/s')"
+}
+
+# utime + stime of the running wfs, in clock ticks
+cpu_ticks() {
+	awk '{ print $14 + $15 }' /proc/$(pgrep -n -x wfs)/stat
+}
+
+per_gb() {
+	python3 -c "print(f'{($3 - $2) / $(getconf CLK_TCK) / ($1 / 1e9):.2f} cpu s/GB')"
+}
+
+head -c 36352 /dev/urandom > /tmp/bench-src.$$
+BYTES=$((FILES * 36352))
+
+for mode in 0 1; do
+	IMGS=""
+	for i in $(seq 1 $DISKS); do
+		IMGS="$IMGS bench$i.img"
+	done
+
+	for opt in --no-zero-copy ""; do
+		for d in $IMGS; do
+			rm -f $d
+			truncate -s 128M $d
+		done
+		../solution/mkfs -r $mode $(for d in $IMGS; do echo -n "-d $d "; done) -i 2048 -b 131072 || exit 1
+		../solution/wfs $IMGS -s mnt $opt || exit 1
+		label="raid $mode, $DISKS disks, ${opt:-zero copy}"
+
+		# directories hold at most 96 entries
+		for i in $(seq 0 $((FILES / 64))); do mkdir mnt/d$i; done
+		cpu=$(cpu_ticks)
+		start=$(date +%s.%N)
+		for i in $(seq 0 $((FILES - 1))); do
+			dd if=/tmp/bench-src.$$ of=mnt/d$((i / 64))/f$i bs=128k status=none
+		done
+		end=$(date +%s.%N)
+		echo "$label: write $(rate $BYTES $start $end), $(per_gb $BYTES $cpu $(cpu_ticks))"
+
+		# a fresh mount starts with nothing of the files in the page cache
+		fusermount -u mnt
+		../solution/wfs $IMGS -s mnt $opt || exit 1
+		cpu=$(cpu_ticks)
+		start=$(date +%s.%N)
+		for i in $(seq 0 $((FILES - 1))); do
+			dd if=mnt/d$((i / 64))/f$i of=/dev/null bs=128k status=none
+		done
+		end=$(date +%s.%N)
+		echo "$label: read $(rate $BYTES $start $end), $(per_gb $BYTES $cpu $(cpu_ticks))"
+		fusermount -u mnt
+	done
+done
+
+rm -f bench*.img /tmp/bench-src.$$
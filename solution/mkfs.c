@@ -15,14 +15,17 @@ int main(int argc, char *argv[]) {
     int raid_mode = -1;
     char **disks = NULL;
     int disk_cnt = 0;
+    int raid_width = 2;
     struct wfs_sb sb = {0};
     int opt;
 
-    while ((opt = getopt(argc, argv, "r:d:i:b:")) != -1) switch (opt) {
+    while ((opt = getopt(argc, argv, "r:d:i:b:w:O:")) != -1) switch (opt) {
         case 'r':
             if (strcmp(optarg, "0") == 0) raid_mode = 0;
             else if (strcmp(optarg, "1") == 0) raid_mode = 1;
             else if (strcmp(optarg, "1v") == 0) raid_mode = 2;
+            else if (strcmp(optarg, "5") == 0) raid_mode = 5;
+            else if (strcmp(optarg, "10") == 0) raid_mode = 10;
 
             else exit(1);          
             break;
@@ -42,22 +45,93 @@ int main(int argc, char *argv[]) {
         case 'b':
             sb.num_data_blocks = myround(atoi(optarg), 32);
             break;
+        case 'w':
+            raid_width = atoi(optarg);
+            break;
+        case 'O':
+            for (char *f = strtok(optarg, ","); f != NULL; f = strtok(NULL, ",")) {
+                if (strcmp(f, "inline") == 0) sb.features |= WFS_FEATURE_INLINE;
+                else if (strcmp(f, "snapshot") == 0) sb.features |= WFS_FEATURE_SNAPSHOT;
+                else if (strcmp(f, "reflink") == 0) sb.features |= WFS_FEATURE_REFLINK;
+                else if (strcmp(f, "compress") == 0) sb.features |= WFS_FEATURE_COMPRESS;
+                else exit(1);
+            }
+            break;
         default:
             exit(1);
     }
 
-    if ((raid_mode != 1 && raid_mode != 0) || disk_cnt < 2 || sb.num_inodes == 0 || sb.num_data_blocks == 0) exit(1);
+    if (raid_mode == -1 || disk_cnt < 2 || sb.num_inodes == 0 || sb.num_data_blocks == 0) exit(1);
+    // Raid 5 needs at least two data disks per stripe
+    if (raid_mode == 5 && disk_cnt < 3) exit(1);
+    // Raid 10 needs at least two mirror groups of raid_width disks
+    if (raid_mode == 10 && (raid_width < 2 || disk_cnt % raid_width != 0 || disk_cnt / raid_width < 2)) exit(1);
 
     size_t inode_bitmap_size = (size_t)myround(sb.num_inodes, 8) / 8;
     size_t data_block_bitmap_size = (size_t)myround(sb.num_data_blocks, 8) / 8;
 
+    sb.magic = WFS_MAGIC;
+    sb.version = WFS_VERSION;
     sb.raid_mode = raid_mode;
+    sb.raid_width = raid_mode == 10 ? raid_width : 0;
     sb.i_bitmap_ptr = (off_t)sizeof(struct wfs_sb);
     sb.d_bitmap_ptr = (off_t)sb.i_bitmap_ptr + inode_bitmap_size;
     sb.i_blocks_ptr = (off_t)myround((sb.d_bitmap_ptr + data_block_bitmap_size), BLOCK_SIZE);
     sb.d_blocks_ptr = (off_t)myround((sb.i_blocks_ptr + sb.num_inodes * BLOCK_SIZE), BLOCK_SIZE);
 
-    off_t total_size = myround(sb.d_blocks_ptr + sb.num_data_blocks * BLOCK_SIZE, BLOCK_SIZE);
+    // Raid 5 stores one parity and disk_cnt - 1 data blocks per stripe slot
+    // and raid 10 stripes over its mirror groups, so each member only needs
+    // its share of the data blocks
+    off_t data_slots = sb.num_data_blocks;
+    if (raid_mode == 5) data_slots = (sb.num_data_blocks + disk_cnt - 2) / (disk_cnt - 1);
+    if (raid_mode == 10) data_slots = (sb.num_data_blocks + disk_cnt / raid_width - 1) / (disk_cnt / raid_width);
+    off_t total_size = myround(sb.d_blocks_ptr + data_slots * BLOCK_SIZE, BLOCK_SIZE);
+
+    // Raid 5 keeps a checksum per data block after the data region
+    if (raid_mode == 5) {
+        sb.csum_ptr = total_size;
+        total_size += myround(sb.num_data_blocks * sizeof(uint32_t), BLOCK_SIZE);
+    }
+
+    // Allocation groups, inodes are split over the same number of groups as data blocks
+    sb.group_blocks = GROUP_BLOCKS;
+    sb.group_cnt = (sb.num_data_blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+    sb.group_inodes = myround((sb.num_inodes + sb.group_cnt - 1) / sb.group_cnt, 8);
+    sb.groups_ptr = total_size;
+    total_size += myround(sb.group_cnt * sizeof(struct wfs_group), BLOCK_SIZE);
+
+    // Reference counts and snapshot slots, left zeroed below
+    if (sb.features & (WFS_FEATURE_SNAPSHOT | WFS_FEATURE_REFLINK)) {
+        sb.refs_ptr = total_size;
+        total_size += myround(sb.num_data_blocks * sizeof(uint32_t), BLOCK_SIZE);
+    }
+    if (sb.features & WFS_FEATURE_SNAPSHOT) {
+        sb.snap_ptr = total_size;
+        sb.snap_cnt = MAX_SNAPSHOTS;
+        sb.snap_size = BLOCK_SIZE + myround(inode_bitmap_size, BLOCK_SIZE) + sb.num_inodes * BLOCK_SIZE;
+        total_size += sb.snap_cnt * sb.snap_size;
+    }
+
+    // Write-intent bitmap, left zeroed below, raid 0 has no copies to keep in sync
+    if (raid_mode != 0) {
+        sb.wib_ptr = total_size;
+        sb.wib_chunk = WIB_CHUNK;
+        off_t bits = (sb.num_data_blocks + WIB_CHUNK - 1) / WIB_CHUNK + 1;
+        total_size += myround((bits + 7) / 8, BLOCK_SIZE);
+    }
+
+    struct wfs_group *groups = calloc(sb.group_cnt, sizeof(struct wfs_group));
+    if (!groups) exit(1);
+    for (int g = 0; g < sb.group_cnt; g++) {
+        groups[g].free_blocks = sb.num_data_blocks - g * sb.group_blocks;
+        if (groups[g].free_blocks > sb.group_blocks) groups[g].free_blocks = sb.group_blocks;
+        groups[g].free_inodes = (int)sb.num_inodes - g * sb.group_inodes;
+        if (groups[g].free_inodes > sb.group_inodes) groups[g].free_inodes = sb.group_inodes;
+        if (groups[g].free_inodes < 0) groups[g].free_inodes = 0;
+    }
+    // Root directory
+    groups[0].free_inodes--;
+    groups[0].dirs = 1;
 
     sb.timestamp = (int) time(NULL);
     sb.disk_cnt = disk_cnt;
@@ -106,8 +180,10 @@ int main(int argc, char *argv[]) {
         }
 
         if (lseek(fd, sb.i_blocks_ptr, SEEK_SET) < 0 || write(fd, &rootInode, sizeof(struct wfs_inode)) < 0) exit(1);
+        if (lseek(fd, sb.groups_ptr, SEEK_SET) < 0 || write(fd, groups, sb.group_cnt * sizeof(struct wfs_group)) < 0) exit(1);
     }
 
+    free(groups);
     free(disks);
     return 0;
 }
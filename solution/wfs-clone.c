@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "wfs.h"
+
+// Copy a file inside a wfs mount by sharing its blocks, like cp --reflink.
+//
+// usage: wfs-clone [-r always|auto|never] src dst
+//
+// always fails if the blocks cannot be cloned, auto (the default) falls back
+// to copying the bytes, never always copies.
+
+enum { REFLINK_NEVER, REFLINK_AUTO, REFLINK_ALWAYS };
+
+// Return -1 if fail
+int clone_file(int src, int dst) {
+    struct stat s, d;
+    if (fstat(src, &s) < 0 || fstat(dst, &d) < 0) return -1;
+    // The handle only means something to the mount it came from
+    if (s.st_dev != d.st_dev) {
+        errno = EXDEV;
+        return -1;
+    }
+
+    int ino;
+    if (ioctl(src, WFS_IOC_GETINO, &ino) < 0) return -1;
+
+    struct wfs_clone_range range = {0};
+    range.src_ino = ino;
+    return ioctl(dst, WFS_IOC_CLONE_RANGE, &range);
+}
+
+// Return -1 if fail
+int copy_file(int src, int dst) {
+    ssize_t n;
+    while ((n = copy_file_range(src, NULL, dst, NULL, 1 << 20, 0)) > 0);
+    if (n == 0) return 0;
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL) return -1;
+
+    char buf[1 << 16];
+    while ((n = read(src, buf, sizeof(buf))) > 0) {
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(dst, buf + done, n - done);
+            if (w < 0) return -1;
+            done += w;
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int mode = REFLINK_AUTO;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) switch (opt) {
+        case 'r':
+            if (strcmp(optarg, "always") == 0) mode = REFLINK_ALWAYS;
+            else if (strcmp(optarg, "auto") == 0) mode = REFLINK_AUTO;
+            else if (strcmp(optarg, "never") == 0) mode = REFLINK_NEVER;
+            else exit(1);
+            break;
+        default:
+            exit(1);
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-r always|auto|never] src dst\n", argv[0]);
+        exit(1);
+    }
+
+    int src = open(argv[optind], O_RDONLY);
+    if (src < 0) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    int dst = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst < 0) {
+        perror(argv[optind + 1]);
+        exit(1);
+    }
+
+    if (mode != REFLINK_NEVER && clone_file(src, dst) == 0) {
+        close(src);
+        close(dst);
+        return 0;
+    }
+    if (mode == REFLINK_ALWAYS) {
+        perror("clone failed");
+        exit(1);
+    }
+
+    if (copy_file(src, dst) < 0) {
+        perror("copy failed");
+        exit(1);
+    }
+    close(src);
+    close(dst);
+    return 0;
+}
@@ -0,0 +1,896 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "wfs.h"
+
+// Check a wfs array offline and optionally repair it.
+//
+// usage: wfs-fsck [-r] [-j] [-t threads] disk...
+//
+// -r repairs what it finds, -j prints a JSON report instead of one line per
+// problem, -t sets the number of threads (default: one per online cpu).
+// Disks are checked in parallel against the first present one, inodes and
+// data blocks are split into ranges that threads check in parallel.
+//
+// Exit status follows e2fsck: 0 clean, 1 every problem was repaired, 4
+// problems are left, 8 the images could not be checked.
+
+#define MAX_PROBLEMS (1000)  /* Problems listed in the report, all are counted */
+#define MAX_THREADS  (64)
+
+#define MAX_FILE_SIZE ((off_t)(D_BLOCK + 1 + BLOCK_SIZE / sizeof(off_t)) * BLOCK_SIZE)
+
+enum {
+    CHECK_SUPERBLOCK,
+    CHECK_MIRRORS,
+    CHECK_INODES,
+    CHECK_DIRECTORIES,
+    CHECK_LINKS,
+    CHECK_BITMAPS,
+    CHECK_REFS,
+    CHECK_GROUPS,
+    CHECK_PARITY,
+    CHECK_COUNT
+};
+
+const char *check_names[CHECK_COUNT] = {
+    "superblock", "mirrors", "inodes", "directories", "links", "bitmaps", "refs", "groups", "parity"
+};
+
+struct problem {
+    int check;
+    int repaired;
+    char what[160];
+};
+
+struct wfs_sb *sb;
+void *disks[MAX_DISK];
+off_t disk_sizes[MAX_DISK];
+const char *disk_names[MAX_DISK];
+int disk_cnt;
+int primary = -1;
+int repair = 0;
+int threads = 1;
+
+uint32_t *paths;     /* Block pointers to each data block, live and snapshot trees */
+uint32_t *links;     /* Dentries naming each inode */
+uint32_t *entries;   /* Dentries in each directory */
+uint32_t crc_table[256];
+
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+struct problem problems[MAX_PROBLEMS];
+int problem_cnt = 0;
+int found[CHECK_COUNT];
+int fixed[CHECK_COUNT];
+
+int orphans[MAX_PROBLEMS];
+int orphan_cnt = 0;
+
+// Record a problem, repaired says whether it was fixed
+void report(int check, int repaired, const char *fmt, ...) {
+    pthread_mutex_lock(&report_lock);
+    found[check]++;
+    if (repaired) fixed[check]++;
+    if (problem_cnt < MAX_PROBLEMS) {
+        struct problem *p = &problems[problem_cnt++];
+        p->check = check;
+        p->repaired = repaired;
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(p->what, sizeof(p->what), fmt, ap);
+        va_end(ap);
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+// Same crc32 wfs keeps for raid 5 blocks
+uint32_t block_checksum(const void *block) {
+    const uint8_t *p = (const uint8_t *)block;
+    uint32_t c = 0xFFFFFFFF;
+    for (int i = 0; i < BLOCK_SIZE; i++) c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+uint32_t *checksums(int disk) {
+    return (uint32_t *)((char *)disks[disk] + sb->csum_ptr);
+}
+
+int raid10_groups() {
+    return sb->disk_cnt / sb->raid_width;
+}
+
+int raid5_parity_disk(off_t stripe) {
+    return sb->disk_cnt - 1 - stripe % sb->disk_cnt;
+}
+
+int raid5_data_disk(off_t b) {
+    off_t stripe = b / (sb->disk_cnt - 1);
+    return (raid5_parity_disk(stripe) + 1 + b % (sb->disk_cnt - 1)) % sb->disk_cnt;
+}
+
+// Return NULL if disk is missing
+char *raid5_addr(int disk, off_t stripe) {
+    if (disks[disk] == NULL) return NULL;
+    return (char *)disks[disk] + sb->d_blocks_ptr + stripe * BLOCK_SIZE;
+}
+
+// Copy of data block b that wfs reads
+// Return NULL if no present disk holds it
+char *block_addr(off_t b) {
+    int n = sb->disk_cnt;
+    if (sb->raid_mode == 0) {
+        if (disks[b % n] == NULL) return NULL;
+        return (char *)disks[b % n] + sb->d_blocks_ptr + (b / n) * BLOCK_SIZE;
+    } else if (sb->raid_mode == 5) {
+        return raid5_addr(raid5_data_disk(b), b / (n - 1));
+    } else if (sb->raid_mode == 10) {
+        int first = (b % raid10_groups()) * sb->raid_width;
+        for (int d = first; d < first + sb->raid_width; d++) {
+            if (disks[d] != NULL) return (char *)disks[d] + sb->d_blocks_ptr + (b / raid10_groups()) * BLOCK_SIZE;
+        }
+        return NULL;
+    }
+    return (char *)disks[primary] + sb->d_blocks_ptr + b * BLOCK_SIZE;
+}
+
+// Recompute the parity of a raid 5 stripe from its data blocks
+// Return -1 if a member is missing
+int fix_parity(off_t stripe) {
+    char *parity = raid5_addr(raid5_parity_disk(stripe), stripe);
+    if (parity == NULL) return -1;
+
+    char acc[BLOCK_SIZE] = {0};
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        if (d == raid5_parity_disk(stripe)) continue;
+        char *data = raid5_addr(d, stripe);
+        if (data == NULL) return -1;
+        for (int i = 0; i < BLOCK_SIZE; i++) acc[i] ^= data[i];
+    }
+    memcpy(parity, acc, BLOCK_SIZE);
+    return 0;
+}
+
+// Write every copy of data block b, keeping raid 5 parity and checksums current
+// No Return
+void write_block(off_t b, const void *buf) {
+    int n = sb->disk_cnt;
+    if (sb->raid_mode == 0) {
+        if (disks[b % n] != NULL) memcpy((char *)disks[b % n] + sb->d_blocks_ptr + (b / n) * BLOCK_SIZE, buf, BLOCK_SIZE);
+    } else if (sb->raid_mode == 5) {
+        char *data = raid5_addr(raid5_data_disk(b), b / (n - 1));
+        if (data != NULL) memcpy(data, buf, BLOCK_SIZE);
+        fix_parity(b / (n - 1));
+        for (int d = 0; d < n; d++) {
+            if (disks[d] != NULL) checksums(d)[b] = block_checksum(buf);
+        }
+    } else if (sb->raid_mode == 10) {
+        int first = (b % raid10_groups()) * sb->raid_width;
+        for (int d = first; d < first + sb->raid_width; d++) {
+            if (disks[d] != NULL) memcpy((char *)disks[d] + sb->d_blocks_ptr + (b / raid10_groups()) * BLOCK_SIZE, buf, BLOCK_SIZE);
+        }
+    } else {
+        for (int d = 0; d < n; d++) {
+            if (disks[d] != NULL) memcpy((char *)disks[d] + sb->d_blocks_ptr + b * BLOCK_SIZE, buf, BLOCK_SIZE);
+        }
+    }
+}
+
+int test_bit(const uint8_t *map, off_t i) {
+    return (map[i / 8] >> (i % 8)) & 1;
+}
+
+uint8_t *inode_bitmap() {
+    return (uint8_t *)disks[primary] + sb->i_bitmap_ptr;
+}
+
+// Raid 0 keeps each disk's blocks in that disk's own bitmap
+uint8_t *block_bitmap(off_t b) {
+    int disk = sb->raid_mode == 0 ? b % sb->disk_cnt : primary;
+    return (uint8_t *)disks[disk] + sb->d_bitmap_ptr;
+}
+
+struct wfs_inode *inode_at(int n) {
+    return (struct wfs_inode *)((char *)disks[primary] + sb->i_blocks_ptr + (off_t)n * BLOCK_SIZE);
+}
+
+off_t snapshot_table_offset() {
+    off_t bitmap_size = sb->d_bitmap_ptr - sb->i_bitmap_ptr;
+    return BLOCK_SIZE + (bitmap_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+char *snapshot_slot(int slot) {
+    return (char *)disks[primary] + sb->snap_ptr + slot * sb->snap_size;
+}
+
+// Bytes of each image the filesystem uses, like image_size in wfs
+off_t image_size() {
+    if (sb->wib_ptr != 0) return sb->wib_ptr + ((sb->num_data_blocks + sb->wib_chunk - 1) / sb->wib_chunk + 8) / 8;
+    if (sb->snap_ptr != 0) return sb->snap_ptr + sb->snap_cnt * sb->snap_size;
+    if (sb->refs_ptr != 0) return sb->refs_ptr + sb->num_data_blocks * sizeof(uint32_t);
+    return sb->groups_ptr + sb->group_cnt * sizeof(struct wfs_group);
+}
+
+// Split [0, count) into one range per thread, starts aligned to align, and run fn on each
+struct range {
+    off_t start;
+    off_t end;
+    int disk;
+};
+
+void parallel(void *(*fn)(void *), off_t count, off_t align) {
+    pthread_t tids[MAX_THREADS];
+    struct range ranges[MAX_THREADS];
+    off_t per = (count + threads - 1) / threads;
+    per = (per + align - 1) / align * align;
+    if (per == 0) per = align;
+
+    int started = 0;
+    for (off_t start = 0; start < count && started < MAX_THREADS; start += per) {
+        ranges[started].start = start;
+        ranges[started].end = start + per < count ? start + per : count;
+        if (pthread_create(&tids[started], NULL, fn, &ranges[started]) != 0) {
+            fn(&ranges[started]);
+            continue;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+}
+
+// Superblocks must match on every disk apart from the mount index
+// Return -1 if the layout is unusable
+int check_superblocks() {
+    if (sb->i_bitmap_ptr < (off_t)sizeof(struct wfs_sb) || sb->d_bitmap_ptr < sb->i_bitmap_ptr ||
+        sb->i_blocks_ptr < sb->d_bitmap_ptr || sb->d_blocks_ptr < sb->i_blocks_ptr + (off_t)(sb->num_inodes * BLOCK_SIZE) ||
+        sb->disk_cnt < 1 || sb->disk_cnt > MAX_DISK) {
+        fprintf(stderr, "superblock layout is invalid\n");
+        return -1;
+    }
+    if (sb->raid_mode == 10 && (sb->raid_width < 1 || sb->disk_cnt % sb->raid_width != 0)) {
+        fprintf(stderr, "raid 10 width %d does not divide %d disks\n", sb->raid_width, sb->disk_cnt);
+        return -1;
+    }
+
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        if (disks[d] == NULL) {
+            report(CHECK_SUPERBLOCK, 0, "disk %d is missing", d);
+            continue;
+        }
+        if (disk_sizes[d] < image_size()) {
+            fprintf(stderr, "%s is smaller than the filesystem\n", disk_names[d]);
+            return -1;
+        }
+
+        struct wfs_sb copy = *(struct wfs_sb *)disks[d];
+        copy.mount_index = sb->mount_index;
+        if (memcmp(&copy, sb, sizeof(struct wfs_sb)) != 0) {
+            if (repair) {
+                memcpy(disks[d], sb, sizeof(struct wfs_sb));
+                ((struct wfs_sb *)disks[d])->mount_index = d;
+            }
+            report(CHECK_SUPERBLOCK, repair, "superblock of %s differs from %s", disk_names[d], disk_names[primary]);
+        }
+    }
+    return 0;
+}
+
+// Count the differing BLOCK_SIZE chunks of [off, off + len) between disk and the primary
+off_t compare_region(int disk, off_t off, off_t len) {
+    off_t diff = 0;
+    for (off_t at = 0; at < len; at += BLOCK_SIZE) {
+        off_t n = len - at < BLOCK_SIZE ? len - at : BLOCK_SIZE;
+        if (memcmp((char *)disks[disk] + off + at, (char *)disks[primary] + off + at, n) != 0) diff++;
+    }
+    return diff;
+}
+
+// Metadata every disk mirrors, as offset and length pairs
+int mirrored_regions(off_t *offs, off_t *lens) {
+    int n = 0;
+    offs[n] = sb->i_bitmap_ptr;
+    lens[n++] = sb->d_bitmap_ptr - sb->i_bitmap_ptr;
+    if (sb->raid_mode != 0) {
+        offs[n] = sb->d_bitmap_ptr;
+        lens[n++] = sb->i_blocks_ptr - sb->d_bitmap_ptr;
+    }
+    offs[n] = sb->i_blocks_ptr;
+    lens[n++] = sb->num_inodes * BLOCK_SIZE;
+    if (sb->raid_mode == 5) {
+        offs[n] = sb->csum_ptr;
+        lens[n++] = sb->num_data_blocks * sizeof(uint32_t);
+    }
+    offs[n] = sb->groups_ptr;
+    lens[n++] = sb->group_cnt * sizeof(struct wfs_group);
+    if (sb->refs_ptr != 0) {
+        offs[n] = sb->refs_ptr;
+        lens[n++] = sb->num_data_blocks * sizeof(uint32_t);
+    }
+    return n;
+}
+
+const char *region_names[] = {"inode bitmap", "block bitmap", "inodes", "checksums", "groups", "refs"};
+
+const char *region_name(off_t off) {
+    if (off == sb->i_bitmap_ptr) return region_names[0];
+    if (off == sb->d_bitmap_ptr) return region_names[1];
+    if (off == sb->i_blocks_ptr) return region_names[2];
+    if (off == sb->csum_ptr) return region_names[3];
+    if (off == sb->groups_ptr) return region_names[4];
+    return region_names[5];
+}
+
+void *check_mirror(void *arg) {
+    struct range *r = arg;
+    off_t offs[8], lens[8];
+    int n = mirrored_regions(offs, lens);
+    for (int i = 0; i < n; i++) {
+        off_t diff = compare_region(r->disk, offs[i], lens[i]);
+        // Repaired by the final copy from the primary
+        if (diff > 0) report(CHECK_MIRRORS, repair, "%s of %s differs from %s in %ld blocks", region_name(offs[i]), disk_names[r->disk], disk_names[primary], (long)diff);
+    }
+    return NULL;
+}
+
+// Other disks against the primary, one thread per disk
+void check_mirrors() {
+    pthread_t tids[MAX_DISK];
+    struct range ranges[MAX_DISK];
+    int started[MAX_DISK] = {0};
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        if (d == primary || disks[d] == NULL) continue;
+        ranges[d].disk = d;
+        if (pthread_create(&tids[d], NULL, check_mirror, &ranges[d]) == 0) started[d] = 1;
+        else check_mirror(&ranges[d]);
+    }
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        if (started[d]) pthread_join(tids[d], NULL);
+    }
+}
+
+// Check one block pointer, counting it if it is valid
+// Return 1 if the pointer was cleared
+int check_pointer(off_t *ptr, int n, int allow_compressed, int live) {
+    if (*ptr == -1 || (allow_compressed && *ptr == COMPRESSED_BLOCK)) return 0;
+    if (*ptr < 0 || *ptr >= (off_t)sb->num_data_blocks) {
+        if (live) report(CHECK_INODES, repair, "inode %d points at block %ld outside the data region", n, (long)*ptr);
+        else report(CHECK_INODES, 0, "snapshot inode %d points at block %ld outside the data region", n, (long)*ptr);
+        if (repair && live) {
+            *ptr = -1;
+            return 1;
+        }
+        return 0;
+    }
+    __atomic_add_fetch(&paths[*ptr], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Count the blocks inode n reaches, fixing bad pointers of live inodes
+// No Return
+void walk_blocks(struct wfs_inode *inode, int n, int live) {
+    if (inode->flags & WFS_INODE_INLINE) return;
+    int reg = S_ISREG(inode->mode);
+    for (int i = 0; i <= D_BLOCK; i++) check_pointer(&inode->blocks[i], n, reg, live);
+
+    off_t ind_blk = inode->blocks[IND_BLOCK];
+    if (ind_blk == -1 || check_pointer(&inode->blocks[IND_BLOCK], n, 0, live)) return;
+    if (ind_blk < 0 || ind_blk >= (off_t)sb->num_data_blocks) return;
+
+    char *addr = block_addr(ind_blk);
+    if (addr == NULL) return;
+    off_t ind[BLOCK_SIZE / sizeof(off_t)];
+    memcpy(ind, addr, BLOCK_SIZE);
+    int cleared = 0;
+    for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) cleared += check_pointer(&ind[i], n, reg, live);
+    if (cleared) write_block(ind_blk, ind);
+}
+
+// Entries of directory n, dropping ones that name free inodes
+// No Return
+void walk_dentries(struct wfs_inode *dir, int n) {
+    for (int i = 0; i <= D_BLOCK; i++) {
+        off_t b = dir->blocks[i];
+        if (b < 0 || b >= (off_t)sb->num_data_blocks) continue;
+        char *addr = block_addr(b);
+        if (addr == NULL) continue;
+
+        struct wfs_dentry block[BLOCK_SIZE / sizeof(struct wfs_dentry)];
+        memcpy(block, addr, BLOCK_SIZE);
+        int cleared = 0;
+        for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+            int num = block[j].num;
+            if (num == 0) continue;
+            if (num < 0 || num >= (int)sb->num_inodes || !test_bit(inode_bitmap(), num)) {
+                char name[MAX_NAME + 1] = {0};
+                memcpy(name, block[j].name, MAX_NAME);
+                report(CHECK_DIRECTORIES, repair, "directory %d entry %s names free inode %d", n, name, num);
+                if (repair) {
+                    block[j].num = 0;
+                    cleared = 1;
+                }
+                continue;
+            }
+            __atomic_add_fetch(&links[num], 1, __ATOMIC_RELAXED);
+            entries[n]++;
+        }
+        if (cleared) write_block(b, block);
+    }
+}
+
+void *check_inodes(void *arg) {
+    struct range *r = arg;
+    uint8_t *bitmap = inode_bitmap();
+    for (off_t n = r->start; n < r->end; n++) {
+        if (!test_bit(bitmap, n)) continue;
+        struct wfs_inode *inode = inode_at(n);
+
+        if (inode->num != n) {
+            report(CHECK_INODES, repair, "inode %ld records number %d", (long)n, inode->num);
+            if (repair) inode->num = n;
+        }
+        if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode)) {
+            report(CHECK_INODES, 0, "inode %ld has mode %o, neither file nor directory", (long)n, (unsigned int)inode->mode);
+            continue;
+        }
+
+        off_t max = (inode->flags & WFS_INODE_INLINE) ? (off_t)INLINE_SIZE : MAX_FILE_SIZE;
+        if (inode->size < 0 || inode->size > max) {
+            report(CHECK_INODES, repair, "inode %ld has size %ld, at most %ld fits", (long)n, (long)inode->size, (long)max);
+            if (repair) inode->size = inode->size < 0 ? 0 : max;
+        }
+
+        walk_blocks(inode, n, 1);
+        if (S_ISDIR(inode->mode)) walk_dentries(inode, n);
+    }
+    return NULL;
+}
+
+// Blocks of every used snapshot slot are counted, the trees are read only
+void *check_snapshot_inodes(void *arg) {
+    struct range *r = arg;
+    for (int slot = 0; slot < sb->snap_cnt; slot++) {
+        struct wfs_snapshot *snap = (struct wfs_snapshot *)snapshot_slot(slot);
+        if (!snap->used) continue;
+
+        uint8_t *bitmap = (uint8_t *)snapshot_slot(slot) + BLOCK_SIZE;
+        for (off_t n = r->start; n < r->end; n++) {
+            if (!test_bit(bitmap, n)) continue;
+            walk_blocks((struct wfs_inode *)(snapshot_slot(slot) + snapshot_table_offset() + n * BLOCK_SIZE), n, 0);
+        }
+    }
+    return NULL;
+}
+
+// Files have one link per dentry, directories also count their own entries
+// and the root starts at 2. wfs does not take the link back when a file is
+// unlinked from a directory, so a directory may have more links than that
+// but never fewer
+void *check_links(void *arg) {
+    struct range *r = arg;
+    uint8_t *bitmap = inode_bitmap();
+    for (off_t n = r->start; n < r->end; n++) {
+        if (!test_bit(bitmap, n)) continue;
+        struct wfs_inode *inode = inode_at(n);
+
+        if (n != 0 && links[n] == 0) {
+            pthread_mutex_lock(&report_lock);
+            if (orphan_cnt < MAX_PROBLEMS) orphans[orphan_cnt++] = n;
+            pthread_mutex_unlock(&report_lock);
+            continue;
+        }
+
+        int want = links[n];
+        int dir = S_ISDIR(inode->mode);
+        if (dir) want += entries[n] + (n == 0 ? 2 : 0);
+        if (dir ? inode->nlinks < want : inode->nlinks != want) {
+            report(CHECK_LINKS, repair, "inode %ld has %d links, %d dentries name it", (long)n, inode->nlinks, want);
+            if (repair) inode->nlinks = want;
+        }
+    }
+    return NULL;
+}
+
+// Valid block pointers of an inode, the indirect block included
+// Return the number of blocks
+int inode_blocks(struct wfs_inode *inode, off_t *out) {
+    int cnt = 0;
+    if (inode->flags & WFS_INODE_INLINE) return 0;
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (inode->blocks[i] >= 0 && inode->blocks[i] < (off_t)sb->num_data_blocks) out[cnt++] = inode->blocks[i];
+    }
+
+    off_t ind_blk = inode->blocks[IND_BLOCK];
+    char *addr = ind_blk >= 0 && ind_blk < (off_t)sb->num_data_blocks ? block_addr(ind_blk) : NULL;
+    if (addr == NULL) return cnt;
+    off_t ind[BLOCK_SIZE / sizeof(off_t)];
+    memcpy(ind, addr, BLOCK_SIZE);
+    for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+        if (ind[i] >= 0 && ind[i] < (off_t)sb->num_data_blocks) out[cnt++] = ind[i];
+    }
+    return cnt;
+}
+
+// An orphan that is not a file or directory, or that points at blocks
+// another inode owns, is a freed inode whose bitmap bit came back. It is
+// released rather than linked in.
+// Return 1 if the orphan was released
+int release_stale(int n) {
+    struct wfs_inode *inode = inode_at(n);
+    uint32_t *refs = sb->refs_ptr != 0 ? (uint32_t *)((char *)disks[primary] + sb->refs_ptr) : NULL;
+    off_t blocks[N_BLOCKS + BLOCK_SIZE / sizeof(off_t)];
+    int cnt = S_ISDIR(inode->mode) || S_ISREG(inode->mode) ? inode_blocks(inode, blocks) : 0;
+
+    int stale = !S_ISDIR(inode->mode) && !S_ISREG(inode->mode);
+    for (int i = 0; i < cnt && !stale; i++) stale = paths[blocks[i]] > (refs != NULL ? refs[blocks[i]] : 0) + 1;
+    if (!stale) return 0;
+
+    report(CHECK_DIRECTORIES, repair, "inode %d is not in any directory and shares its blocks, releasing it", n);
+    if (!repair) return 1;
+    for (int i = 0; i < cnt; i++) paths[blocks[i]]--;
+    inode_bitmap()[n / 8] &= ~(1 << (n % 8));
+    return 1;
+}
+
+// Give an orphan a dentry in the root directory named #<inode>
+// Return -1 if the root has no free dentry
+int reconnect(int n) {
+    struct wfs_inode *root = inode_at(0);
+    for (int i = 0; i <= D_BLOCK; i++) {
+        off_t b = root->blocks[i];
+        if (b < 0 || b >= (off_t)sb->num_data_blocks) continue;
+        char *addr = block_addr(b);
+        if (addr == NULL) continue;
+
+        struct wfs_dentry block[BLOCK_SIZE / sizeof(struct wfs_dentry)];
+        memcpy(block, addr, BLOCK_SIZE);
+        for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+            if (block[j].num != 0) continue;
+            block[j].num = n;
+            snprintf(block[j].name, MAX_NAME, "#%d", n);
+            write_block(b, block);
+            root->nlinks++;
+            inode_at(n)->nlinks = S_ISDIR(inode_at(n)->mode) ? 1 + entries[n] : 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Bitmaps against the pointers found, and the refs table against the
+// number of pointers to each block
+void *check_blocks(void *arg) {
+    struct range *r = arg;
+    uint32_t *refs = sb->refs_ptr != 0 ? (uint32_t *)((char *)disks[primary] + sb->refs_ptr) : NULL;
+    for (off_t b = r->start; b < r->end; b++) {
+        uint8_t *bitmap = block_bitmap(b);
+        int marked = test_bit(bitmap, b);
+
+        if (paths[b] > 0 && !marked) {
+            report(CHECK_BITMAPS, repair, "block %ld is in use but free in the bitmap", (long)b);
+            if (repair) bitmap[b / 8] |= 1 << (b % 8);
+        } else if (paths[b] == 0 && marked) {
+            report(CHECK_BITMAPS, repair, "block %ld is allocated but nothing points at it", (long)b);
+            if (repair) {
+                // Raid 5 keeps free blocks zeroed so their stripes keep valid parity
+                if (sb->raid_mode == 5) {
+                    char zero[BLOCK_SIZE] = {0};
+                    write_block(b, zero);
+                }
+                bitmap[b / 8] &= ~(1 << (b % 8));
+            }
+        }
+
+        uint32_t want = paths[b] > 0 ? paths[b] - 1 : 0;
+        if (refs != NULL && refs[b] != want) {
+            report(CHECK_REFS, repair, "block %ld has %u extra references, %u are held", (long)b, refs[b], want);
+            if (repair) refs[b] = want;
+        } else if (refs == NULL && paths[b] > 1) {
+            report(CHECK_REFS, 0, "block %ld is pointed at %u times without reference counts", (long)b, paths[b]);
+        }
+    }
+    return NULL;
+}
+
+// Free counts of every allocation group, recounted from the bitmaps
+void check_groups() {
+    struct wfs_group *table = (struct wfs_group *)((char *)disks[primary] + sb->groups_ptr);
+    for (int g = 0; g < sb->group_cnt; g++) {
+        struct wfs_group want = {0};
+        for (off_t b = (off_t)g * sb->group_blocks; b < (off_t)(g + 1) * sb->group_blocks && b < (off_t)sb->num_data_blocks; b++) {
+            if (!test_bit(block_bitmap(b), b)) want.free_blocks++;
+        }
+        for (off_t n = (off_t)g * sb->group_inodes; n < (off_t)(g + 1) * sb->group_inodes && n < (off_t)sb->num_inodes; n++) {
+            if (!test_bit(inode_bitmap(), n)) want.free_inodes++;
+            else if (S_ISDIR(inode_at(n)->mode)) want.dirs++;
+        }
+        if (memcmp(&want, &table[g], sizeof(want)) != 0) {
+            report(CHECK_GROUPS, repair, "group %d counts %d free blocks %d free inodes %d dirs, bitmaps say %d %d %d",
+                   g, table[g].free_blocks, table[g].free_inodes, table[g].dirs, want.free_blocks, want.free_inodes, want.dirs);
+            if (repair) table[g] = want;
+        }
+    }
+}
+
+// Raid 5 stripes must xor to zero and used data blocks must match their
+// checksums, free blocks were never summed. A stripe with one bad checksum is rebuilt from parity, a stripe whose
+// checksums all match gets new parity.
+void *check_parity(void *arg) {
+    struct range *r = arg;
+    int n = sb->disk_cnt;
+    uint8_t *bitmap = block_bitmap(0);
+    for (off_t stripe = r->start; stripe < r->end; stripe++) {
+        char acc[BLOCK_SIZE] = {0};
+        int bad_disk = -1, bad_cnt = 0;
+        for (int d = 0; d < n; d++) {
+            char *blk = raid5_addr(d, stripe);
+            for (int i = 0; i < BLOCK_SIZE; i++) acc[i] ^= blk[i];
+            if (d == raid5_parity_disk(stripe)) continue;
+
+            off_t b = stripe * (n - 1) + (d - raid5_parity_disk(stripe) - 1 + n) % n;
+            if (b >= (off_t)sb->num_data_blocks || !test_bit(bitmap, b)) continue;
+            if (block_checksum(blk) != checksums(primary)[b]) {
+                bad_disk = d;
+                bad_cnt++;
+            }
+        }
+
+        int parity_ok = 1;
+        for (int i = 0; i < BLOCK_SIZE && parity_ok; i++) parity_ok = acc[i] == 0;
+        if (parity_ok && bad_cnt == 0) continue;
+
+        if (!parity_ok && bad_cnt == 1) {
+            // The stripe xor is the damage to the bad block, undo it
+            report(CHECK_PARITY, repair, "stripe %ld: block on %s fails its checksum", (long)stripe, disk_names[bad_disk]);
+            if (repair) {
+                char *blk = raid5_addr(bad_disk, stripe);
+                for (int i = 0; i < BLOCK_SIZE; i++) blk[i] ^= acc[i];
+            }
+        } else if (!parity_ok && bad_cnt == 0) {
+            report(CHECK_PARITY, repair, "stripe %ld: parity does not match its data", (long)stripe);
+            if (repair) fix_parity(stripe);
+        } else if (parity_ok) {
+            // Data and parity agree, the checksums are what is stale
+            report(CHECK_PARITY, repair, "stripe %ld: %d checksums do not match consistent data", (long)stripe, bad_cnt);
+            if (repair) {
+                for (int d = 0; d < n; d++) {
+                    if (d == raid5_parity_disk(stripe)) continue;
+                    off_t b = stripe * (n - 1) + (d - raid5_parity_disk(stripe) - 1 + n) % n;
+                    if (b < (off_t)sb->num_data_blocks && test_bit(bitmap, b)) {
+                        checksums(primary)[b] = block_checksum(raid5_addr(d, stripe));
+                    }
+                }
+            }
+        } else {
+            report(CHECK_PARITY, 0, "stripe %ld: %d blocks fail their checksums, parity can not rebuild them", (long)stripe, bad_cnt);
+        }
+    }
+    return NULL;
+}
+
+// Copy the primary's metadata over the other disks after repairs
+// No Return
+void mirror_metadata() {
+    off_t offs[8], lens[8];
+    int n = mirrored_regions(offs, lens);
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        if (d == primary || disks[d] == NULL) continue;
+        for (int i = 0; i < n; i++) memcpy((char *)disks[d] + offs[i], (char *)disks[primary] + offs[i], lens[i]);
+    }
+}
+
+// No Return
+void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", *s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+// No Return
+void print_json(double seconds, off_t used_inodes, off_t used_blocks) {
+    int total = 0, total_fixed = 0;
+    for (int c = 0; c < CHECK_COUNT; c++) {
+        total += found[c];
+        total_fixed += fixed[c];
+    }
+
+    printf("{\n  \"disks\": [");
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        if (d > 0) printf(", ");
+        if (disks[d] == NULL) printf("null");
+        else print_json_string(disk_names[d]);
+    }
+    printf("],\n  \"raid_mode\": %d,\n  \"repair\": %s,\n", sb->raid_mode, repair ? "true" : "false");
+    printf("  \"inodes\": {\"total\": %zu, \"used\": %ld},\n", sb->num_inodes, (long)used_inodes);
+    printf("  \"blocks\": {\"total\": %zu, \"used\": %ld},\n", sb->num_data_blocks, (long)used_blocks);
+    printf("  \"checks\": {");
+    for (int c = 0; c < CHECK_COUNT; c++) {
+        printf("%s\n    \"%s\": {\"found\": %d, \"repaired\": %d}", c ? "," : "", check_names[c], found[c], fixed[c]);
+    }
+    printf("\n  },\n  \"problems\": [");
+    for (int i = 0; i < problem_cnt; i++) {
+        printf("%s\n    {\"check\": \"%s\", \"problem\": ", i ? "," : "", check_names[problems[i].check]);
+        print_json_string(problems[i].what);
+        printf(", \"repaired\": %s}", problems[i].repaired ? "true" : "false");
+    }
+    printf("%s],\n  \"truncated\": %s,\n", problem_cnt ? "\n  " : "", total > problem_cnt ? "true" : "false");
+    printf("  \"found\": %d,\n  \"repaired\": %d,\n  \"seconds\": %.3f\n}\n", total, total_fixed, seconds);
+}
+
+// Take the lock wfs holds while mounted, waiting for a wfs that is still exiting
+// Return -1 if the disk stays in use
+int lock_disk(int fd) {
+    for (int tries = 0; flock(fd, LOCK_EX | LOCK_NB) < 0; tries++) {
+        if (errno != EWOULDBLOCK || tries == LOCK_WAIT * 10) return -1;
+        usleep(100000);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int json = 0;
+    int opt;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "rjt:")) != -1) switch (opt) {
+        case 'r':
+            repair = 1;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r] [-j] [-t threads] disk...\n", argv[0]);
+            exit(8);
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (optind == argc || argc - optind > MAX_DISK) {
+        fprintf(stderr, "usage: %s [-r] [-j] [-t threads] disk...\n", argv[0]);
+        exit(8);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Map the disks in mount index order, like wfs does
+    int timestamp = 0;
+    for (int i = optind; i < argc; i++) {
+        int fd = open(argv[i], repair ? O_RDWR : O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(argv[i]);
+            exit(8);
+        }
+        // A repair keeps the disk open and locked until it exits
+        if (repair && lock_disk(fd) < 0) {
+            fprintf(stderr, "%s: in use by a mounted wfs\n", argv[i]);
+            exit(8);
+        }
+        void *map = mmap(NULL, st.st_size, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (!repair) close(fd);
+        if (map == MAP_FAILED || st.st_size < (off_t)sizeof(struct wfs_sb)) {
+            fprintf(stderr, "%s: can not map a superblock\n", argv[i]);
+            exit(8);
+        }
+
+        struct wfs_sb *disk_sb = map;
+        if (disk_sb->magic != WFS_MAGIC || disk_sb->version != WFS_VERSION) {
+            fprintf(stderr, "%s: not a version %d wfs disk, re-run mkfs on the array\n", argv[i], WFS_VERSION);
+            exit(8);
+        }
+        if (disk_sb->mount_index < 0 || disk_sb->mount_index >= MAX_DISK || disks[disk_sb->mount_index] != NULL) {
+            fprintf(stderr, "%s: invalid or duplicate mount index %d\n", argv[i], disk_sb->mount_index);
+            exit(8);
+        }
+        if (i > optind && disk_sb->timestamp != timestamp) {
+            fprintf(stderr, "%s: not from the same mkfs run\n", argv[i]);
+            exit(8);
+        }
+        timestamp = disk_sb->timestamp;
+        disks[disk_sb->mount_index] = map;
+        disk_sizes[disk_sb->mount_index] = st.st_size;
+        disk_names[disk_sb->mount_index] = argv[i];
+        disk_cnt++;
+    }
+    // The newest disk is the reference, one that missed a mount holds stale
+    // data only wfs --replace can rebuild
+    for (int d = 0; d < MAX_DISK; d++) {
+        if (disks[d] != NULL && (primary < 0 || ((struct wfs_sb *)disks[d])->generation > ((struct wfs_sb *)disks[primary])->generation)) primary = d;
+    }
+    sb = disks[primary];
+    for (int d = 0; d < MAX_DISK; d++) {
+        if (disks[d] == NULL || ((struct wfs_sb *)disks[d])->generation == sb->generation) continue;
+        report(CHECK_SUPERBLOCK, 0, "%s is stale, generation %d of %d, rebuild it with wfs --replace", disk_names[d],
+               ((struct wfs_sb *)disks[d])->generation, sb->generation);
+        disks[d] = NULL;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+
+    if (check_superblocks() < 0) exit(8);
+
+    paths = calloc(sb->num_data_blocks, sizeof(uint32_t));
+    links = calloc(sb->num_inodes, sizeof(uint32_t));
+    entries = calloc(sb->num_inodes, sizeof(uint32_t));
+    if (paths == NULL || links == NULL || entries == NULL) {
+        perror("calloc");
+        exit(8);
+    }
+
+    check_mirrors();
+    parallel(check_inodes, sb->num_inodes, 8);
+    if (sb->snap_ptr != 0) parallel(check_snapshot_inodes, sb->num_inodes, 8);
+    parallel(check_links, sb->num_inodes, 8);
+
+    for (int i = 0; i < orphan_cnt; i++) {
+        if (release_stale(orphans[i])) continue;
+        int ok = repair && reconnect(orphans[i]) == 0;
+        report(CHECK_DIRECTORIES, ok, "inode %d is not in any directory%s", orphans[i], ok ? ", linked into / as #inode" : "");
+    }
+
+    // Ranges start on bitmap byte boundaries so threads never share a byte
+    parallel(check_blocks, sb->num_data_blocks, 8);
+    check_groups();
+
+    int complete = 1;
+    for (int d = 0; d < sb->disk_cnt; d++) complete &= disks[d] != NULL;
+    if (sb->raid_mode == 5 && !complete) fprintf(stderr, "raid 5 parity is not checked with a disk missing\n");
+    if (sb->raid_mode == 5 && complete) parallel(check_parity, (sb->num_data_blocks + sb->disk_cnt - 2) / (sb->disk_cnt - 1), 1);
+
+    int total = 0, total_fixed = 0;
+    for (int c = 0; c < CHECK_COUNT; c++) {
+        total += found[c];
+        total_fixed += fixed[c];
+    }
+    if (repair && total_fixed > 0) {
+        mirror_metadata();
+
+        // A wfs --cache image closed before the repairs is stale
+        int generation = sb->generation + 1;
+        for (int d = 0; d < sb->disk_cnt; d++) {
+            if (disks[d] != NULL) ((struct wfs_sb *)disks[d])->generation = generation;
+        }
+    }
+
+    off_t used_inodes = 0, used_blocks = 0;
+    for (off_t n = 0; n < (off_t)sb->num_inodes; n++) used_inodes += test_bit(inode_bitmap(), n);
+    for (off_t b = 0; b < (off_t)sb->num_data_blocks; b++) used_blocks += paths[b] > 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (json) {
+        print_json(seconds, used_inodes, used_blocks);
+    } else {
+        for (int i = 0; i < problem_cnt; i++) {
+            printf("%s: %s%s\n", check_names[problems[i].check], problems[i].what, problems[i].repaired ? " (repaired)" : "");
+        }
+        if (total > problem_cnt) printf("... %d more\n", total - problem_cnt);
+        printf("%ld/%zu inodes, %ld/%zu blocks, %d problems, %d repaired, %.3fs\n",
+               (long)used_inodes, sb->num_inodes, (long)used_blocks, sb->num_data_blocks, total, total_fixed, seconds);
+    }
+
+    if (total == 0) return 0;
+    return total == total_fixed ? 1 : 4;
+}
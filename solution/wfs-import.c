@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "wfs.h"
+
+// Copy a host directory tree into a freshly made wfs array without mounting it.
+//
+// usage: wfs-import [-t threads] source disk...
+//
+// The source is walked once to number inodes and lay every file out in one
+// contiguous run of blocks, the order cp -r would create them in. Threads
+// then copy files and dentry blocks straight into the mapped disks, raid 5
+// parity and checksums are computed per stripe, and the metadata is built
+// on the first disk and copied to each of the others once at the end.
+// Nothing is marked used until every file was read, a failed import leaves
+// the array empty.
+
+#define MAX_THREADS  (64)
+#define MAX_FILE_SIZE ((off_t)(D_BLOCK + 1 + BLOCK_SIZE / sizeof(off_t)) * BLOCK_SIZE)
+#define DIR_ENTRIES  (D_BLOCK * (int)(BLOCK_SIZE / sizeof(struct wfs_dentry)))
+
+struct node {
+    char name[MAX_NAME];
+    char *path;
+    struct stat st;
+    int num;              /* Inode number */
+    int first_child;      /* Children are consecutive nodes */
+    int child_cnt;
+    off_t first_block;    /* Start of the node's run, -1 without blocks */
+};
+
+struct wfs_sb *sb;
+void *disks[MAX_DISK];
+const char *disk_names[MAX_DISK];
+int threads = 1;
+time_t now;
+
+struct node *nodes;
+int node_cnt = 0;
+int node_cap = 0;
+int next_node = 0;      /* Work queue of the copy threads */
+int failed = 0;
+
+struct wfs_group *groups;
+int group_cnt, group_blocks, group_inodes;
+off_t next_block = 0;   /* Blocks are handed out in one increasing run */
+uint8_t *ibitmap;       /* Inodes taken so far, written to the disks at the end */
+off_t copied_bytes = 0;
+uint32_t crc_table[256];
+
+// Same crc32 wfs keeps for raid 5 blocks
+uint32_t block_checksum(const void *block) {
+    const uint8_t *p = (const uint8_t *)block;
+    uint32_t c = 0xFFFFFFFF;
+    for (int i = 0; i < BLOCK_SIZE; i++) c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+int raid10_groups() {
+    return sb->disk_cnt / sb->raid_width;
+}
+
+int raid5_parity_disk(off_t stripe) {
+    return sb->disk_cnt - 1 - stripe % sb->disk_cnt;
+}
+
+char *raid5_addr(int disk, off_t stripe) {
+    return (char *)disks[disk] + sb->d_blocks_ptr + stripe * BLOCK_SIZE;
+}
+
+struct wfs_inode *inode_at(int n) {
+    return (struct wfs_inode *)((char *)disks[0] + sb->i_blocks_ptr + (off_t)n * BLOCK_SIZE);
+}
+
+// Write every copy of data block b, raid 5 parity is left to fill_parity
+// No Return
+void put_block(off_t b, const void *buf) {
+    int n = sb->disk_cnt;
+    if (sb->raid_mode == 0) {
+        memcpy((char *)disks[b % n] + sb->d_blocks_ptr + (b / n) * BLOCK_SIZE, buf, BLOCK_SIZE);
+    } else if (sb->raid_mode == 5) {
+        off_t stripe = b / (n - 1);
+        memcpy(raid5_addr((raid5_parity_disk(stripe) + 1 + b % (n - 1)) % n, stripe), buf, BLOCK_SIZE);
+    } else if (sb->raid_mode == 10) {
+        int first = (b % raid10_groups()) * sb->raid_width;
+        for (int d = first; d < first + sb->raid_width; d++) {
+            memcpy((char *)disks[d] + sb->d_blocks_ptr + (b / raid10_groups()) * BLOCK_SIZE, buf, BLOCK_SIZE);
+        }
+    } else {
+        for (int d = 0; d < n; d++) memcpy((char *)disks[d] + sb->d_blocks_ptr + b * BLOCK_SIZE, buf, BLOCK_SIZE);
+    }
+}
+
+// Return the new node's index
+int add_node(const char *name, const char *path, struct stat *st) {
+    if (node_cnt == node_cap) {
+        node_cap = node_cap ? node_cap * 2 : 1024;
+        nodes = realloc(nodes, node_cap * sizeof(struct node));
+        if (nodes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct node *node = &nodes[node_cnt];
+    memset(node, 0, sizeof(struct node));
+    strncpy(node->name, name, MAX_NAME - 1);
+    node->path = strdup(path);
+    node->st = *st;
+    node->num = -1;
+    node->first_block = -1;
+    return node_cnt++;
+}
+
+// Add the entries of directory idx as consecutive nodes, then descend
+// Return -1 if an entry does not fit in wfs
+int scan(int idx) {
+    struct dirent **names;
+    int cnt = scandir(nodes[idx].path, &names, NULL, alphasort);
+    if (cnt < 0) {
+        perror(nodes[idx].path);
+        return -1;
+    }
+
+    int err = 0;
+    nodes[idx].first_child = node_cnt;
+    for (int i = 0; i < cnt; i++) {
+        const char *name = names[i]->d_name;
+        if (err || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        char *path;
+        struct stat st;
+        if (asprintf(&path, "%s/%s", nodes[idx].path, name) < 0) exit(1);
+        if (lstat(path, &st) < 0) {
+            perror(path);
+            err = -1;
+        } else if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "%s: skipped, wfs only holds files and directories\n", path);
+        } else if (idx == 0 && strcmp(name, ".snapshots") == 0 && (sb->features & WFS_FEATURE_SNAPSHOT)) {
+            fprintf(stderr, "%s: skipped, the name is reserved for snapshots\n", path);
+        } else if (strlen(name) >= MAX_NAME) {
+            fprintf(stderr, "%s: name longer than %d bytes\n", path, MAX_NAME - 1);
+            err = -1;
+        } else if (S_ISREG(st.st_mode) && st.st_size > MAX_FILE_SIZE) {
+            fprintf(stderr, "%s: %ld bytes, wfs files hold at most %ld\n", path, (long)st.st_size, (long)MAX_FILE_SIZE);
+            err = -1;
+        } else if (node_cnt - nodes[idx].first_child == DIR_ENTRIES) {
+            fprintf(stderr, "%s: more than %d entries\n", nodes[idx].path, DIR_ENTRIES);
+            err = -1;
+        } else {
+            add_node(name, path, &st);
+            nodes[idx].child_cnt++;
+        }
+        free(path);
+    }
+    for (int i = 0; i < cnt; i++) free(names[i]);
+    free(names);
+
+    for (int i = 0; i < nodes[idx].child_cnt && err == 0; i++) {
+        int child = nodes[idx].first_child + i;
+        if (S_ISDIR(nodes[child].st.st_mode)) err = scan(child);
+    }
+    return err;
+}
+
+// Files go into their parent's group, directories into the group with the
+// most free inodes, as allocate_inode in wfs places them
+// Return -1 if the inodes ran out
+int take_inode(mode_t mode, int parent) {
+    int group = parent / group_inodes;
+    if (S_ISDIR(mode)) {
+        for (int g = 0; g < group_cnt; g++) {
+            if (groups[g].free_inodes > groups[group].free_inodes ||
+                (groups[g].free_inodes == groups[group].free_inodes && groups[g].dirs < groups[group].dirs)) {
+                group = g;
+            }
+        }
+    }
+
+    for (int g = 0; g < group_cnt; g++) {
+        int curr = (group + g) % group_cnt;
+        if (groups[curr].free_inodes == 0) continue;
+        off_t end = (off_t)(curr + 1) * group_inodes;
+        if (end > (off_t)sb->num_inodes) end = sb->num_inodes;
+        for (off_t n = (off_t)curr * group_inodes; n < end; n++) {
+            if (ibitmap[n / 8] & (1 << n % 8)) continue;
+            ibitmap[n / 8] |= 1 << n % 8;
+            groups[curr].free_inodes--;
+            if (S_ISDIR(mode)) groups[curr].dirs++;
+            return n;
+        }
+    }
+    return -1;
+}
+
+// Return the first of count blocks, -1 if the array is full
+off_t take_blocks(off_t count) {
+    if (next_block + count > (off_t)sb->num_data_blocks) {
+        fprintf(stderr, "out of space, %zu blocks are not enough\n", sb->num_data_blocks);
+        return -1;
+    }
+    off_t first = next_block;
+    next_block += count;
+    for (off_t b = first; b < next_block; b++) groups[b / group_blocks].free_blocks--;
+    return first;
+}
+
+int inline_file(struct node *node) {
+    return (sb->features & WFS_FEATURE_INLINE) && node->st.st_size <= (off_t)INLINE_SIZE;
+}
+
+// Data blocks of a file, and its indirect block when it has one
+off_t file_blocks(struct node *node) {
+    if (inline_file(node)) return 0;
+    off_t cnt = (node->st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return cnt > D_BLOCK + 1 ? cnt + 1 : cnt;
+}
+
+// Physical block of logical block lblk, the indirect block sits after the direct ones
+off_t node_block(struct node *node, off_t lblk) {
+    return node->first_block + (lblk <= D_BLOCK ? lblk : lblk + 1);
+}
+
+// Number the children of directory idx and lay out its dentry blocks, then
+// each child's blocks, in the order cp -r creates them
+// Return -1 if the array is too small
+int assign(int idx) {
+    struct node *dir = &nodes[idx];
+    int per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    off_t dir_blocks = (dir->child_cnt + per_block - 1) / per_block;
+    if (dir_blocks > 0 && (dir->first_block = take_blocks(dir_blocks)) < 0) return -1;
+
+    for (int i = 0; i < dir->child_cnt; i++) {
+        struct node *child = &nodes[dir->first_child + i];
+        if ((child->num = take_inode(child->st.st_mode, nodes[idx].num)) < 0) {
+            fprintf(stderr, "out of inodes, %zu are not enough\n", sb->num_inodes);
+            return -1;
+        }
+        if (S_ISDIR(child->st.st_mode)) {
+            if (assign(dir->first_child + i) < 0) return -1;
+            continue;
+        }
+        off_t cnt = file_blocks(child);
+        if (cnt > 0 && (child->first_block = take_blocks(cnt)) < 0) return -1;
+    }
+    return 0;
+}
+
+// Fill the inode of node, and for a file copy its contents into its blocks
+// Return -1 if the source could not be read
+int import_node(struct node *node) {
+    struct wfs_inode *inode = inode_at(node->num);
+    memset(inode, 0, BLOCK_SIZE);
+    inode->num = node->num;
+    inode->mode = node->st.st_mode;
+    inode->uid = node->st.st_uid;
+    inode->gid = node->st.st_gid;
+    inode->atim = node->st.st_atime;
+    inode->mtim = node->st.st_mtime;
+    inode->ctim = now;
+    if ((sb->features & WFS_FEATURE_COMPRESS) && node->num != 0) inode->flags |= WFS_INODE_COMPRESS;
+    for (int i = 0; i < N_BLOCKS; i++) inode->blocks[i] = -1;
+
+    int per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    if (S_ISDIR(node->st.st_mode)) {
+        // One link from the parent's dentry, one per entry, the root starts at 2
+        inode->nlinks = (node->num == 0 ? 2 : 1) + node->child_cnt;
+        for (int i = 0; i * per_block < node->child_cnt; i++) {
+            struct wfs_dentry block[BLOCK_SIZE / sizeof(struct wfs_dentry)];
+            memset(block, 0, BLOCK_SIZE);
+            for (int j = 0; j < per_block && i * per_block + j < node->child_cnt; j++) {
+                struct node *child = &nodes[node->first_child + i * per_block + j];
+                memcpy(block[j].name, child->name, MAX_NAME);
+                block[j].num = child->num;
+            }
+            inode->blocks[i] = node->first_block + i;
+            inode->size += BLOCK_SIZE;
+            put_block(inode->blocks[i], block);
+        }
+        return 0;
+    }
+
+    inode->nlinks = 1;
+    inode->size = node->st.st_size;
+    if (inline_file(node)) inode->flags |= WFS_INODE_INLINE;
+
+    char buf[MAX_FILE_SIZE];
+    int fd = open(node->path, O_RDONLY);
+    if (fd < 0) {
+        perror(node->path);
+        return -1;
+    }
+    off_t done = 0;
+    while (done < node->st.st_size) {
+        ssize_t got = read(fd, buf + done, node->st.st_size - done);
+        if (got <= 0) {
+            if (got == 0) fprintf(stderr, "%s: shrank while importing\n", node->path);
+            else perror(node->path);
+            close(fd);
+            return -1;
+        }
+        done += got;
+    }
+    close(fd);
+    __atomic_add_fetch(&copied_bytes, done, __ATOMIC_RELAXED);
+
+    if (inode->flags & WFS_INODE_INLINE) {
+        memcpy((char *)inode + sizeof(struct wfs_inode), buf, done);
+        return 0;
+    }
+
+    off_t cnt = (done + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    memset(buf + done, 0, cnt * BLOCK_SIZE - done);
+    off_t ind[BLOCK_SIZE / sizeof(off_t)];
+    for (int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) ind[i] = -1;
+    for (off_t lblk = 0; lblk < cnt; lblk++) {
+        off_t b = node_block(node, lblk);
+        if (lblk <= D_BLOCK) inode->blocks[lblk] = b;
+        else ind[lblk - D_BLOCK - 1] = b;
+        put_block(b, buf + lblk * BLOCK_SIZE);
+    }
+    if (cnt > D_BLOCK + 1) {
+        inode->blocks[IND_BLOCK] = node->first_block + D_BLOCK + 1;
+        put_block(inode->blocks[IND_BLOCK], ind);
+    }
+    return 0;
+}
+
+// Take nodes off the shared queue a few at a time until it is empty
+void *import_worker(void *arg) {
+    for (;;) {
+        int start = __atomic_fetch_add(&next_node, 16, __ATOMIC_RELAXED);
+        if (start >= node_cnt) break;
+        int end = start + 16 < node_cnt ? start + 16 : node_cnt;
+        for (int i = start; i < end && !__atomic_load_n(&failed, __ATOMIC_RELAXED); i++) {
+            if (import_node(&nodes[i]) < 0) __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Parity and checksums of the stripes holding blocks [start, end)
+struct range {
+    off_t start;
+    off_t end;
+    int disk;
+};
+
+void *fill_parity(void *arg) {
+    struct range *r = arg;
+    int n = sb->disk_cnt;
+    uint32_t *sums = (uint32_t *)((char *)disks[0] + sb->csum_ptr);
+    for (off_t stripe = r->start; stripe < r->end; stripe++) {
+        int parity_disk = raid5_parity_disk(stripe);
+        char acc[BLOCK_SIZE] = {0};
+        for (int d = 0; d < n; d++) {
+            if (d == parity_disk) continue;
+            char *data = raid5_addr(d, stripe);
+            for (int i = 0; i < BLOCK_SIZE; i++) acc[i] ^= data[i];
+
+            off_t b = stripe * (n - 1) + (d - parity_disk - 1 + n) % n;
+            if (b < next_block) sums[b] = block_checksum(data);
+        }
+        memcpy(raid5_addr(parity_disk, stripe), acc, BLOCK_SIZE);
+    }
+    return NULL;
+}
+
+// Copy what the first disk holds of the metadata to another disk
+void *mirror_disk(void *arg) {
+    struct range *r = arg;
+    char *dst = disks[r->disk];
+    char *src = disks[0];
+
+    memcpy(dst + sb->i_bitmap_ptr, src + sb->i_bitmap_ptr, sb->d_bitmap_ptr - sb->i_bitmap_ptr);
+    if (sb->raid_mode != 0) memcpy(dst + sb->d_bitmap_ptr, src + sb->d_bitmap_ptr, sb->i_blocks_ptr - sb->d_bitmap_ptr);
+    for (int i = 0; i < node_cnt; i++) {
+        off_t off = sb->i_blocks_ptr + (off_t)nodes[i].num * BLOCK_SIZE;
+        memcpy(dst + off, src + off, BLOCK_SIZE);
+    }
+    if (sb->raid_mode == 5) memcpy(dst + sb->csum_ptr, src + sb->csum_ptr, next_block * sizeof(uint32_t));
+    memcpy(dst + sb->groups_ptr, src + sb->groups_ptr, group_cnt * sizeof(struct wfs_group));
+    return NULL;
+}
+
+// Run fn on every disk but the first, one thread each
+// No Return
+void each_mirror(void *(*fn)(void *)) {
+    pthread_t tids[MAX_DISK];
+    struct range ranges[MAX_DISK];
+    for (int d = 1; d < sb->disk_cnt; d++) {
+        ranges[d].disk = d;
+        if (pthread_create(&tids[d], NULL, fn, &ranges[d]) != 0) {
+            fn(&ranges[d]);
+            tids[d] = 0;
+        }
+    }
+    for (int d = 1; d < sb->disk_cnt; d++) {
+        if (tids[d] != 0) pthread_join(tids[d], NULL);
+    }
+}
+
+// Return -1 if the array already holds files
+int check_empty() {
+    uint8_t *i_bitmap = (uint8_t *)disks[0] + sb->i_bitmap_ptr;
+    for (off_t n = 1; n < (off_t)sb->num_inodes; n++) {
+        if (i_bitmap[n / 8] & (1 << n % 8)) return -1;
+    }
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        uint8_t *d_bitmap = (uint8_t *)disks[d] + sb->d_bitmap_ptr;
+        for (off_t i = 0; i < (off_t)(sb->i_blocks_ptr - sb->d_bitmap_ptr); i++) {
+            if (d_bitmap[i] != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Take the lock wfs holds while mounted, waiting for a wfs that is still exiting
+// Return -1 if the disk stays in use
+int lock_disk(int fd) {
+    for (int tries = 0; flock(fd, LOCK_EX | LOCK_NB) < 0; tries++) {
+        if (errno != EWOULDBLOCK || tries == LOCK_WAIT * 10) return -1;
+        usleep(100000);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "t:")) != -1) switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] source disk...\n", argv[0]);
+            exit(1);
+    }
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (argc - optind < 2 || argc - optind - 1 > MAX_DISK) {
+        fprintf(stderr, "usage: %s [-t threads] source disk...\n", argv[0]);
+        exit(1);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    now = time(NULL);
+
+    // Map the disks in mount index order, every member has to be present
+    int timestamp = 0;
+    int disk_cnt = 0;
+    for (int i = optind + 1; i < argc; i++) {
+        int fd = open(argv[i], O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(argv[i]);
+            exit(1);
+        }
+        // Kept open, the lock goes when wfs-import exits
+        if (lock_disk(fd) < 0) {
+            fprintf(stderr, "%s: in use by a mounted wfs\n", argv[i]);
+            exit(1);
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED || st.st_size < (off_t)sizeof(struct wfs_sb)) {
+            fprintf(stderr, "%s: can not map a superblock\n", argv[i]);
+            exit(1);
+        }
+
+        struct wfs_sb *disk_sb = map;
+        if (disk_sb->magic != WFS_MAGIC || disk_sb->version != WFS_VERSION) {
+            fprintf(stderr, "%s: not a version %d wfs disk, re-run mkfs on the array\n", argv[i], WFS_VERSION);
+            exit(1);
+        }
+        if (disk_sb->mount_index < 0 || disk_sb->mount_index >= MAX_DISK || disks[disk_sb->mount_index] != NULL) {
+            fprintf(stderr, "%s: invalid or duplicate mount index %d\n", argv[i], disk_sb->mount_index);
+            exit(1);
+        }
+        if (i > optind + 1 && disk_sb->timestamp != timestamp) {
+            fprintf(stderr, "%s: not from the same mkfs run\n", argv[i]);
+            exit(1);
+        }
+        timestamp = disk_sb->timestamp;
+        disks[disk_sb->mount_index] = map;
+        disk_names[disk_sb->mount_index] = argv[i];
+        disk_cnt++;
+    }
+    sb = disks[0];
+    if (sb == NULL || disk_cnt != sb->disk_cnt) {
+        fprintf(stderr, "the array has %d disks, all of them are needed\n", sb != NULL ? sb->disk_cnt : 0);
+        exit(1);
+    }
+    if (check_empty() < 0) {
+        fprintf(stderr, "%s: only a freshly made array can be imported into\n", disk_names[0]);
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+
+    group_cnt = sb->group_cnt;
+    group_blocks = sb->group_blocks;
+    group_inodes = sb->group_inodes;
+    groups = calloc(group_cnt, sizeof(struct wfs_group));
+    ibitmap = calloc(1, sb->d_bitmap_ptr - sb->i_bitmap_ptr);
+    if (groups == NULL || ibitmap == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    memcpy(groups, (char *)disks[0] + sb->groups_ptr, group_cnt * sizeof(struct wfs_group));
+    ibitmap[0] = 1;
+
+    struct stat st;
+    if (stat(argv[optind], &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: not a directory\n", argv[optind]);
+        exit(1);
+    }
+    add_node("", argv[optind], &st);
+    nodes[0].num = 0;
+    // The root keeps the mode mkfs gave it
+    nodes[0].st.st_mode = inode_at(0)->mode;
+    if (scan(0) < 0) exit(1);
+    if (assign(0) < 0) exit(1);
+
+    // File contents and dentry blocks first, nothing is in use yet
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&tids[started], NULL, import_worker, NULL) == 0) started++;
+    }
+    if (started == 0) import_worker(NULL);
+    for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    if (failed) exit(1);
+
+    if (sb->raid_mode == 5 && next_block > 0) {
+        off_t stripes = (next_block + sb->disk_cnt - 2) / (sb->disk_cnt - 1);
+        off_t per = (stripes + threads - 1) / threads;
+        struct range ranges[MAX_THREADS];
+        started = 0;
+        for (off_t s = 0; s < stripes; s += per) {
+            ranges[started].start = s;
+            ranges[started].end = s + per < stripes ? s + per : stripes;
+            if (pthread_create(&tids[started], NULL, fill_parity, &ranges[started]) != 0) {
+                fill_parity(&ranges[started]);
+                continue;
+            }
+            started++;
+        }
+        for (int t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    }
+
+    // Metadata of the first disk, raid 0 disks keep their own block bitmap
+    memcpy((char *)disks[0] + sb->i_bitmap_ptr, ibitmap, sb->d_bitmap_ptr - sb->i_bitmap_ptr);
+    for (off_t b = 0; b < next_block; b++) {
+        int d = sb->raid_mode == 0 ? b % sb->disk_cnt : 0;
+        uint8_t *d_bitmap = (uint8_t *)disks[d] + sb->d_bitmap_ptr;
+        d_bitmap[b / 8] |= 1 << b % 8;
+    }
+    memcpy((char *)disks[0] + sb->groups_ptr, groups, group_cnt * sizeof(struct wfs_group));
+    each_mirror(mirror_disk);
+
+    // A wfs --cache image closed before the import is stale
+    int generation = sb->generation + 1;
+    for (int d = 0; d < sb->disk_cnt; d++) ((struct wfs_sb *)disks[d])->generation = generation;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int dirs = 0;
+    for (int i = 1; i < node_cnt; i++) dirs += S_ISDIR(nodes[i].st.st_mode);
+    printf("%d files, %d directories, %ld bytes, %ld blocks in %.3fs (%.1f MB/s)\n",
+           node_cnt - 1 - dirs, dirs, (long)copied_bytes, (long)next_block, seconds,
+           seconds > 0 ? copied_bytes / seconds / 1e6 : 0.0);
+    return 0;
+}
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <linux/falloc.h>
+#include "wfs.h"
+
+// Give the free space of an unmounted wfs array back to the host, like
+// fstrim. Every host block of the data area that only holds free wfs blocks
+// is punched out of the image, and reads back as zeros.
+//
+// usage: wfs-trim [-n] disk...
+//
+// -n only reports what would be punched. wfs --discard does the same for
+// blocks freed while mounted.
+
+#define GRAIN (4096)  /* Bytes a host filesystem allocates at once, like DISCARD_GRAIN in wfs */
+
+struct wfs_sb *sb;
+void *disks[MAX_DISK];
+int fds[MAX_DISK];
+const char *disk_names[MAX_DISK];
+int primary = -1;
+int dry_run = 0;
+
+int raid10_groups() {
+    return sb->disk_cnt / sb->raid_width;
+}
+
+int raid5_parity_disk(off_t stripe) {
+    return sb->disk_cnt - 1 - stripe % sb->disk_cnt;
+}
+
+int raid5_data_disk(off_t b) {
+    off_t stripe = b / (sb->disk_cnt - 1);
+    return (raid5_parity_disk(stripe) + 1 + b % (sb->disk_cnt - 1)) % sb->disk_cnt;
+}
+
+// Raid 0 keeps each disk's blocks in that disk's own bitmap
+int block_used(off_t b) {
+    int disk = sb->raid_mode == 0 ? b % sb->disk_cnt : primary;
+    if (disks[disk] == NULL) return 1;
+    uint8_t *map = (uint8_t *)disks[disk] + sb->d_bitmap_ptr;
+    return (map[b / 8] >> (b % 8)) & 1;
+}
+
+// Data block slots on each disk, raid 5 has one per stripe
+off_t disk_slots() {
+    off_t n = sb->num_data_blocks;
+    if (sb->raid_mode == 0) return (n + sb->disk_cnt - 1) / sb->disk_cnt;
+    if (sb->raid_mode == 10) return (n + raid10_groups() - 1) / raid10_groups();
+    if (sb->raid_mode == 5) return (n + sb->disk_cnt - 2) / (sb->disk_cnt - 1);
+    return n;
+}
+
+// Return 1 if slot of disk holds nothing live, a raid 5 parity slot is live
+// while any block of its stripe is
+int slot_free(int disk, off_t slot) {
+    off_t n = sb->num_data_blocks;
+    off_t b = slot;
+    if (sb->raid_mode == 0) {
+        b = slot * sb->disk_cnt + disk;
+    } else if (sb->raid_mode == 10) {
+        b = slot * raid10_groups() + disk / sb->raid_width;
+    } else if (sb->raid_mode == 5) {
+        int parity = raid5_parity_disk(slot);
+        for (b = slot * (sb->disk_cnt - 1); b < (slot + 1) * (sb->disk_cnt - 1) && b < n; b++) {
+            if ((disk == parity || raid5_data_disk(b) == disk) && block_used(b)) return 0;
+        }
+        return 1;
+    }
+    return b >= n || !block_used(b);
+}
+
+// Punch the free grains of one disk, adjacent ones in a single call
+// Return the number of grains punched, -1 if fail
+off_t trim_disk(int disk) {
+    off_t first = (sb->d_blocks_ptr + GRAIN - 1) / GRAIN;
+    off_t last = (sb->d_blocks_ptr + disk_slots() * BLOCK_SIZE) / GRAIN;
+    off_t per_grain = GRAIN / BLOCK_SIZE;
+    off_t punched = 0, run = -1;
+
+    for (off_t g = first; g <= last; g++) {
+        int free_grain = g < last;
+        off_t slot = (g * GRAIN - sb->d_blocks_ptr) / BLOCK_SIZE;
+        for (off_t s = slot; free_grain && s < slot + per_grain; s++) free_grain = slot_free(disk, s);
+
+        if (free_grain) {
+            if (run < 0) run = g;
+            continue;
+        }
+        if (run < 0) continue;
+        if (!dry_run && fallocate(fds[disk], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, run * GRAIN, (g - run) * GRAIN) < 0) {
+            perror(disk_names[disk]);
+            return -1;
+        }
+        punched += g - run;
+        run = -1;
+    }
+    return punched;
+}
+
+// Take the lock wfs holds while mounted, waiting for a wfs that is still exiting
+// Return -1 if the disk stays in use
+int lock_disk(int fd) {
+    for (int tries = 0; flock(fd, LOCK_EX | LOCK_NB) < 0; tries++) {
+        if (errno != EWOULDBLOCK || tries == LOCK_WAIT * 10) return -1;
+        usleep(100000);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n")) != -1) switch (opt) {
+        case 'n':
+            dry_run = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n] disk...\n", argv[0]);
+            exit(1);
+    }
+    if (optind == argc || argc - optind > MAX_DISK) {
+        fprintf(stderr, "usage: %s [-n] disk...\n", argv[0]);
+        exit(1);
+    }
+
+    // Map the disks in mount index order, like wfs does
+    int timestamp = 0;
+    for (int i = optind; i < argc; i++) {
+        int fd = open(argv[i], O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(argv[i]);
+            exit(1);
+        }
+        if (lock_disk(fd) < 0) {
+            fprintf(stderr, "%s: in use by a mounted wfs\n", argv[i]);
+            exit(1);
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED || st.st_size < (off_t)sizeof(struct wfs_sb)) {
+            fprintf(stderr, "%s: can not map a superblock\n", argv[i]);
+            exit(1);
+        }
+
+        struct wfs_sb *disk_sb = map;
+        if (disk_sb->magic != WFS_MAGIC || disk_sb->version != WFS_VERSION) {
+            fprintf(stderr, "%s: not a version %d wfs disk, re-run mkfs on the array\n", argv[i], WFS_VERSION);
+            exit(1);
+        }
+        if (disk_sb->mount_index < 0 || disk_sb->mount_index >= MAX_DISK || disks[disk_sb->mount_index] != NULL) {
+            fprintf(stderr, "%s: invalid or duplicate mount index %d\n", argv[i], disk_sb->mount_index);
+            exit(1);
+        }
+        if (i > optind && disk_sb->timestamp != timestamp) {
+            fprintf(stderr, "%s: not from the same mkfs run\n", argv[i]);
+            exit(1);
+        }
+        timestamp = disk_sb->timestamp;
+        disks[disk_sb->mount_index] = map;
+        fds[disk_sb->mount_index] = fd;
+        disk_names[disk_sb->mount_index] = argv[i];
+    }
+    while (disks[++primary] == NULL);
+    sb = disks[primary];
+
+    if (sb->disk_cnt < 1 || sb->disk_cnt > MAX_DISK || (sb->raid_mode == 10 && (sb->raid_width < 1 || sb->disk_cnt % sb->raid_width != 0))) {
+        fprintf(stderr, "superblock layout is invalid\n");
+        exit(1);
+    }
+    // Raid 0 bitmaps live on their own disks, a missing one hides which blocks are used
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        if (disks[d] == NULL && sb->raid_mode == 0) {
+            fprintf(stderr, "raid 0 disk %d is missing, nothing can be trimmed\n", d);
+            exit(1);
+        }
+    }
+
+    int failed = 0;
+    for (int d = 0; d < sb->disk_cnt; d++) {
+        if (disks[d] == NULL) continue;
+        struct stat before, after;
+        fstat(fds[d], &before);
+        off_t punched = trim_disk(d);
+        fstat(fds[d], &after);
+        if (punched < 0) {
+            failed = 1;
+            continue;
+        }
+        printf("%s: %s %ld KiB, %ld KiB allocated, was %ld KiB\n", disk_names[d], dry_run ? "would trim" : "trimmed",
+               (long)(punched * GRAIN / 1024), (long)(after.st_blocks / 2), (long)(before.st_blocks / 2));
+    }
+    return failed;
+}
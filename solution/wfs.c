@@ -1,4 +1,5 @@
 #define FUSE_USE_VERSION 30
+#define _GNU_SOURCE
 
 #include <fuse.h>
 #include <stdio.h>
@@ -10,46 +11,537 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <time.h>
+#include <pthread.h>
+#include <immintrin.h>
+#include <linux/falloc.h>
 #include "wfs.h"
 
 
 int disk_count;
 void *regions[MAX_DISK];
+int disk_fds[MAX_DISK];
+int primary_disk = 0;
 int raid_mode = -1;
 struct wfs_sb *superblock;
 void *metadata;
 
+// metadata is the primary disk's own mapping, nothing is loaded at mount.
+// update_metadata mirrors it to the other disks: inodes recently handed
+// out by get_inode, compared before being copied, and the bitmap bytes
+// changed since the last update. Group counters and reference counts are
+// written to every disk the same way, only the entries changed since the
+// last update.
+#define HOT_INODES (64)
+#define DIRTY_RANGES (32)
+int hot_inodes[HOT_INODES];
+int hot_count = 0;
+int hot_next = 0;
+
+// Changed entries of a table, neighbours share a range and the whole table
+// is copied once the ranges run out
+struct dirty_ranges {
+	off_t off[DIRTY_RANGES];
+	off_t len[DIRTY_RANGES];
+	int count;
+	int all;
+};
+struct dirty_ranges bitmap_ranges;   /* Bytes of the metadata */
+struct dirty_ranges group_ranges;    /* Entries of group_table */
+struct dirty_ranges ref_ranges;      /* Entries of block_refs */
+
+// Mount options handled by wfs itself, stripped before fuse_main
+int allow_degraded = 0;
+int readahead_hints = 1;    // --no-readahead, readahead itself is taken by readahead(2)
+int write_combine = 1;
+int zero_copy = 1;
+int discard = 0;
+char *cache_path = NULL;
+char *replace_paths[MAX_DISK];
+int replace_count = 0;
+
+#define RESILVER_MAX_THREADS (8)
+
+// Write-combining buffers of open files, defined with the open file state
+void wcache_flush_inode(struct wfs_inode *inode, off_t offset, size_t size);
+void wcache_drop_inode(int num);
+off_t wcache_file_size(struct wfs_inode *inode);
+
+// Freed blocks waiting to be punched out of the images, defined with the block lookups
+#define DISCARD_BATCH (256)   /* Freed blocks collected before they are punched */
+#define DISCARD_GRAIN (4096)  /* Bytes a host filesystem allocates at once */
+uint8_t *discard_pending = NULL;
+off_t discard_count = 0;
+void discard_flush();
+
+// Hot block cache, defined with the block lookups
+void cache_write(off_t blk, const void *block);
+void cache_drop(off_t blk);
+
+// Largest file the direct and indirect blocks can describe
+#define MAX_FILE_SIZE ((off_t)(D_BLOCK + 1 + BLOCK_SIZE / sizeof(off_t)) * BLOCK_SIZE)
+
+// Logical block allocate_block places an indirect block as, logical block
+// IND_BLOCK is the first data block it maps
+#define IND_KEY (-1)
+
+// Raid 0 allocator state, per disk free block counts and next block to try
+off_t disk_free[MAX_DISK];
+off_t disk_cursor[MAX_DISK];
+
+// Allocation groups, group_table is the working copy of the on-disk table
+struct wfs_group *group_table;
+int group_cnt;
+int group_blocks;
+int group_inodes;
+off_t free_blocks_total;
+off_t free_inodes_total;
+
+// Snapshots, block_refs is the working copy of the on-disk reference counts
+#define SNAPSHOT_DIR "/.snapshots"
+uint32_t *block_refs = NULL;
+struct wfs_inode snapshot_root;
+
+// Raid 5 state
+#define RAID5_SCRATCH (64)
+int missing_disks = 0;
+char raid5_scratch[RAID5_SCRATCH][BLOCK_SIZE] __attribute__((aligned(32)));
+int raid5_next_scratch = 0;
+int parity_batch = 0;
+off_t *dirty_stripes = NULL;
+int dirty_stripe_count = 0;
+int dirty_stripe_cap = 0;
+uint32_t crc_table[256];
+
+// dst = srcs[0] ^ srcs[1] ^ ... over one block, picked at mount by cpu features
+void (*xor_blocks)(void *dst, void **srcs, int count);
+
+void xor_blocks_scalar(void *dst, void **srcs, int count) {
+	for(int off = 0; off < BLOCK_SIZE; off += sizeof(uint64_t)) {
+		uint64_t acc = 0;
+		for(int i = 0; i < count; i++) acc ^= *(uint64_t *)((char *)srcs[i] + off);
+		*(uint64_t *)((char *)dst + off) = acc;
+	}
+}
+
+__attribute__((target("sse2")))
+void xor_blocks_sse2(void *dst, void **srcs, int count) {
+	for(int off = 0; off < BLOCK_SIZE; off += 64) {
+		__m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;
+		for(int i = 0; i < count; i++) {
+			const char *p = (const char *)srcs[i] + off;
+			a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)p));
+			a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(p + 16)));
+			a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(p + 32)));
+			a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(p + 48)));
+		}
+		char *d = (char *)dst + off;
+		_mm_storeu_si128((__m128i *)d, a0);
+		_mm_storeu_si128((__m128i *)(d + 16), a1);
+		_mm_storeu_si128((__m128i *)(d + 32), a2);
+		_mm_storeu_si128((__m128i *)(d + 48), a3);
+	}
+}
+
+__attribute__((target("avx2")))
+void xor_blocks_avx2(void *dst, void **srcs, int count) {
+	for(int off = 0; off < BLOCK_SIZE; off += 128) {
+		__m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+		for(int i = 0; i < count; i++) {
+			const char *p = (const char *)srcs[i] + off;
+			a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)p));
+			a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(p + 32)));
+			a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(p + 64)));
+			a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(p + 96)));
+		}
+		char *d = (char *)dst + off;
+		_mm256_storeu_si256((__m256i *)d, a0);
+		_mm256_storeu_si256((__m256i *)(d + 32), a1);
+		_mm256_storeu_si256((__m256i *)(d + 64), a2);
+		_mm256_storeu_si256((__m256i *)(d + 96), a3);
+	}
+}
+
+// No Return
+void init_crc() {
+	for(uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for(int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+// No Return
+void init_raid5() {
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		xor_blocks = xor_blocks_avx2;
+		printf("raid 5 parity using avx2\n");
+	} else if(__builtin_cpu_supports("sse2")) {
+		xor_blocks = xor_blocks_sse2;
+		printf("raid 5 parity using sse2\n");
+	} else {
+		xor_blocks = xor_blocks_scalar;
+	}
+	init_crc();
+}
+
+uint32_t block_checksum(const void *block) {
+	const uint8_t *p = (const uint8_t *)block;
+	uint32_t c = 0xFFFFFFFF;
+	for(int i = 0; i < BLOCK_SIZE; i++) c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFF;
+}
+
+uint32_t *checksums(int disk) {
+	return (uint32_t *)((char *)regions[disk] + superblock->csum_ptr);
+}
+
+// Raid 5 layout: stripe s keeps its parity on disk N - 1 - (s % N) and its
+// data blocks on the disks following the parity disk, wrapping around
+int raid5_parity_disk(off_t stripe) {
+	return disk_count - 1 - stripe % disk_count;
+}
+
+int raid5_data_disk(off_t block_index) {
+	off_t stripe = block_index / (disk_count - 1);
+	return (raid5_parity_disk(stripe) + 1 + block_index % (disk_count - 1)) % disk_count;
+}
+
+// Return NULL if disk is missing
+char *raid5_addr(int disk, off_t stripe) {
+	if(regions[disk] == NULL) return NULL;
+	return (char *)regions[disk] + superblock->d_blocks_ptr + stripe * BLOCK_SIZE;
+}
+
+// Rebuild the member of stripe on disk skip from all the others
+// Return -1 if another member is missing too
+int raid5_rebuild(off_t stripe, int skip, void *dst) {
+	void *srcs[MAX_DISK];
+	int count = 0;
+	for(int i = 0; i < disk_count; i++) {
+		if(i == skip) continue;
+		if((srcs[count++] = raid5_addr(i, stripe)) == NULL) return -1;
+	}
+	xor_blocks(dst, srcs, count);
+	return 0;
+}
+
+// Read the logical contents of a block, reconstructing it from parity if its
+// disk is missing or it fails its checksum
+// Return -1 if the block could not be recovered
+int raid5_read(off_t block_index, void *dst) {
+	off_t stripe = block_index / (disk_count - 1);
+	int disk = raid5_data_disk(block_index);
+	char *block = raid5_addr(disk, stripe);
+	uint32_t sum = checksums(primary_disk)[block_index];
+
+	if(block != NULL && block_checksum(block) == sum) {
+		memcpy(dst, block, BLOCK_SIZE);
+		return 0;
+	}
+
+	if(raid5_rebuild(stripe, disk, dst) < 0 || block_checksum(dst) != sum) {
+		printf("raid 5 block %ld is unrecoverable\n", (long)block_index);
+		if(block != NULL) memcpy(dst, block, BLOCK_SIZE);
+		return -1;
+	}
+
+	// Repair the bad copy in place
+	if(block != NULL) {
+		printf("raid 5 block %ld failed its checksum, repaired from parity\n", (long)block_index);
+		memcpy(block, dst, BLOCK_SIZE);
+	}
+	return 0;
+}
+
+// Recompute parity of every stripe written since begin_parity_batch
+// No Return
+void end_parity_batch() {
+	void *srcs[MAX_DISK];
+	for(int i = 0; i < dirty_stripe_count; i++) {
+		off_t stripe = dirty_stripes[i];
+		int parity = raid5_parity_disk(stripe);
+		int count = 0;
+		for(int d = 0; d < disk_count; d++) {
+			if(d != parity) srcs[count++] = raid5_addr(d, stripe);
+		}
+		// Reconstruct-write from every data member, a partial stripe also
+		// reads the members nobody wrote, but never the old parity
+		xor_blocks(raid5_addr(parity, stripe), srcs, count);
+	}
+	dirty_stripe_count = 0;
+	parity_batch = 0;
+}
+
+// Defer raid 5 parity updates until end_parity_batch, only possible with every disk present
+// No Return
+void begin_parity_batch() {
+	if(raid_mode == 5 && missing_disks == 0) parity_batch = 1;
+}
+
+// Return -1 if fail
+int mark_stripe_dirty(off_t stripe) {
+	for(int i = dirty_stripe_count - 1; i >= 0; i--) {
+		if(dirty_stripes[i] == stripe) return 0;
+	}
+	if(dirty_stripe_count == dirty_stripe_cap) {
+		int cap = dirty_stripe_cap ? dirty_stripe_cap * 2 : 64;
+		off_t *grown = realloc(dirty_stripes, cap * sizeof(off_t));
+		if(grown == NULL) return -1;
+		dirty_stripes = grown;
+		dirty_stripe_cap = cap;
+	}
+	dirty_stripes[dirty_stripe_count++] = stripe;
+	return 0;
+}
+
+// Raid 10 layout: block b lives in mirror group b % groups at offset b / groups,
+// group g is made of disks g * raid_width up to (g + 1) * raid_width - 1
+int raid10_groups() {
+	return disk_count / superblock->raid_width;
+}
+
+int raid10_first_disk(off_t block_index) {
+	return (block_index % raid10_groups()) * superblock->raid_width;
+}
+
+char *raid10_addr(int disk, off_t block_index) {
+	return (char *)regions[disk] + superblock->d_blocks_ptr + (block_index / raid10_groups()) * BLOCK_SIZE;
+}
+
+// Copy len bytes at off of the metadata to every other disk
+// No Return
+void mirror_metadata(off_t off, off_t len) {
+	for(int i = 0; i < disk_count; i++) {
+		if(i == primary_disk || regions[i] == NULL) continue;
+		memcpy((char *)regions[i] + off, (char *)metadata + off, len);
+	}
+}
+
+// Inode n inside the metadata, whether it is allocated or not
+struct wfs_inode *inode_block(int n) {
+	return (struct wfs_inode *)((char *)metadata + superblock->i_blocks_ptr + (off_t)n * BLOCK_SIZE);
+}
+
+// Remember inode n may be written, the oldest hot inode is mirrored and dropped when the set is full
+// No Return
+void touch_inode(int n) {
+	for(int i = 0; i < hot_count; i++) {
+		if(hot_inodes[i] == n) return;
+	}
+	if(hot_count < HOT_INODES) {
+		hot_inodes[hot_count++] = n;
+		return;
+	}
+	mirror_metadata((char *)inode_block(hot_inodes[hot_next]) - (char *)metadata, BLOCK_SIZE);
+	hot_inodes[hot_next] = n;
+	hot_next = (hot_next + 1) % HOT_INODES;
+}
+
+// Remember entry at of a table changed
+// No Return
+void mark_dirty(struct dirty_ranges *d, off_t at) {
+	if(d->all) return;
+	for(int i = 0; i < d->count; i++) {
+		if(at >= d->off[i] - 1 && at <= d->off[i] + d->len[i]) {
+			if(at < d->off[i]) {
+				d->off[i] = at;
+				d->len[i]++;
+			} else if(at == d->off[i] + d->len[i]) {
+				d->len[i]++;
+			}
+			return;
+		}
+	}
+	if(d->count == DIRTY_RANGES) {
+		d->all = 1;
+		return;
+	}
+	d->off[d->count] = at;
+	d->len[d->count++] = 1;
+}
+
+// Remember a changed bitmap byte
+// No Return
+void bitmap_dirty(uint8_t *byte) {
+	mark_dirty(&bitmap_ranges, (char *)byte - (char *)metadata);
+}
+
+// Write the dirty entries of a working copy table to the on-disk table at ptr of every disk
+// No Return
+void write_table(off_t ptr, void *table, size_t entry, off_t entries, struct dirty_ranges *d) {
+	for(int i = 0; i < disk_count; i++) {
+		if(regions[i] == NULL) continue;
+		char *dst = (char *)regions[i] + ptr;
+		if(d->all) {
+			memcpy(dst, table, entries * entry);
+			continue;
+		}
+		for(int r = 0; r < d->count; r++) {
+			memcpy(dst + d->off[r] * entry, (char *)table + d->off[r] * entry, d->len[r] * entry);
+		}
+	}
+	d->count = 0;
+	d->all = 0;
+}
+
 // No Return
 void update_metadata() {
 	// Keep metadata consistent across all disks
-	for(int i = 0; i < disk_count; i++) {
-		// Write inode bitmap into memory
-		memcpy((char *)regions[i] + superblock->i_bitmap_ptr, (char *)metadata + superblock->i_bitmap_ptr, superblock->d_bitmap_ptr - superblock->i_bitmap_ptr);
+	if(bitmap_ranges.all) {
+		mirror_metadata(superblock->i_bitmap_ptr, superblock->d_bitmap_ptr - superblock->i_bitmap_ptr);
 		if(raid_mode >= 1) {
 			// Only copy blocks bitmap if using raid 1 or 1v
-			memcpy((char *)regions[i] + superblock->d_bitmap_ptr, (char *)metadata + superblock->d_bitmap_ptr, superblock->i_blocks_ptr - superblock->d_bitmap_ptr);
+			mirror_metadata(superblock->d_bitmap_ptr, superblock->i_blocks_ptr - superblock->d_bitmap_ptr);
+		}
+	} else {
+		for(int r = 0; r < bitmap_ranges.count; r++) mirror_metadata(bitmap_ranges.off[r], bitmap_ranges.len[r]);
+	}
+	bitmap_ranges.count = 0;
+	bitmap_ranges.all = 0;
+	if(discard_count >= DISCARD_BATCH) discard_flush();
+
+	for(int i = 0; i < disk_count; i++) {
+		// Missing disks in a degraded array are skipped
+		if(regions[i] == NULL) continue;
+
+		// Hot inodes are only written where they differ, untouched pages of the mirrors stay clean
+		for(int h = 0; i != primary_disk && h < hot_count; h++) {
+			off_t off = (char *)inode_block(hot_inodes[h]) - (char *)metadata;
+			if(memcmp((char *)regions[i] + off, (char *)metadata + off, BLOCK_SIZE) != 0) {
+				memcpy((char *)regions[i] + off, (char *)metadata + off, BLOCK_SIZE);
+			}
 		}
-		// Write inode blocks into memory
-		memcpy((char *)regions[i] + superblock->i_blocks_ptr, (char *)metadata + superblock->i_blocks_ptr, superblock->num_inodes * BLOCK_SIZE);
 	}
+	// Write group counters and snapshot reference counts
+	write_table(superblock->groups_ptr, group_table, sizeof(struct wfs_group), group_cnt, &group_ranges);
+	if(block_refs != NULL) write_table(superblock->refs_ptr, block_refs, sizeof(uint32_t), superblock->num_data_blocks, &ref_ranges);
+}
+
+// Write-intent bitmap. A region's bit reaches every disk before any copy of
+// its blocks changes, the metadata bit is set for as long as the array is
+// mounted. Bits are cleared once writes have been idle for WIB_IDLE seconds
+// and the copies are synced, so the bits found at mount are the regions a
+// crash may have left out of sync.
+#define WIB_IDLE (5)
+off_t wib_dirty = 0;    /* Data region bits currently set */
+time_t wib_last = 0;    /* Time of the last write to a region */
+
+// Data regions, the metadata bit comes after them
+off_t wib_regions() {
+	return (superblock->num_data_blocks + superblock->wib_chunk - 1) / superblock->wib_chunk;
+}
+
+uint8_t *wib_map(int disk) {
+	return (uint8_t *)regions[disk] + superblock->wib_ptr;
+}
+
+// Wait for the pages under [addr, addr + len) to reach the image
+// No Return
+void sync_range(void *addr, size_t len) {
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page - 1);
+	if(msync((void *)start, (uintptr_t)addr + len - start, MS_SYNC) < 0) perror("msync failed\n");
+}
+
+// Set bit on every disk and make it durable
+// No Return
+void wib_set(off_t bit) {
+	for(int i = 0; i < disk_count; i++) {
+		if(regions[i] == NULL) continue;
+		wib_map(i)[bit / 8] |= 1 << (bit % 8);
+		sync_range(wib_map(i) + bit / 8, 1);
+	}
+}
+
+// Note a write to blk before any copy of it changes
+// No Return
+void wib_mark(off_t blk) {
+	if(superblock->wib_ptr == 0) return;
+	wib_last = time(NULL);
+	off_t bit = blk / superblock->wib_chunk;
+	if(wib_map(primary_disk)[bit / 8] & (1 << (bit % 8))) return;
+	wib_set(bit);
+	wib_dirty++;
+}
+
+// Sync every copy and clear the data bits, and the metadata bit on unmount
+// No Return
+void wib_clear(int unmount) {
+	if(superblock->wib_ptr == 0 || (wib_dirty == 0 && !unmount)) return;
+	off_t bytes = (wib_regions() + 8) / 8;
+	for(int i = 0; i < disk_count; i++) {
+		if(regions[i] == NULL) continue;
+		sync_range(regions[i], superblock->wib_ptr);
+		for(off_t bit = 0; bit < wib_regions() + unmount; bit++) wib_map(i)[bit / 8] &= ~(1 << (bit % 8));
+		sync_range(wib_map(i), bytes);
+	}
+	wib_dirty = 0;
+}
+
+// wfs runs single threaded, idle regions are cleared as calls come in
+// No Return
+void wib_expire() {
+	if(wib_dirty > 0 && time(NULL) - wib_last >= WIB_IDLE) wib_clear(0);
 }
 
 // No Return
 void update_all_datablocks(off_t index, void *block) {
-	if(raid_mode >= 1) {
+	wib_mark(index);
+	if(raid_mode == 5) {
+		off_t stripe = index / (disk_count - 1);
+		char *data = raid5_addr(raid5_data_disk(index), stripe);
+		char *parity = raid5_addr(raid5_parity_disk(stripe), stripe);
+
+		if(parity_batch && mark_stripe_dirty(stripe) == 0) {
+			// Parity is recomputed once per stripe in end_parity_batch
+			if(data != block) memcpy(data, block, BLOCK_SIZE);
+		} else {
+			// Read-modify-write, parity ^= old ^ new
+			if(parity != NULL) {
+				char old[BLOCK_SIZE];
+				raid5_read(index, old);
+				void *srcs[3] = {parity, old, block};
+				xor_blocks(parity, srcs, 3);
+			}
+			if(data != NULL && data != block) memcpy(data, block, BLOCK_SIZE);
+		}
+
+		uint32_t sum = block_checksum(block);
+		for(int i = 0; i < disk_count; i++) {
+			if(regions[i] != NULL) checksums(i)[index] = sum;
+		}
+	} else if(raid_mode == 10) {
+		// Only the mirrors of the block's group hold a copy
+		int first = raid10_first_disk(index);
+		for(int i = first; i < first + superblock->raid_width; i++) {
+			if(regions[i] == NULL) continue;
+			char *dst = raid10_addr(i, index);
+			if(dst != block) memcpy(dst, block, BLOCK_SIZE);
+		}
+	} else if(raid_mode >= 1) {
 		for(int i = 0; i < disk_count; i++) {
+			if(regions[i] == NULL) continue;
 			memcpy((char *)regions[i] + superblock->d_blocks_ptr + index * BLOCK_SIZE, block, BLOCK_SIZE);
 		}
+	} else if(raid_mode == 0) {
+		// Only differs from the disk when block is a cache slot
+		char *dst = (char *)regions[index % disk_count] + superblock->d_blocks_ptr + (index / disk_count) * BLOCK_SIZE;
+		if(dst != block) memcpy(dst, block, BLOCK_SIZE);
 	}
+	cache_write(index, block);
 }
 
 // Return NULL if fail
 struct wfs_inode* get_inode(int n) {
 	uint8_t* bitmap = (uint8_t*)((char*)metadata + superblock->i_bitmap_ptr);
 
-	if (bitmap[n / 8] & (1 << n % 8))
-		return (struct wfs_inode*)(((char*)metadata + superblock->i_blocks_ptr) + n * BLOCK_SIZE);
+	if (bitmap[n / 8] & (1 << n % 8)) {
+		touch_inode(n);
+		return inode_block(n);
+	}
 
 	return NULL;
 }
@@ -64,13 +556,9 @@ int block_exists(off_t block_index) {
 	return (int)(b_bitmap[block_index / 8]) & 0x1 << (block_index % 8);
 }
 
+// Block as the disks hold it, whether it is allocated or not
 // Return NULL if fail
-void *get_block(off_t block_index) {
-	if(!block_exists(block_index)) {
-		perror("Block was not allocated\n");
-		return NULL;
-	}
-
+void *disk_block(off_t block_index) {
 	if(raid_mode == 0) {
 		// Raid 0 Case
 		int disk = block_index % disk_count;
@@ -79,21 +567,23 @@ void *get_block(off_t block_index) {
 		return (void *)((char *)regions[disk] + superblock->d_blocks_ptr + (index * BLOCK_SIZE));
 	} else if(raid_mode == 1) {
 		// Raid 1 Case
-		return (void *)((char *)regions[0] + superblock->d_blocks_ptr + (block_index * BLOCK_SIZE));
+		return (void *)((char *)regions[primary_disk] + superblock->d_blocks_ptr + (block_index * BLOCK_SIZE));
 	} else if(raid_mode == 2) {
 		// Raid 1v Case
 		int block_votes[MAX_DISK] = {0}; // number of matches each block has
 		void *blocks[MAX_DISK] = {0};
-		int max_votes = 0, majority_index = 0;
+		int max_votes = 0, majority_index = primary_disk;
 
 		for (int i = 0; i < disk_count; i++) {
+			if(regions[i] == NULL) continue;
 			blocks[i] = (char *)regions[i] + superblock->d_blocks_ptr + block_index * BLOCK_SIZE;
 		}
 
 		// comparing blocks on each disk with blocks on all other disks
 		for (int i = 0; i < disk_count; i++) {
+			if(blocks[i] == NULL) continue;
 			for (int j = 0; j < disk_count; j++)
-				if (memcmp(blocks[i], blocks[j], BLOCK_SIZE) == 0) block_votes[i]++; // indentical blocks
+				if (blocks[j] != NULL && memcmp(blocks[i], blocks[j], BLOCK_SIZE) == 0) block_votes[i]++; // indentical blocks
 			
 			// update majority block
 			if (block_votes[i] > max_votes || (block_votes[i] == max_votes && i < majority_index)) {
@@ -103,717 +593,2992 @@ void *get_block(off_t block_index) {
 		}
 		// update block with most matches
 		return (void *)blocks[majority_index];
+	} else if(raid_mode == 10) {
+		// Raid 10 Case, consecutive blocks of a group alternate between its
+		// mirrors so sequential reads use all of them
+		int width = superblock->raid_width;
+		int first = raid10_first_disk(block_index);
+		int pick = (block_index / raid10_groups()) % width;
+		for(int i = 0; i < width; i++) {
+			int disk = first + (pick + i) % width;
+			if(regions[disk] != NULL) return (void *)raid10_addr(disk, block_index);
+		}
+		return NULL;
+	} else if(raid_mode == 5) {
+		// Raid 5 Case, hand out a copy so writers can update parity from the old contents
+		char *block = raid5_scratch[raid5_next_scratch];
+		raid5_next_scratch = (raid5_next_scratch + 1) % RAID5_SCRATCH;
+		raid5_read(block_index, block);
+		return (void *)block;
 	}
 	return NULL;
 }
 
-// No Return
-void free_block(off_t blk) {
-	void *disk;
+// Hot block cache. With --cache=path copies of data blocks live in the
+// slots of a faster image and get_block hands out the slot, so a working
+// set that fits never touches the disks. Writes go through to the disks,
+// the cache never holds the only copy of a block. Slots are replaced by
+// 2Q: a block seen once waits in the a1in FIFO, and only a block asked for
+// again while the a1out ring still remembers it falling out of a1in earns
+// a place in the am LRU, so one pass over a large file can not flush it.
+//
+// Inodes and bitmaps are not cached. Every lookup, allocation and
+// update_metadata works on them in place through the primary's mapping,
+// and they are one block per inode plus two bitmaps, small enough to stay
+// in the host page cache once read. A mount with a cache reads them ahead
+// in one pass instead of a block at a time on the slow disk.
+#define CACHE_FREE (0)
+#define CACHE_A1IN (1)
+#define CACHE_AM   (2)
+#define CACHE_NONE (-1)      /* cache_where of a block without a slot, a1out positions are below it */
+#define CACHE_PINNED (1024)  /* Slots handed out last, never replaced */
+
+struct cache_entry {
+	off_t block;      /* Data block held, -1 if free */
+	int prev;         /* Neighbours on its list, -1 past the ends */
+	int next;
+	int list;         /* CACHE_FREE, CACHE_A1IN or CACHE_AM */
+	uint64_t stamp;   /* cache_clock when it last went to the head of its list */
+};
 
-	// Update specific disk if raid 0, otherwise update metadata and therefore all disks
-	if(raid_mode == 0) 
-		disk = regions[blk % disk_count];	
-	else 
-		disk = metadata;
+int cache_fd = -1;
+char *cache_map = NULL;
+off_t cache_size = 0;
+struct wfs_cache *cache_header;
+struct cache_entry *cache_entries;
+int cache_slots = 0;
+int cache_head[3], cache_tail[3], cache_len[3];
+int *cache_where = NULL;   /* Slot of every data block, CACHE_NONE, or -2 - its a1out position */
+off_t *cache_ghosts;       /* a1out, blocks recently evicted from a1in */
+int cache_ghost_cap;
+int cache_ghost_next = 0;
+uint64_t cache_clock = 0;
+long cache_hits = 0;
+long cache_misses = 0;
+
+// Callers may hold the last RAID5_SCRATCH blocks like on raid 5, and
+// read_buf splices a whole request out of the slots after it returns,
+// looking up an indirect block next to every data block
+int cache_pinned[CACHE_PINNED];
+uint16_t *cache_pins;
+int cache_pin_next = 0;
+
+char *cache_data(int s) {
+	return cache_map + cache_header->data_ptr + (off_t)s * BLOCK_SIZE;
+}
 
-	uint8_t* bitmap = (uint8_t*)((char*)disk + superblock->d_bitmap_ptr);
-	bitmap[blk / 8] &= ~(1 << (blk % 8));
-	update_metadata();
+// No Return
+void cache_unlink(int s) {
+	struct cache_entry *e = &cache_entries[s];
+	if(e->prev >= 0) cache_entries[e->prev].next = e->next;
+	else cache_head[e->list] = e->next;
+	if(e->next >= 0) cache_entries[e->next].prev = e->prev;
+	else cache_tail[e->list] = e->prev;
+	cache_len[e->list]--;
 }
 
+// Put slot s at the head of list
 // No Return
-void free_inode(int index) {
+void cache_push(int s, int list) {
+	struct cache_entry *e = &cache_entries[s];
+	e->list = list;
+	e->prev = -1;
+	e->next = cache_head[list];
+	if(e->next >= 0) cache_entries[e->next].prev = s;
+	else cache_tail[list] = s;
+	cache_head[list] = s;
+	cache_len[list]++;
+	e->stamp = ++cache_clock;
+}
 
-	struct wfs_inode *inode = get_inode(index);
+// Remember blk in a1out, the oldest block there is forgotten
+// No Return
+void cache_ghost(off_t blk) {
+	off_t old = cache_ghosts[cache_ghost_next];
+	if(old >= 0 && cache_where[old] == -2 - cache_ghost_next) cache_where[old] = CACHE_NONE;
+	cache_ghosts[cache_ghost_next] = blk;
+	cache_where[blk] = -2 - cache_ghost_next;
+	cache_ghost_next = (cache_ghost_next + 1) % cache_ghost_cap;
+}
 
-	if (inode == NULL) {
-		perror("no inode with given index");
-		return;
-	}
+// Keep slot s in place until CACHE_PINNED more slots were handed out
+// No Return
+void cache_pin(int s) {
+	int old = cache_pinned[cache_pin_next];
+	if(old >= 0) cache_pins[old]--;
+	cache_pinned[cache_pin_next] = s;
+	cache_pins[s]++;
+	cache_pin_next = (cache_pin_next + 1) % CACHE_PINNED;
+}
 
-	// Free all direct blocks
-	for(int i = 0; i <= D_BLOCK; i++) {
-		if(inode->blocks[i] > -1) {
-			free_block(inode->blocks[i]);
-		}
+// Return the oldest unpinned slot of list, -1 if there is none
+int cache_oldest(int list) {
+	for(int s = cache_tail[list]; s >= 0; s = cache_entries[s].prev) {
+		if(cache_pins[s] == 0) return s;
 	}
+	return -1;
+}
 
-	// Free indirect block and inner blocks
-	if(inode->blocks[IND_BLOCK] > -1) {
-		off_t *ind_block = (off_t *)get_block(inode->blocks[IND_BLOCK]);
-		if(ind_block == NULL) return;
+// Take a slot for a new block: a free one, else the oldest of a1in while it
+// holds more than a quarter of the slots, else the least recently used of am.
+// cache_open leaves far more slots than CACHE_PINNED, so one is always found.
+// Return the slot, unlinked from its list
+int cache_victim() {
+	int s = cache_oldest(CACHE_FREE);
+	if(s < 0 && cache_len[CACHE_A1IN] > cache_slots / 4) s = cache_oldest(CACHE_A1IN);
+	if(s < 0) s = cache_oldest(CACHE_AM);
+	if(s < 0) s = cache_oldest(CACHE_A1IN);
+
+	struct cache_entry *e = &cache_entries[s];
+	if(e->list == CACHE_A1IN) cache_ghost(e->block);
+	else if(e->list == CACHE_AM) cache_where[e->block] = CACHE_NONE;
+	cache_unlink(s);
+	return s;
+}
 
-		for(int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
-			if(ind_block[i] > -1) {
-				free_block(ind_block[i]);
-			}
+// Slot holding blk, filled from the disks on a miss
+// Return NULL if fail
+void *cache_block(off_t blk) {
+	int s = cache_where[blk];
+	if(s >= 0) {
+		cache_hits++;
+		if(cache_entries[s].list == CACHE_AM) {
+			cache_unlink(s);
+			cache_push(s, CACHE_AM);
 		}
-		free_block(inode->blocks[IND_BLOCK]);
+	} else {
+		void *src = disk_block(blk);
+		if(src == NULL) return NULL;
+		cache_misses++;
+
+		int seen = s < CACHE_NONE;
+		s = cache_victim();
+		memcpy(cache_data(s), src, BLOCK_SIZE);
+		cache_entries[s].block = blk;
+		cache_where[blk] = s;
+		cache_push(s, seen ? CACHE_AM : CACHE_A1IN);
 	}
+	cache_pin(s);
+	return cache_data(s);
+}
 
-	uint8_t* bitmap = (uint8_t*)((char*)metadata + superblock->i_bitmap_ptr);
-	bitmap[index / 8] &= ~(1 << (index % 8));
-	update_metadata();
+// Keep the slot of blk equal to what was just written to the disks
+// No Return
+void cache_write(off_t blk, const void *block) {
+	if(cache_where == NULL || cache_where[blk] < 0) return;
+	char *slot = cache_data(cache_where[blk]);
+	if(slot != block) memcpy(slot, block, BLOCK_SIZE);
 }
 
-// Return -ENOSPC if fail
-off_t allocate_block() {
-	uint8_t* bitmap;
-	off_t blk = -1;
-	// For each possible block
-	for(int i = 0; i < superblock->num_data_blocks; i++) {
-		// Check bitmap for availability
-		if(raid_mode == 0) {
-			int disk = i % disk_count;
-			bitmap = (uint8_t*)((char*)regions[disk] + superblock->d_bitmap_ptr);
-		} else {
-			bitmap = (uint8_t*)((char*)metadata + superblock->d_bitmap_ptr);
+// Forget blk, it was freed
+// No Return
+void cache_drop(off_t blk) {
+	if(cache_where == NULL || cache_where[blk] < 0) return;
+	int s = cache_where[blk];
+	cache_unlink(s);
+	cache_entries[s].block = -1;
+	cache_where[blk] = CACHE_NONE;
+	cache_push(s, CACHE_FREE);
+}
+
+int cache_stamp_order(const void *a, const void *b) {
+	uint64_t x = ((const struct wfs_cache_slot *)a)->stamp, y = ((const struct wfs_cache_slot *)b)->stamp;
+	return (x > y) - (x < y);
+}
+
+// Map the cache image and take over the slots it was closed with, if it was
+// closed cleanly at the array's current generation and a slot still passes
+// its checksum and holds an allocated block. Anything else starts empty.
+// Return -1 if fail
+int cache_open(const char *path) {
+	struct stat st;
+	if((cache_fd = open(path, O_RDWR)) < 0 || fstat(cache_fd, &st) < 0) {
+		printf("open failed on cache %s\n", path);
+		return -1;
+	}
+
+	off_t slots = (st.st_size - BLOCK_SIZE) / (BLOCK_SIZE + (off_t)sizeof(struct wfs_cache_slot));
+	off_t data_ptr = 0;
+	for(; slots > 0; slots--) {
+		data_ptr = (BLOCK_SIZE + slots * sizeof(struct wfs_cache_slot) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+		if(data_ptr + slots * BLOCK_SIZE <= st.st_size) break;
+	}
+	if(slots < 4 * CACHE_PINNED || slots > INT32_MAX / 2) {
+		printf("cache %s needs between %d and %d slots of %d bytes, it has %ld\n", path, 4 * CACHE_PINNED, INT32_MAX / 2, BLOCK_SIZE, (long)slots);
+		return -1;
+	}
+
+	cache_size = st.st_size;
+	if((cache_map = mmap(NULL, cache_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache_fd, 0)) == MAP_FAILED) {
+		perror("mmap failed on cache\n");
+		return -1;
+	}
+	cache_header = (struct wfs_cache *)cache_map;
+	cache_slots = slots;
+	cache_ghost_cap = slots / 2;
+
+	cache_entries = calloc(cache_slots, sizeof(struct cache_entry));
+	cache_pins = calloc(cache_slots, sizeof(uint16_t));
+	cache_ghosts = malloc(cache_ghost_cap * sizeof(off_t));
+	cache_where = malloc(superblock->num_data_blocks * sizeof(int));
+	if(cache_entries == NULL || cache_pins == NULL || cache_ghosts == NULL || cache_where == NULL) {
+		perror("Failed to allocate the cache index\n");
+		return -1;
+	}
+	for(int i = 0; i < 3; i++) cache_head[i] = cache_tail[i] = -1;
+	for(int i = 0; i < CACHE_PINNED; i++) cache_pinned[i] = -1;
+	for(int i = 0; i < cache_ghost_cap; i++) cache_ghosts[i] = -1;
+	for(int s = 0; s < cache_slots; s++) cache_entries[s].block = -1;
+	for(off_t b = 0; b < (off_t)superblock->num_data_blocks; b++) cache_where[b] = CACHE_NONE;
+	init_crc();
+
+	struct wfs_cache *h = cache_header;
+	int warm = h->magic == WFS_CACHE_MAGIC && h->clean && h->timestamp == superblock->timestamp &&
+		h->generation == superblock->generation && h->slots == cache_slots && h->data_ptr == data_ptr;
+
+	// Slots go back on their lists oldest first, so the newest ends up at the head
+	struct wfs_cache_slot *table = (struct wfs_cache_slot *)(cache_map + BLOCK_SIZE);
+	int kept = 0, dropped = 0;
+	if(warm) {
+		qsort(table, cache_slots, sizeof(struct wfs_cache_slot), cache_stamp_order);
+	}
+	h->data_ptr = data_ptr;
+	for(int i = 0; i < cache_slots; i++) {
+		if(!warm || table[i].block < 0) continue;
+
+		off_t blk = table[i].block;
+		int s = table[i].slot;
+		if(blk >= (off_t)superblock->num_data_blocks || s < 0 || s >= cache_slots || cache_entries[s].block >= 0 ||
+			cache_where[blk] != CACHE_NONE || (table[i].list != CACHE_A1IN && table[i].list != CACHE_AM) ||
+			!block_exists(blk) || block_checksum(cache_data(s)) != table[i].crc) {
+			dropped++;
+			continue;
 		}
-		
-		// Set bit to 1 if 0
-		if (!(bitmap[i / 8] & (1 << i % 8))) {
-			bitmap[i / 8] |= (1 << i % 8);
-			blk = i;
-			break;
+		cache_entries[s].block = blk;
+		cache_entries[s].list = table[i].list;
+		cache_where[blk] = s;
+		kept++;
+	}
+	for(int i = 0; warm && i < cache_slots; i++) {
+		int s = table[i].slot;
+		if(table[i].block >= 0 && s >= 0 && s < cache_slots && cache_entries[s].block == table[i].block && cache_entries[s].stamp == 0) {
+			cache_push(s, cache_entries[s].list);
 		}
 	}
+	for(int s = 0; s < cache_slots; s++) {
+		if(cache_entries[s].block < 0) cache_push(s, CACHE_FREE);
+	}
+	printf("Cache %s: %d slots, %d blocks kept, %d dropped%s\n", path, cache_slots, kept, dropped, warm ? "" : ", starting empty");
+
+	// Until the unmount the slot table is stale
+	h->magic = WFS_CACHE_MAGIC;
+	h->timestamp = superblock->timestamp;
+	h->slots = cache_slots;
+	h->clean = 0;
+	sync_range(h, BLOCK_SIZE);
+	return 0;
+}
 
-	if(blk == -1) return -ENOSPC;
-
-	update_metadata();
-	// Clear data in new block
-	void *newblock = get_block(blk);
-	memset(newblock, 0, BLOCK_SIZE);
-	update_all_datablocks(blk, newblock);
-	return blk;
+// Write the slot table and mark the cache clean, the generation is the one
+// this mount gave the array
+// No Return
+void cache_close() {
+	if(cache_map == NULL) return;
+	struct wfs_cache_slot *table = (struct wfs_cache_slot *)(cache_map + BLOCK_SIZE);
+	for(int s = 0; s < cache_slots; s++) {
+		struct cache_entry *e = &cache_entries[s];
+		table[s].block = e->block;
+		table[s].slot = s;
+		table[s].list = e->list;
+		table[s].stamp = e->stamp;
+		table[s].crc = e->block >= 0 ? block_checksum(cache_data(s)) : 0;
+	}
+	msync(cache_map, cache_size, MS_SYNC);
+	cache_header->generation = superblock->generation;
+	cache_header->clean = 1;
+	sync_range(cache_header, BLOCK_SIZE);
+
+	printf("Cache: %ld hits, %ld misses\n", cache_hits, cache_misses);
+	munmap(cache_map, cache_size);
+	close(cache_fd);
+	free(cache_entries);
+	free(cache_pins);
+	free(cache_ghosts);
+	free(cache_where);
 }
 
-// Return -ENOSPC if fail
-off_t allocate_inode(mode_t mode) {
-	uint8_t* bitmap = (uint8_t*)((char*)metadata + superblock->i_bitmap_ptr);
+// Return NULL if fail
+void *get_block(off_t block_index) {
+	if(!block_exists(block_index)) {
+		perror("Block was not allocated\n");
+		return NULL;
+	}
+	if(cache_where != NULL) return cache_block(block_index);
+	return disk_block(block_index);
+}
 
-	off_t blk = -1;
-	for (uint32_t i = 0; i < superblock->num_inodes / 8; i++) {
-		if (bitmap[i] == 0xFF)
-			continue;
+// get_block for a caller that changes the block in place, which writes the
+// member copy before update_all_datablocks runs, so the intent bit goes first
+// Return NULL if fail
+void *get_block_for_write(off_t block_index) {
+	wib_mark(block_index);
+	return get_block(block_index);
+}
 
-		for (uint32_t k = 0; k < 8; k++) {
-			if (!(bitmap[i] & (1 << k))) {
-				// allocate inodes on all disks
-				bitmap[i] |= (1 << k);
-				blk =  8 * i + k;
-				goto found;
-			}
-		}
+// Find the image and offset holding a block, so FUSE can splice it to the
+// kernel without copying it through wfs first
+// Return -1 if the block only exists as a reconstructed copy
+int block_fd(off_t block_index, off_t *pos) {
+	char *block;
+	if(cache_map != NULL) {
+		// Every block get_block hands out is a slot, reconstructed ones too
+		if((block = get_block(block_index)) == NULL) return -1;
+		*pos = block - cache_map;
+		return cache_fd;
+	} else if(raid_mode == 5) {
+		// Only a member that passes its checksum can be handed out as is
+		if(!block_exists(block_index)) return -1;
+		block = raid5_addr(raid5_data_disk(block_index), block_index / (disk_count - 1));
+		if(block == NULL || block_checksum(block) != checksums(primary_disk)[block_index]) return -1;
+	} else if((block = get_block(block_index)) == NULL) {
+		return -1;
 	}
 
-	found:
-	if (blk < 0) return -ENOSPC;
-	
-	// Fill inode with initial information
-	struct wfs_inode* inode = (struct wfs_inode*)((char*)metadata + superblock->i_blocks_ptr + BLOCK_SIZE * blk);
-	for(int i = 0; i < N_BLOCKS; i++) {
-		inode->blocks[i] = -1;
+	// The block lives in the closest mapping that starts below it
+	int fd = -1;
+	for(int i = 0; i < disk_count; i++) {
+		if(regions[i] == NULL || block < (char *)regions[i]) continue;
+		off_t at = block - (char *)regions[i];
+		if(fd < 0 || at < *pos) {
+			*pos = at;
+			fd = disk_fds[i];
+		}
 	}
-	inode->num = blk;
-	inode->mode = mode;
-	inode->uid = getuid();
-	inode->gid = getgid();
-	inode->size = 0;
-	inode->nlinks = 0;
-	time_t t;
-	time(&t);
-	inode->ctim = t;
-	inode->atim = t;
-	inode->mtim = t;
-	update_metadata();
-	printf("Inode number %d allocated\n", (int)blk);
-	return blk;
+	return fd;
 }
 
+// Start of the tables after the data region, the region is narrower than
+// num_data_blocks on striped arrays
+off_t tables_ptr() {
+	return raid_mode == 5 ? superblock->csum_ptr : superblock->groups_ptr;
+}
 
-
-// Return -1 if fail
-off_t get_datablock_index_from_inode(int i, off_t *blocks) {
-	if (i < 0) return -1;
-	if(i <= D_BLOCK) {
-		return blocks[i];
-	} else if(i <= D_BLOCK + BLOCK_SIZE / sizeof(off_t)) {
-		if(blocks[IND_BLOCK] == -1) return -1;
-		off_t *block = (off_t *)get_block(blocks[IND_BLOCK]);
-		if(block == NULL) return -1;
-
-		return block[i - (D_BLOCK + 1)];
-	} else return -1;
+// Copy the blocks of [off, off + len) that differ from the primary to the other disks
+// Return the number of blocks copied
+off_t resync_copy(off_t off, off_t len) {
+	off_t copied = 0;
+	for(int i = 0; i < disk_count; i++) {
+		if(regions[i] == NULL || i == primary_disk) continue;
+		for(off_t at = off; at < off + len; at += BLOCK_SIZE) {
+			off_t n = off + len - at < BLOCK_SIZE ? off + len - at : BLOCK_SIZE;
+			char *src = (char *)regions[primary_disk] + at, *dst = (char *)regions[i] + at;
+			if(memcmp(dst, src, n) != 0) {
+				memcpy(dst, src, n);
+				copied++;
+			}
+		}
+	}
+	return copied;
 }
 
-// Return NULL if fail
-struct wfs_dentry *find_dentry(struct wfs_inode *dir_inode, const char *name, off_t *blocknumber, void **blockptr) {
-	// Make sure it's a directory
-	if(!(S_IFDIR & dir_inode->mode)) {
-		printf("Parent is not directory\n");
-		return NULL;
+// Rebuild the one data member of stripe that fails its checksum, a member
+// that still fails after the rebuild is a write the crash cut off before its
+// checksum and is kept
+// Return 1 if a member was rebuilt
+int raid5_resync_member(off_t stripe) {
+	off_t bad = -1;
+	int fails = 0;
+	for(off_t b = stripe * (disk_count - 1); b < (stripe + 1) * (disk_count - 1); b++) {
+		if(b >= superblock->num_data_blocks || !block_exists(b)) continue;
+		if(block_checksum(raid5_addr(raid5_data_disk(b), stripe)) != checksums(primary_disk)[b]) {
+			bad = b;
+			fails++;
+		}
 	}
+	if(fails != 1) return 0;
+
+	char rebuilt[BLOCK_SIZE];
+	if(raid5_rebuild(stripe, raid5_data_disk(bad), rebuilt) < 0) return 0;
+	if(block_checksum(rebuilt) != checksums(primary_disk)[bad]) return 0;
+	printf("raid 5 block %ld failed its checksum, repaired from parity\n", (long)bad);
+	memcpy(raid5_addr(raid5_data_disk(bad), stripe), rebuilt, BLOCK_SIZE);
+	return 1;
+}
 
-	printf("Searching for %s\n", name);
-
-	off_t *block_indicies = dir_inode->blocks;
-	struct wfs_dentry *curr_dentry;
-
-	// Search each data block
-	for(int i = 0; i < D_BLOCK; i++) {
-		if(block_indicies[i] == -1) continue;
+// Make every copy of data region r agree. Mirrors take the primary's copy,
+// raid 1v the majority and raid 10 the group's first present disk. Raid 5
+// first rebuilds a data member that fails its checksum, then recomputes
+// checksums and parity from the data members.
+// Return the number of blocks rewritten
+off_t resync_region(off_t r) {
+	off_t first = r * superblock->wib_chunk;
+	off_t last = first + superblock->wib_chunk;
+	if(last > superblock->num_data_blocks) last = superblock->num_data_blocks;
+	off_t fixed = 0;
+
+	if(raid_mode == 5) {
+		if(missing_disks > 0) return 0;
+		void *srcs[MAX_DISK];
+		char parity[BLOCK_SIZE];
+		for(off_t stripe = first / (disk_count - 1); stripe <= (last - 1) / (disk_count - 1); stripe++) {
+			fixed += raid5_resync_member(stripe);
+			int count = 0;
+			for(int d = 0; d < disk_count; d++) {
+				if(d != raid5_parity_disk(stripe)) srcs[count++] = raid5_addr(d, stripe);
+			}
+			xor_blocks(parity, srcs, count);
+			char *stored = raid5_addr(raid5_parity_disk(stripe), stripe);
+			if(memcmp(stored, parity, BLOCK_SIZE) != 0) {
+				memcpy(stored, parity, BLOCK_SIZE);
+				fixed++;
+			}
+		}
+		for(off_t b = first; b < last; b++) {
+			if(!block_exists(b)) continue;
+			uint32_t sum = block_checksum(raid5_addr(raid5_data_disk(b), b / (disk_count - 1)));
+			for(int d = 0; d < disk_count; d++) checksums(d)[b] = sum;
+		}
+		return fixed;
+	}
 
-		curr_dentry = (struct wfs_dentry *) get_block(block_indicies[i]);
-		if(curr_dentry != NULL) {
-			// Search each dentry in data block
-			for(int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
-				if(curr_dentry[j].num != 0 && strcmp(curr_dentry[j].name, name) == 0) {
-					*blocknumber = block_indicies[i];
-					*blockptr = (void*) curr_dentry;
-					return &curr_dentry[j];
-				}
+	for(off_t b = first; b < last; b++) {
+		// Free blocks are zeroed when they are handed out again
+		if(!block_exists(b)) continue;
+		char *src;
+		int from = primary_disk, to = disk_count;
+		if(raid_mode == 10) {
+			from = raid10_first_disk(b);
+			to = from + superblock->raid_width;
+			while(regions[from] == NULL) from++;
+			src = raid10_addr(from, b);
+		} else if((src = get_block(b)) == NULL) {
+			continue;
+		}
+		for(int d = raid_mode == 10 ? from : 0; d < to; d++) {
+			if(regions[d] == NULL) continue;
+			char *dst = raid_mode == 10 ? raid10_addr(d, b) : (char *)regions[d] + superblock->d_blocks_ptr + b * BLOCK_SIZE;
+			if(dst != src && memcmp(dst, src, BLOCK_SIZE) != 0) {
+				memcpy(dst, src, BLOCK_SIZE);
+				fixed++;
 			}
 		}
 	}
-	// No matching dentry found
-	printf("No matching dentry found\n");
-	return NULL;
+	return fixed;
 }
 
-// Return -1 if block failure, -ENOSPC if space failure
-int alloc_dentry(struct wfs_inode* dir_inode, int num, char* name) {
-	struct wfs_dentry *curr_dentry;
+// Resync what the bits left by an unclean shutdown cover, then mark the array mounted
+// No Return
+void wib_resync() {
+	if(superblock->wib_ptr == 0) return;
+	struct timespec begin, finish;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	// A crash may have left a bit on some disks only
+	off_t count = wib_regions();
+	off_t dirty = 0, fixed = 0;
+	int unclean = 0;
+	for(off_t bit = 0; bit <= count; bit++) {
+		int set = 0;
+		for(int i = 0; i < disk_count; i++) {
+			if(regions[i] != NULL) set |= (wib_map(i)[bit / 8] >> (bit % 8)) & 1;
+		}
+		if(!set) continue;
+		if(bit == count) {
+			// Bitmaps, inodes and the tables after the data region
+			unclean = 1;
+			off_t tail = tables_ptr();
+			fixed += resync_copy(superblock->i_bitmap_ptr, superblock->d_blocks_ptr - superblock->i_bitmap_ptr);
+			fixed += resync_copy(tail, superblock->wib_ptr - tail);
+		} else {
+			unclean = 1;
+			dirty++;
+			fixed += resync_region(bit);
+		}
+	}
+	if(raid_mode == 5 && missing_disks > 0 && dirty > 0) {
+		printf("raid 5 parity of %ld regions can not be resynced with a disk missing\n", (long)dirty);
+	}
 
-	// find free block
-	for (int i = 0; i < D_BLOCK; i++) {
-		if (dir_inode->blocks[i] == -1) continue;
-		if((curr_dentry = (struct wfs_dentry *) get_block(dir_inode->blocks[i])) == NULL) return -1;
+	wib_dirty = dirty;
+	wib_clear(1);
+	wib_set(count);
+	if(unclean) {
+		clock_gettime(CLOCK_MONOTONIC, &finish);
+		printf("Resynced %ld of %ld regions after an unclean shutdown, %ld blocks rewritten in %.3fs\n", (long)dirty, (long)count,
+			(long)fixed, (finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9);
+	}
+}
 
-		// find free dentry in this block
-		for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
-			if (curr_dentry[j].num == 0) {
-				curr_dentry[j].num = num;
-				strncpy(curr_dentry[j].name, name, strlen(name));
-				dir_inode->nlinks++; 
-				update_all_datablocks(dir_inode->blocks[i], curr_dentry);
-				return 0;
-			}
+// Data block slots on each disk, raid 5 has one per stripe
+off_t disk_slots() {
+	off_t n = superblock->num_data_blocks;
+	if(raid_mode == 0) return (n + disk_count - 1) / disk_count;
+	if(raid_mode == 10) return (n + raid10_groups() - 1) / raid10_groups();
+	if(raid_mode == 5) return (n + disk_count - 2) / (disk_count - 1);
+	return n;
+}
+
+// Return 1 if slot of disk holds nothing live, a raid 5 parity slot is live
+// while any block of its stripe is
+int slot_free(int disk, off_t slot) {
+	off_t n = superblock->num_data_blocks;
+	off_t blk = slot;
+	if(raid_mode == 0) {
+		blk = slot * disk_count + disk;
+	} else if(raid_mode == 10) {
+		blk = slot * raid10_groups() + disk / superblock->raid_width;
+	} else if(raid_mode == 5) {
+		int parity = raid5_parity_disk(slot);
+		for(off_t b = slot * (disk_count - 1); b < (slot + 1) * (disk_count - 1) && b < n; b++) {
+			if((disk == parity || raid5_data_disk(b) == disk) && block_exists(b)) return 0;
 		}
+		return 1;
 	}
+	return blk >= n || !block_exists(blk);
+}
 
-	// no free dentry or block found
-	for (int i = 0; i < D_BLOCK; i++) {
-		if (dir_inode->blocks[i] == -1) { // allocate unallocated block from before
-			off_t new_block = allocate_block();
-			if (new_block < 0) return -ENOSPC;
+// Return 1 if grain g of disk lies in the data area and covers only free slots
+int grain_free(int disk, off_t g) {
+	off_t start = g * DISCARD_GRAIN - superblock->d_blocks_ptr;
+	if(start < 0 || start + DISCARD_GRAIN > disk_slots() * BLOCK_SIZE) return 0;
+	for(off_t s = start / BLOCK_SIZE; s < (start + DISCARD_GRAIN) / BLOCK_SIZE; s++) {
+		if(!slot_free(disk, s)) return 0;
+	}
+	return 1;
+}
 
-			dir_inode->blocks[i] = new_block;
+// Slots holding a copy of blk, raid 5 counts the parity of its stripe too
+// Return the number of slots
+int block_slots(off_t blk, int *disks, off_t *slots) {
+	int count = 0;
+	if(raid_mode == 0) {
+		disks[count] = blk % disk_count;
+		slots[count++] = blk / disk_count;
+	} else if(raid_mode == 10) {
+		int first = raid10_first_disk(blk);
+		for(int i = first; i < first + superblock->raid_width; i++) {
+			disks[count] = i;
+			slots[count++] = blk / raid10_groups();
+		}
+	} else if(raid_mode == 5) {
+		off_t stripe = blk / (disk_count - 1);
+		disks[count] = raid5_data_disk(blk);
+		slots[count++] = stripe;
+		disks[count] = raid5_parity_disk(stripe);
+		slots[count++] = stripe;
+	} else {
+		for(int i = 0; i < disk_count; i++) {
+			disks[count] = i;
+			slots[count++] = blk;
+		}
+	}
+	return count;
+}
 
-			// initialize entries
-			if((curr_dentry = (struct wfs_dentry *) get_block(dir_inode->blocks[i])) == NULL) return -1;
-			
-			curr_dentry[0].num = num;
-			strncpy(curr_dentry[0].name, name, MAX_NAME);
-			dir_inode->nlinks++;
-			dir_inode->size += BLOCK_SIZE;
-			update_all_datablocks(dir_inode->blocks[i], curr_dentry);
-			return 0;
+// Give grains [first, last] of disk back to the host, they read as zeros after
+// Return the number of grains punched
+off_t punch_grains(int disk, off_t first, off_t last) {
+	if(fallocate(disk_fds[disk], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first * DISCARD_GRAIN, (last - first + 1) * DISCARD_GRAIN) < 0) {
+		perror("discard: fallocate failed\n");
+		return 0;
+	}
+	return last - first + 1;
+}
+
+// Punch the pending blocks out of every image holding them. A block only
+// shares its grain with neighbours, so a grain goes once all of them are
+// free, and adjacent grains of a disk go in one call.
+// No Return
+void discard_flush() {
+	off_t run_lo[MAX_DISK], run_hi[MAX_DISK], seen[MAX_DISK];
+	for(int i = 0; i < disk_count; i++) run_lo[i] = run_hi[i] = seen[i] = -1;
+	off_t punched = 0, blocks = discard_count;
+
+	for(off_t b = 0; b < superblock->num_data_blocks && discard_count > 0; b++) {
+		if(discard_pending[b / 8] == 0) {
+			b += 7 - b % 8;
+			continue;
+		}
+		if(!(discard_pending[b / 8] & (1 << (b % 8)))) continue;
+		discard_pending[b / 8] &= ~(1 << (b % 8));
+		discard_count--;
+
+		// Slots come in ascending order per disk, so runs only grow at their end
+		int disks[MAX_DISK];
+		off_t slots[MAX_DISK];
+		int count = block_slots(b, disks, slots);
+		for(int i = 0; i < count; i++) {
+			int d = disks[i];
+			off_t g = (superblock->d_blocks_ptr + slots[i] * BLOCK_SIZE) / DISCARD_GRAIN;
+			if(regions[d] == NULL || g == seen[d]) continue;
+			seen[d] = g;
+			if(!grain_free(d, g)) continue;
+			if(run_lo[d] >= 0 && run_hi[d] == g - 1) {
+				run_hi[d] = g;
+				continue;
+			}
+			if(run_lo[d] >= 0) punched += punch_grains(d, run_lo[d], run_hi[d]);
+			run_lo[d] = run_hi[d] = g;
 		}
 	}
+	for(int d = 0; d < disk_count; d++) {
+		if(run_lo[d] >= 0) punched += punch_grains(d, run_lo[d], run_hi[d]);
+	}
+	discard_count = 0;
+	printf("Discarded %ld freed blocks, punched %ld KiB out of the images\n", (long)blocks, (long)(punched * DISCARD_GRAIN / 1024));
+}
 
-	return -ENOSPC;
+// Adjust the free block count of blk's group, the table is mirrored by update_metadata
+// No Return
+void count_block(off_t blk, int delta) {
+	group_table[blk / group_blocks].free_blocks += delta;
+	mark_dirty(&group_ranges, blk / group_blocks);
+	free_blocks_total += delta;
 }
 
-// Return NULL if fail
-struct wfs_inode *get_inode_from_path(const char *path) {
+// No Return
+void count_inode(int num, mode_t mode, int delta) {
+	group_table[num / group_inodes].free_inodes += delta;
+	if(S_ISDIR(mode)) group_table[num / group_inodes].dirs -= delta;
+	mark_dirty(&group_ranges, num / group_inodes);
+	free_inodes_total += delta;
+}
 
-	struct wfs_inode *curr_inode = get_inode(0);
+// Adjust the references to blk, the table is written by update_metadata
+// No Return
+void count_ref(off_t blk, int delta) {
+	block_refs[blk] += delta;
+	mark_dirty(&ref_ranges, blk);
+}
 
-	if(strcmp(path, "/") == 0) {
-		printf("root node: %p", (void *)curr_inode);
-		return curr_inode;
-	}
+// Return 1 if a snapshot still references blk
+int block_shared(off_t blk) {
+	return block_refs != NULL && block_refs[blk] > 0;
+}
 
-	char *path_copy = strdup(path);
-	if(path_copy == NULL) {
-		perror("strdup failure\n");
-		return NULL;
+// Clear blk in its bitmap without mirroring metadata, callers must update_metadata
+// No Return
+void release_block(off_t blk) {
+	void *disk;
+
+	// Blocks a snapshot still uses only lose a reference
+	if(block_shared(blk)) {
+		count_ref(blk, -1);
+		return;
 	}
-	char *rem_path = path_copy;
-	char *tok = strtok(rem_path, "/");
-	struct wfs_dentry *dentry;
-	while(tok) {
-		// Check if curr inode is directory
-		if(!(S_IFDIR & curr_inode->mode)) {
-			free(path_copy);
-			printf("Not a directory\n");
-			return NULL;
-		}
 
-		// Find dentry in current inode and corresponding next inode
-		off_t blocknumber;
-		void *blockptr;
-		if((dentry = find_dentry(curr_inode, tok, &blocknumber, &blockptr)) == NULL) {
-			free(path_copy);
-			printf("Find dentry failed \n");
-			return NULL;
-		}
-		(void)blocknumber;
-		(void)blockptr;
+	// Update specific disk if raid 0, otherwise update metadata and therefore all disks
+	if(raid_mode == 0) 
+		disk = regions[blk % disk_count];	
+	else 
+		disk = metadata;
 
-		if((curr_inode = get_inode(dentry->num)) == NULL) {
-			free(path_copy);
-			printf("Get inode failed\n");
-			return NULL;
-		}
+	// Raid 5 keeps free blocks zeroed so stripes nobody uses always have valid parity
+	if(raid_mode == 5 && block_exists(blk)) {
+		static char zero_block[BLOCK_SIZE];
+		update_all_datablocks(blk, zero_block);
+	}
 
-		tok = strtok(NULL, "/");
+	uint8_t* bitmap = (uint8_t*)((char*)disk + superblock->d_bitmap_ptr);
+	if(bitmap[blk / 8] & (1 << (blk % 8))) {
+		if(raid_mode == 0) disk_free[blk % disk_count]++;
+		count_block(blk, 1);
+		cache_drop(blk);
+		if(discard_pending != NULL && !(discard_pending[blk / 8] & (1 << (blk % 8)))) {
+			discard_pending[blk / 8] |= 1 << (blk % 8);
+			discard_count++;
+		}
 	}
+	bitmap[blk / 8] &= ~(1 << (blk % 8));
+	if(raid_mode != 0) bitmap_dirty(&bitmap[blk / 8]);
+}
 
-	free(path_copy);
-	return curr_inode;
+// No Return
+void free_block(off_t blk) {
+	release_block(blk);
+	update_metadata();
 }
 
-// Returns -ENOENT if fail
-int unlink_(struct wfs_inode *parent, char *filename) {
-	if(!(S_IFDIR & parent->mode)) {
-		perror("Trying to unlink from non-directory\n");
-		return -ENOENT;
+// Release every data and indirect block of inode, callers must update_metadata
+// No Return
+void release_inode_blocks(struct wfs_inode *inode) {
+	// Free all direct blocks
+	for(int i = 0; i <= D_BLOCK; i++) {
+		if(inode->blocks[i] > -1) {
+			release_block(inode->blocks[i]);
+		}
 	}
 
-	struct wfs_dentry *dentry;
-	void *blockptr;
-	off_t blocknumber;
-	if((dentry = find_dentry(parent, filename, &blocknumber, &blockptr)) == NULL) {
-		return -ENOENT;
+	// Free indirect block and inner blocks
+	if(inode->blocks[IND_BLOCK] > -1) {
+		off_t *ind_block = (off_t *)get_block(inode->blocks[IND_BLOCK]);
+		if(ind_block != NULL) {
+			for(int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+				if(ind_block[i] > -1) {
+					release_block(ind_block[i]);
+				}
+			}
+		}
+		release_block(inode->blocks[IND_BLOCK]);
 	}
+}
 
-	struct wfs_inode *inode;
-	if((inode = get_inode(dentry->num)) == NULL) {
-		return -ENOENT;
-	}
+// No Return
+void free_inode(int index) {
 
-	if(S_IFDIR & inode->mode) {
-		// ENOENT because expecting file, not directory
-		return -ENOENT;
-	}
+	struct wfs_inode *inode = get_inode(index);
 
-	inode->nlinks--;
-	if(inode->nlinks <= 0) {
-		free_inode(dentry->num);
+	if (inode == NULL) {
+		perror("no inode with given index");
+		return;
 	}
-	dentry->num = 0;
+	release_inode_blocks(inode);
+	wcache_drop_inode(index);
 
+	// One metadata update for the whole inode
+	uint8_t* bitmap = (uint8_t*)((char*)metadata + superblock->i_bitmap_ptr);
+	bitmap[index / 8] &= ~(1 << (index % 8));
+	bitmap_dirty(&bitmap[index / 8]);
+	count_inode(index, inode->mode, 1);
 	update_metadata();
-	update_all_datablocks(blocknumber, blockptr);
-	return 0;
 }
 
-// Returns -ENOENT if fail
-int separate_paths(char *path_copy1, char *path_copy2, char **parent_path, char **entry_name) {
-
-	int last_slash_index = -1;
-	for(int i = 0; i < strlen(path_copy1); i++) {
-		if(path_copy1[i] == '/') last_slash_index = i;
+// Zero a freshly allocated block on every disk holding it
+// No Return
+void clear_block(off_t blk) {
+	if(raid_mode == 5) {
+		// Stale contents of a free block have no valid checksum, write zeros straight through
+		static char zero_block[BLOCK_SIZE];
+		update_all_datablocks(blk, zero_block);
+		return;
 	}
+	void *newblock = get_block_for_write(blk);
+	memset(newblock, 0, BLOCK_SIZE);
+	update_all_datablocks(blk, newblock);
+}
 
-	if(last_slash_index < 0 || last_slash_index == (strlen(path_copy1) - 1)) {
-		perror("Either no parent or child in path\n");
-		return -ENOENT;
+// Load the group table
+// Return -1 if fail
+int init_groups() {
+	group_cnt = superblock->group_cnt;
+	group_blocks = superblock->group_blocks;
+	group_inodes = superblock->group_inodes;
+
+	group_table = calloc(group_cnt, sizeof(struct wfs_group));
+	if(group_table == NULL) return -1;
+	memcpy(group_table, (char *)regions[primary_disk] + superblock->groups_ptr, group_cnt * sizeof(struct wfs_group));
+
+	free_blocks_total = 0;
+	free_inodes_total = 0;
+	for(int g = 0; g < group_cnt; g++) {
+		free_blocks_total += group_table[g].free_blocks;
+		free_inodes_total += group_table[g].free_inodes;
 	}
-
-	*parent_path = path_copy1;
-	(*parent_path)[last_slash_index + 1] = '\0';
-	*entry_name = path_copy2 + (last_slash_index + 1);
 	return 0;
 }
 
-static int wfs_getattr(const char *path, struct stat *stbuf) {
-	struct wfs_inode *inode;
-	if((inode = get_inode_from_path(path)) == NULL) {
-		return -ENOENT;
+// Load the block reference counts and set up the /.snapshots directory
+// Return -1 if fail
+int init_snapshots() {
+	if(superblock->refs_ptr != 0) {
+		block_refs = malloc(superblock->num_data_blocks * sizeof(uint32_t));
+		if(block_refs == NULL) return -1;
+		memcpy(block_refs, (char *)regions[primary_disk] + superblock->refs_ptr, superblock->num_data_blocks * sizeof(uint32_t));
 	}
+	if(!(superblock->features & WFS_FEATURE_SNAPSHOT)) return 0;
 
-	stbuf->st_uid = inode->uid;
-	stbuf->st_gid = inode->gid;
-	stbuf->st_atime = inode->atim;
-	stbuf->st_mtime = inode->mtim;
-	stbuf->st_mode = inode->mode;
-	stbuf->st_size = inode->size;
+	memset(&snapshot_root, 0, sizeof(struct wfs_inode));
+	snapshot_root.mode = S_IFDIR | 0555;
+	snapshot_root.uid = getuid();
+	snapshot_root.gid = getgid();
+	snapshot_root.nlinks = 2;
+	for(int i = 0; i < N_BLOCKS; i++) {
+		snapshot_root.blocks[i] = -1;
+	}
 	return 0;
 }
 
-static int wfs_mknod(const char* path, mode_t mode, dev_t rdev) {
-	(void)rdev;
-	printf("wfs_mknod, path: (%s)\n", path);
+// Count free blocks on every raid 0 disk and reset the allocation cursors
+void init_allocator() {
+	for(int d = 0; d < disk_count; d++) {
+		disk_free[d] = 0;
+		disk_cursor[d] = d;
+		if(raid_mode != 0) continue;
 
-	// Make sure it doesn't exist
-	if(get_inode_from_path(path) != NULL) {
-		return -EEXIST;
+		uint8_t *bitmap = (uint8_t*)((char*)regions[d] + superblock->d_bitmap_ptr);
+		for(off_t i = d; i < superblock->num_data_blocks; i += disk_count) {
+			if(!(bitmap[i / 8] & (1 << i % 8))) disk_free[d]++;
+		}
 	}
+}
 
-	char *path_copy1 = strdup(path);
-	char *path_copy2 = strdup(path);
-	if (!path_copy1 || !path_copy2) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOMEM;
-	}
+// Raid 0 only, return -1 if disk is full
+off_t allocate_on_disk(int disk) {
+	uint8_t *bitmap = (uint8_t*)((char*)regions[disk] + superblock->d_bitmap_ptr);
+	if(disk_free[disk] == 0) return -1;
 
-	// obtain parent path and created file name
-	char *parent_path;
-	char *entry_name;
-	if(separate_paths(path_copy1, path_copy2, &parent_path, &entry_name) < 0) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOENT;
-	}
+	// Blocks of a disk are every disk_count'th global index, resume at the cursor and wrap once
+	off_t first = disk_cursor[disk];
+	off_t i = first;
+	do {
+		if (!(bitmap[i / 8] & (1 << i % 8))) {
+			bitmap[i / 8] |= (1 << i % 8);
+			disk_free[disk]--;
+			count_block(i, -1);
+			disk_cursor[disk] = i + disk_count < superblock->num_data_blocks ? i + disk_count : disk;
+			return i;
+		}
+		i += disk_count;
+		if(i >= superblock->num_data_blocks) i = disk;
+	} while(i != first);
 
-	struct wfs_inode* parent = get_inode_from_path(parent_path);
-	if (parent == NULL) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOMEM;
+	return -1;
+}
+
+// Return -1 if fail
+off_t get_datablock_index_from_inode(int i, off_t *blocks) {
+	if (i < 0) return -1;
+	if(i <= D_BLOCK) {
+		return blocks[i];
+	} else if(i <= D_BLOCK + BLOCK_SIZE / sizeof(off_t)) {
+		if(blocks[IND_BLOCK] == -1) return -1;
+		off_t *block = (off_t *)get_block(blocks[IND_BLOCK]);
+		if(block == NULL) return -1;
+
+		return block[i - (D_BLOCK + 1)];
+	} else return -1;
+}
+
+// Take the first free block of group g, trying goal first
+// Return -1 if the group is full
+off_t allocate_in_group(int g, off_t goal) {
+	uint8_t *bitmap = (uint8_t*)((char*)metadata + superblock->d_bitmap_ptr);
+	off_t start = (off_t)g * group_blocks;
+	off_t end = start + group_blocks;
+	if(end > superblock->num_data_blocks) end = superblock->num_data_blocks;
+	if(group_table[g].free_blocks == 0) return -1;
+
+	if(goal >= start && goal < end && !(bitmap[goal / 8] & (1 << goal % 8))) {
+		start = goal;
+	}
+	for(off_t i = start; i < end; i++) {
+		// Skip full bitmap bytes without testing each bit
+		if(i % 8 == 0 && i + 8 <= end && bitmap[i / 8] == 0xFF) {
+			i += 7;
+			continue;
+		}
+		if (!(bitmap[i / 8] & (1 << i % 8))) {
+			bitmap[i / 8] |= (1 << i % 8);
+			bitmap_dirty(&bitmap[i / 8]);
+			count_block(i, -1);
+			return i;
+		}
 	}
+	// The goal skipped the start of the group
+	if(start != (off_t)g * group_blocks) return allocate_in_group(g, -1);
+	return -1;
+}
 
-	if((parent->mode & S_IFDIR) == 0) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOENT;
+// Group with the most free blocks, large files spread out into it
+int emptiest_group() {
+	int best = 0;
+	for(int g = 1; g < group_cnt; g++) {
+		if(group_table[g].free_blocks > group_table[best].free_blocks) best = g;
 	}
+	return best;
+}
 
-	off_t blk = allocate_inode(mode);
-	if (blk < 0) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOSPC;
+// Allocate a block for logical block lblk of owner, IND_KEY for its indirect block
+// Return -ENOSPC if fail
+off_t allocate_block(struct wfs_inode *owner, off_t lblk) {
+	off_t blk = -1;
+
+	if(raid_mode == 0) {
+		// Keep consecutive blocks of a file round robin across the disks,
+		// starting each file on a different disk. The indirect block goes
+		// with the last direct block, away from the first block it maps.
+		int target = (owner->num + (lblk == IND_KEY ? D_BLOCK : lblk)) % disk_count;
+		for(int d = 0; d < disk_count && blk == -1; d++) {
+			blk = allocate_on_disk((target + d) % disk_count);
+		}
+	} else {
+		// Small files and directories stay in their inode's group, blocks
+		// behind the indirect block go with it into the emptiest group,
+		// and every block tries to follow the previous one on disk: the
+		// indirect block follows the last direct block and is followed by
+		// the first block it maps
+		int group = owner->num / group_inodes;
+		if(group >= group_cnt) group = group_cnt - 1;
+		off_t goal = -1;
+
+		if(lblk > D_BLOCK || lblk == IND_KEY) {
+			if(owner->blocks[IND_BLOCK] >= 0) group = owner->blocks[IND_BLOCK] / group_blocks;
+			else group = emptiest_group();
+		}
+		if(lblk == IND_KEY || (lblk > 0 && lblk <= D_BLOCK + BLOCK_SIZE / sizeof(off_t))) {
+			off_t prev;
+			if(lblk == IND_KEY) prev = owner->blocks[D_BLOCK];
+			else if(lblk == IND_BLOCK && owner->blocks[IND_BLOCK] >= 0) prev = owner->blocks[IND_BLOCK];
+			else prev = get_datablock_index_from_inode(lblk - 1, owner->blocks);
+			if(prev >= 0) {
+				goal = prev + 1;
+				if(goal < superblock->num_data_blocks && lblk >= 0 && lblk <= D_BLOCK) group = goal / group_blocks;
+			}
+		}
+
+		for(int g = 0; g < group_cnt && blk == -1; g++) {
+			blk = allocate_in_group((group + g) % group_cnt, goal);
+		}
 	}
 
-	free(path_copy1);
-	if (alloc_dentry(parent, blk, entry_name) < 0){
-		int8_t *bitmap = (int8_t *)((char *)metadata + superblock->i_bitmap_ptr);
-		bitmap[blk / 8] &= 1 << blk % 8;
-		update_metadata();
-		free(path_copy2);
-		return -ENOSPC;
-	} 
-	free(path_copy2);
-	get_inode(blk)->nlinks++;
-	update_metadata();
-	
-	return 0;
+	if(blk == -1) return -ENOSPC;
 
+	update_metadata();
+	clear_block(blk);
+	return blk;
 }
 
-static int wfs_mkdir(const char* path, mode_t mode) {
-	printf("wfs_mkdir, path: (%s)\n", path);
+// Reserve count contiguous free blocks, not used for raid 0 which spreads files across disks
+// Return -ENOSPC if there is no free run that long
+off_t allocate_run(off_t count) {
+	uint8_t* bitmap = (uint8_t*)((char*)metadata + superblock->d_bitmap_ptr);
+	off_t run = 0;
 
-	// Make sure it doesn't exist
-	if(get_inode_from_path(path) != NULL) {
-		return -EEXIST;
-	}
+	for(off_t i = 0; i < superblock->num_data_blocks; i++) {
+		if(bitmap[i / 8] & (1 << i % 8)) {
+			run = 0;
+			continue;
+		}
+		if(++run < count) continue;
 
-	char *path_copy1 = strdup(path);
-	char *path_copy2 = strdup(path);
-	if (!path_copy1 || !path_copy2) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOMEM;
+		off_t start = i - count + 1;
+		for(off_t b = start; b <= i; b++) {
+			bitmap[b / 8] |= (1 << b % 8);
+			bitmap_dirty(&bitmap[b / 8]);
+			count_block(b, -1);
+		}
+		update_metadata();
+		for(off_t b = start; b <= i; b++) {
+			clear_block(b);
+		}
+		return start;
 	}
+	return -ENOSPC;
+}
 
-	// obtain parent path and created directory name
-	char *parent_path;
-	char *entry_name;
-	if(separate_paths(path_copy1, path_copy2, &parent_path, &entry_name) < 0) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOENT;
+// Files go into their parent's group, directories into the group with the
+// most free inodes so the tree spreads over the disk
+// Return -ENOSPC if fail
+off_t allocate_inode(mode_t mode, struct wfs_inode *parent) {
+	uint8_t* bitmap = (uint8_t*)((char*)metadata + superblock->i_bitmap_ptr);
+
+	int group = parent->num / group_inodes;
+	if(S_ISDIR(mode)) {
+		for(int g = 0; g < group_cnt; g++) {
+			if(group_table[g].free_inodes > group_table[group].free_inodes ||
+				(group_table[g].free_inodes == group_table[group].free_inodes && group_table[g].dirs < group_table[group].dirs)) {
+				group = g;
+			}
+		}
 	}
 
-	struct wfs_inode* parent = get_inode_from_path(parent_path);
-	if (parent == NULL) {
-		free(path_copy1);
-		free(path_copy2);
-		printf("Failed Here\n");
-		return -ENOMEM;
+	off_t blk = -1;
+	for (int g = 0; g < group_cnt; g++) {
+		int curr = (group + g) % group_cnt;
+		if(group_table[curr].free_inodes == 0) continue;
+
+		uint32_t end = (uint32_t)(curr + 1) * group_inodes;
+		if(end > superblock->num_inodes) end = superblock->num_inodes;
+		for (uint32_t i = (uint32_t)curr * group_inodes / 8; i < end / 8; i++) {
+			if (bitmap[i] == 0xFF)
+				continue;
+
+			for (uint32_t k = 0; k < 8; k++) {
+				if (!(bitmap[i] & (1 << k))) {
+					// allocate inodes on all disks
+					bitmap[i] |= (1 << k);
+					bitmap_dirty(&bitmap[i]);
+					blk =  8 * i + k;
+					goto found;
+				}
+			}
+		}
 	}
 
-	if((parent->mode & S_IFDIR) == 0) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOENT;
+	found:
+	if (blk < 0) return -ENOSPC;
+	
+	// Fill inode with initial information, clearing whatever a previous owner left in the block
+	struct wfs_inode* inode = inode_block(blk);
+	touch_inode(blk);
+	memset(inode, 0, BLOCK_SIZE);
+	if((superblock->features & WFS_FEATURE_INLINE) && S_ISREG(mode)) {
+		inode->flags |= WFS_INODE_INLINE;
 	}
+	if((superblock->features & WFS_FEATURE_COMPRESS) || (parent->flags & WFS_INODE_COMPRESS)) {
+		inode->flags |= WFS_INODE_COMPRESS;
+	}
+	for(int i = 0; i < N_BLOCKS; i++) {
+		inode->blocks[i] = -1;
+	}
+	inode->num = blk;
+	inode->mode = mode;
+	count_inode(blk, mode, -1);
+	inode->uid = getuid();
+	inode->gid = getgid();
+	inode->size = 0;
+	inode->nlinks = 0;
+	time_t t;
+	time(&t);
+	inode->ctim = t;
+	inode->atim = t;
+	inode->mtim = t;
+	update_metadata();
+	printf("Inode number %d allocated\n", (int)blk);
+	return blk;
+}
 
-	off_t blk = allocate_inode(mode | S_IFDIR);
-	if (blk < 0) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOSPC;
+
+
+char *inline_data(struct wfs_inode *inode) {
+	return (char *)inode + sizeof(struct wfs_inode);
+}
+
+// Move inline contents into a regular data block once the file outgrows its inode
+// Return -ENOSPC if fail
+int migrate_inline(struct wfs_inode *inode) {
+	if(inode->size > 0) {
+		off_t blk = allocate_block(inode, 0);
+		if(blk < 0) return -ENOSPC;
+
+		char *block = get_block_for_write(blk);
+		memcpy(block, inline_data(inode), inode->size);
+		update_all_datablocks(blk, block);
+		inode->blocks[0] = blk;
 	}
 
-	free(path_copy1);
-	if (alloc_dentry(parent, blk, entry_name) < 0){
-		int8_t *bitmap = (int8_t *)((char *)metadata + superblock->i_bitmap_ptr);
-		bitmap[blk / 8] &= 1 << blk % 8;
-		update_metadata();
-		free(path_copy2);
-		return -ENOSPC;
-	} 
-	free(path_copy2);
-	get_inode(blk)->nlinks++;
+	memset(inline_data(inode), 0, INLINE_SIZE);
+	inode->flags &= ~WFS_INODE_INLINE;
 	update_metadata();
-	
 	return 0;
 }
 
-static int wfs_unlink(const char* path) {
-	struct wfs_inode *inode_to_unlink;
-	if((inode_to_unlink = get_inode_from_path(path)) == 0) {
-		return -ENOENT;
-	}
+// Copy blk, which a snapshot still references, into a block owned by the live tree
+// Return the copy, -ENOSPC if fail
+off_t unshare_block(struct wfs_inode *owner, off_t lblk, off_t blk) {
+	char copy[BLOCK_SIZE];
+	char *old = get_block(blk);
+	if(old == NULL) return -ENOENT;
+	memcpy(copy, old, BLOCK_SIZE);
+
+	off_t new_blk = allocate_block(owner, lblk);
+	if(new_blk < 0) return -ENOSPC;
+	char *block = get_block_for_write(new_blk);
+	memcpy(block, copy, BLOCK_SIZE);
+	update_all_datablocks(new_blk, block);
+	count_ref(blk, -1);
+	return new_blk;
+}
 
-	char *path_copy1 = strdup(path);
-	char *path_copy2 = strdup(path);
-	if (!path_copy1 || !path_copy2) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOMEM;
+// Copy the indirect block of inode before it is modified if a snapshot shares it
+// Return -ENOSPC if fail
+int unshare_indirect(struct wfs_inode *inode) {
+	off_t ind = inode->blocks[IND_BLOCK];
+	if(ind < 0 || !block_shared(ind)) return 0;
+
+	off_t copy = unshare_block(inode, IND_KEY, ind);
+	if(copy < 0) return -ENOSPC;
+	inode->blocks[IND_BLOCK] = copy;
+	update_metadata();
+	return 0;
+}
+
+// Point logical block i of inode at blk, creating the indirect block if needed
+// Return -EFBIG if i is past the indirect block, -ENOSPC or -ENOENT if fail
+int set_datablock_index(struct wfs_inode *inode, int i, off_t blk) {
+	if(i >= 0 && i <= D_BLOCK) {
+		// If index is one of the D blocks
+		inode->blocks[i] = blk;
+		return 0;
+	}
+	if(i < 0 || i > D_BLOCK + BLOCK_SIZE / sizeof(off_t)) {
+		// Index out of bounds
+		return -EFBIG;
 	}
 
-	// obtain parent path and created directory name
-	char *parent_path;
-	char *child_filename;
-	if(separate_paths(path_copy1, path_copy2, &parent_path, &child_filename) < 0) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOENT;
+	// Create new ind block if needed
+	if(inode->blocks[IND_BLOCK] == -1) {
+		off_t ind_block;
+		if((ind_block = allocate_block(inode, IND_KEY)) < 0) return -ENOSPC;
+		off_t *block = get_block_for_write(ind_block);
+		inode->blocks[IND_BLOCK] = ind_block;
+		for(int j = 0; j < BLOCK_SIZE / sizeof(off_t); j++) {
+			block[j] = -1;
+		}
+
+		update_all_datablocks(inode->blocks[IND_BLOCK], block);
+		update_metadata();
 	}
 
-	struct wfs_inode *parent;
-	if((parent = get_inode_from_path(parent_path)) == NULL) {
-		free(path_copy1);
-		free(path_copy2);
+	// Insert block pointer into ind block
+	if(unshare_indirect(inode) < 0) return -ENOSPC;
+	off_t *block = get_block_for_write(inode->blocks[IND_BLOCK]);
+	if(block == NULL) {
+		perror("getblock failed on indirect block\n");
 		return -ENOENT;
 	}
+	block[i - (D_BLOCK + 1)] = blk;
+	update_all_datablocks(inode->blocks[IND_BLOCK], block);
+	return 0;
+}
 
-	unlink_(parent, child_filename);
-	free(path_copy1);
-	free(path_copy2);
+// Block behind logical block i of inode, copied first if a snapshot shares it
+// Return -1 if not allocated, -ENOSPC if fail
+off_t writable_datablock(struct wfs_inode *inode, int i) {
+	off_t blk = get_datablock_index_from_inode(i, inode->blocks);
+	if(blk < 0 || !block_shared(blk)) return blk;
+
+	// The indirect block is copied first so pointing it at the copy cannot fail
+	if(i > D_BLOCK && unshare_indirect(inode) < 0) return -ENOSPC;
+	off_t copy = unshare_block(inode, i, blk);
+	if(copy < 0) return -ENOSPC;
+	if(set_datablock_index(inode, i, copy) < 0) return -ENOENT;
 	update_metadata();
-	return 0;
+	return copy;
 }
 
-static int wfs_rmdir(const char* path) {
-	printf("wfs_rmdir, path: %s\n", path);
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define LZ4_HASH_BITS (12)
+#define LZ4_MIN_MATCH (4)
+
+// Append one LZ4 sequence, a match of length 0 ends the stream with literals only
+// Return the new output length, -1 if it does not fit in cap
+int lz4_emit(uint8_t *dst, int op, int cap, const uint8_t *literals, int literal_len, int offset, int match_len) {
+	int ml = match_len - LZ4_MIN_MATCH;
+	int need = 1 + literal_len / 255 + 1 + literal_len + (match_len ? 2 + ml / 255 + 1 : 0);
+	if(op + need > cap) return -1;
+
+	uint8_t *token = &dst[op++];
+	*token = (literal_len < 15 ? literal_len : 15) << 4;
+	if(literal_len >= 15) {
+		int rest = literal_len - 15;
+		for(; rest >= 255; rest -= 255) dst[op++] = 255;
+		dst[op++] = rest;
+	}
+	memcpy(dst + op, literals, literal_len);
+	op += literal_len;
+	if(match_len == 0) return op;
+
+	dst[op++] = offset & 0xFF;
+	dst[op++] = offset >> 8;
+	*token |= ml < 15 ? ml : 15;
+	if(ml >= 15) {
+		int rest = ml - 15;
+		for(; rest >= 255; rest -= 255) dst[op++] = 255;
+		dst[op++] = rest;
+	}
+	return op;
+}
 
-	if (strcmp(path, "/") == 0) return -EPERM;
+// Greedy LZ4 block compression with a single hash probe per position
+// Return the compressed length, 0 if it does not fit in cap
+int lz4_compress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+	int table[1 << LZ4_HASH_BITS];
+	memset(table, 0xFF, sizeof(table));
+
+	// The format wants the last match to start 12 bytes and end 5 bytes before the end
+	int ip = 0, anchor = 0, op = 0;
+	while(ip < len - 12) {
+		uint32_t seq;
+		memcpy(&seq, src + ip, 4);
+		uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+		int ref = table[h];
+		table[h] = ip;
+		if(ref < 0 || ip - ref > 0xFFFF || memcmp(src + ref, src + ip, 4) != 0) {
+			ip++;
+			continue;
+		}
 
-	char *path_copy1 = strdup(path);
-	char *path_copy2 = strdup(path);
-	if (!path_copy1 || !path_copy2) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOMEM;
+		int match_len = LZ4_MIN_MATCH;
+		while(ip + match_len < len - 5 && src[ref + match_len] == src[ip + match_len]) match_len++;
+		if((op = lz4_emit(dst, op, cap, src + anchor, ip - anchor, ip - ref, match_len)) < 0) return 0;
+		ip += match_len;
+		anchor = ip;
 	}
+	if((op = lz4_emit(dst, op, cap, src + anchor, len - anchor, 0, 0)) < 0) return 0;
+	return op;
+}
 
-	// obtain parent path and created directory name
-	char *parent_path;
-	char *entry_name;
-	if(separate_paths(path_copy1, path_copy2, &parent_path, &entry_name) < 0) return -ENOENT;
-
-	struct wfs_inode* parent = get_inode_from_path(parent_path);
-	if (parent == NULL) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOMEM;
+// Return the decompressed length, -1 if the stream is malformed or overflows cap
+int lz4_decompress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+	int ip = 0, op = 0;
+	while(ip < len) {
+		int token = src[ip++];
+		int literal_len = token >> 4;
+		if(literal_len == 15) {
+			int b;
+			do {
+				if(ip >= len) return -1;
+				literal_len += (b = src[ip++]);
+			} while(b == 255);
+		}
+		if(ip + literal_len > len || op + literal_len > cap) return -1;
+		memcpy(dst + op, src + ip, literal_len);
+		ip += literal_len;
+		op += literal_len;
+		if(ip == len) break;
+
+		if(ip + 2 > len) return -1;
+		int offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		int match_len = (token & 0xF) + LZ4_MIN_MATCH;
+		if((token & 0xF) == 15) {
+			int b;
+			do {
+				if(ip >= len) return -1;
+				match_len += (b = src[ip++]);
+			} while(b == 255);
+		}
+		if(offset == 0 || offset > op || op + match_len > cap) return -1;
+		// Matches may overlap their own output, copy byte by byte
+		for(int i = 0; i < match_len; i++, op++) dst[op] = dst[op - offset];
 	}
+	return op;
+}
 
-	struct wfs_inode* rem_dir = get_inode_from_path(path);
-	if (rem_dir == NULL) {
-		free(path_copy1);
-		free(path_copy2);
-		return -ENOMEM;
+// Return 1 if cluster c of inode is stored compressed
+int cluster_compressed(struct wfs_inode *inode, int c) {
+	return get_datablock_index_from_inode(c * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1, inode->blocks) == COMPRESSED_BLOCK;
+}
+
+// Decompress cluster c of inode into buf, CLUSTER_SIZE bytes
+// Return -EIO if fail
+int read_cluster(struct wfs_inode *inode, int c, char *buf) {
+	char stream[CLUSTER_SIZE];
+	int used = 0;
+	for(; used < CLUSTER_BLOCKS; used++) {
+		off_t blk = get_datablock_index_from_inode(c * CLUSTER_BLOCKS + used, inode->blocks);
+		if(blk < 0) break;
+
+		char *block = get_block(blk);
+		if(block == NULL) return -EIO;
+		memcpy(stream + used * BLOCK_SIZE, block, BLOCK_SIZE);
 	}
 
-	free(path_copy1);
+	uint16_t len;
+	memcpy(&len, stream, sizeof(uint16_t));
+	if(len + sizeof(uint16_t) > used * BLOCK_SIZE) return -EIO;
+	if(lz4_decompress((uint8_t *)stream + sizeof(uint16_t), len, (uint8_t *)buf, CLUSTER_SIZE) != CLUSTER_SIZE) return -EIO;
+	return 0;
+}
 
-	// check if actually a directory
-	if (!(S_IFDIR & rem_dir->mode)){
-		free(path_copy2);
-		return -ENOTDIR;
+// Store cluster c of inode uncompressed again so its blocks can be modified in place
+// Return -ENOSPC or -EIO if fail
+int expand_cluster(struct wfs_inode *inode, int c) {
+	if(!cluster_compressed(inode, c)) return 0;
+
+	char buf[CLUSTER_SIZE];
+	if(read_cluster(inode, c, buf) < 0) return -EIO;
+
+	// Blocks holding the stream are unshared first, freed slots get new
+	// blocks, and the cluster stays readable as compressed until the last
+	// slot is pointed at its block
+	off_t blks[CLUSTER_BLOCKS];
+	int used = 0;
+	for(int k = 0; k < CLUSTER_BLOCKS; k++) {
+		int lblk = c * CLUSTER_BLOCKS + k;
+		if(get_datablock_index_from_inode(lblk, inode->blocks) == COMPRESSED_BLOCK) {
+			if((blks[k] = allocate_block(inode, lblk)) < 0) {
+				while(--k >= used) free_block(blks[k]);
+				return -ENOSPC;
+			}
+		} else {
+			if((blks[k] = writable_datablock(inode, lblk)) < 0) return -ENOSPC;
+			used++;
+		}
+	}
+	for(int k = used; k < CLUSTER_BLOCKS; k++) {
+		if(set_datablock_index(inode, c * CLUSTER_BLOCKS + k, blks[k]) < 0) {
+			for(int j = k; j < CLUSTER_BLOCKS; j++) free_block(blks[j]);
+			return -ENOSPC;
+		}
 	}
 
-	// make sure directory empty
-	struct wfs_dentry *curr_dentry;
-	for (int i = 0; i < D_BLOCK; i++) {
-		if (rem_dir->blocks[i] != -1) {
-			if ((curr_dentry = (struct wfs_dentry*) get_block(rem_dir->blocks[i])) == NULL) return -1;
+	for(int k = 0; k < CLUSTER_BLOCKS; k++) {
+		char *block = get_block_for_write(blks[k]);
+		memcpy(block, buf + k * BLOCK_SIZE, BLOCK_SIZE);
+		update_all_datablocks(blks[k], block);
+	}
+	update_metadata();
+	return 0;
+}
+
+// Compress cluster c of inode if that frees at least one block, clusters
+// with holes or blocks shared with a snapshot or clone are left alone
+// No Return
+void compress_cluster(struct wfs_inode *inode, int c) {
+	off_t blks[CLUSTER_BLOCKS];
+	char buf[CLUSTER_SIZE];
+
+	off_t ind = inode->blocks[IND_BLOCK];
+	if((c + 1) * CLUSTER_BLOCKS - 1 > D_BLOCK && ind >= 0 && block_shared(ind)) return;
+	for(int k = 0; k < CLUSTER_BLOCKS; k++) {
+		blks[k] = get_datablock_index_from_inode(c * CLUSTER_BLOCKS + k, inode->blocks);
+		if(blks[k] < 0 || block_shared(blks[k])) return;
+
+		char *block = get_block(blks[k]);
+		if(block == NULL) return;
+		memcpy(buf + k * BLOCK_SIZE, block, BLOCK_SIZE);
+	}
+
+	char stream[(CLUSTER_BLOCKS - 1) * BLOCK_SIZE];
+	int len = lz4_compress((uint8_t *)buf, CLUSTER_SIZE, (uint8_t *)stream + sizeof(uint16_t), sizeof(stream) - sizeof(uint16_t));
+	if(len == 0) return;
+
+	uint16_t len16 = len;
+	memcpy(stream, &len16, sizeof(uint16_t));
+	int used = (len + sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	memset(stream + sizeof(uint16_t) + len, 0, used * BLOCK_SIZE - sizeof(uint16_t) - len);
+
+	for(int k = 0; k < used; k++) {
+		char *block = get_block_for_write(blks[k]);
+		memcpy(block, stream + k * BLOCK_SIZE, BLOCK_SIZE);
+		update_all_datablocks(blks[k], block);
+	}
+	for(int k = used; k < CLUSTER_BLOCKS; k++) {
+		set_datablock_index(inode, c * CLUSTER_BLOCKS + k, COMPRESSED_BLOCK);
+		release_block(blks[k]);
+	}
+	update_metadata();
+}
+
+// Compress the full clusters of inode that overlap [offset, offset + size)
+// No Return
+void compress_range(struct wfs_inode *inode, off_t offset, off_t size) {
+	if(!(inode->flags & WFS_INODE_COMPRESS) || size <= 0) return;
+	for(int c = offset / CLUSTER_SIZE; c <= (offset + size - 1) / CLUSTER_SIZE; c++) {
+		if((off_t)(c + 1) * CLUSTER_SIZE <= inode->size) compress_cluster(inode, c);
+	}
+}
+
+// Return -ENOSPC or -EIO if fail
+int expand_range(struct wfs_inode *inode, off_t offset, off_t size) {
+	if(size <= 0) return 0;
+	for(int c = offset / CLUSTER_SIZE; c <= (offset + size - 1) / CLUSTER_SIZE; c++) {
+		int err = expand_cluster(inode, c);
+		if(err < 0) return err;
+	}
+	return 0;
+}
+
+// Return NULL if fail
+struct wfs_dentry *find_dentry(struct wfs_inode *dir_inode, const char *name, off_t *blocknumber, void **blockptr) {
+	// Make sure it's a directory
+	if(!(S_IFDIR & dir_inode->mode)) {
+		printf("Parent is not directory\n");
+		return NULL;
+	}
+
+	printf("Searching for %s\n", name);
+
+	off_t *block_indicies = dir_inode->blocks;
+	struct wfs_dentry *curr_dentry;
+
+	// Search each data block
+	for(int i = 0; i < D_BLOCK; i++) {
+		if(block_indicies[i] == -1) continue;
+
+		curr_dentry = (struct wfs_dentry *) get_block(block_indicies[i]);
+		if(curr_dentry != NULL) {
+			// Search each dentry in data block
+			for(int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+				if(curr_dentry[j].num != 0 && strcmp(curr_dentry[j].name, name) == 0) {
+					*blocknumber = block_indicies[i];
+					*blockptr = (void*) curr_dentry;
+					return &curr_dentry[j];
+				}
+			}
+		}
+	}
+	// No matching dentry found
+	printf("No matching dentry found\n");
+	return NULL;
+}
+
+// Return -1 if block failure, -ENOSPC if space failure
+int alloc_dentry(struct wfs_inode* dir_inode, int num, char* name) {
+	struct wfs_dentry *curr_dentry;
+
+	// find free block
+	for (int i = 0; i < D_BLOCK; i++) {
+		if (dir_inode->blocks[i] == -1) continue;
+		if((curr_dentry = (struct wfs_dentry *) get_block(dir_inode->blocks[i])) == NULL) return -1;
+
+		// find free dentry in this block
+		for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++) {
+			if (curr_dentry[j].num == 0) {
+				off_t blk = writable_datablock(dir_inode, i);
+				if (blk < 0) return -ENOSPC;
+				if ((curr_dentry = (struct wfs_dentry *) get_block_for_write(blk)) == NULL) return -1;
+
+				curr_dentry[j].num = num;
+				strncpy(curr_dentry[j].name, name, MAX_NAME);
+				dir_inode->nlinks++; 
+				update_all_datablocks(dir_inode->blocks[i], curr_dentry);
+				return 0;
+			}
+		}
+	}
+
+	// no free dentry or block found
+	for (int i = 0; i < D_BLOCK; i++) {
+		if (dir_inode->blocks[i] == -1) { // allocate unallocated block from before
+			off_t new_block = allocate_block(dir_inode, i);
+			if (new_block < 0) return -ENOSPC;
+
+			dir_inode->blocks[i] = new_block;
+
+			// initialize entries
+			if((curr_dentry = (struct wfs_dentry *) get_block_for_write(dir_inode->blocks[i])) == NULL) return -1;
 			
-			for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
-				if (curr_dentry[j].num != 0) {
-					free(path_copy2);
-					return -ENOTEMPTY; // dentry found, directory not empty
-				} 
+			curr_dentry[0].num = num;
+			strncpy(curr_dentry[0].name, name, MAX_NAME);
+			dir_inode->nlinks++;
+			dir_inode->size += BLOCK_SIZE;
+			update_all_datablocks(dir_inode->blocks[i], curr_dentry);
+			return 0;
+		}
+	}
+
+	return -ENOSPC;
+}
+
+// Return 1 if path is the snapshot directory or inside it
+int in_snapshots(const char *path) {
+	if(!(superblock->features & WFS_FEATURE_SNAPSHOT)) return 0;
+	size_t len = strlen(SNAPSHOT_DIR);
+	return strncmp(path, SNAPSHOT_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Slot of snapshot i on the primary disk
+char *snapshot_slot(int i) {
+	return (char *)regions[primary_disk] + superblock->snap_ptr + i * superblock->snap_size;
+}
+
+// Offset of the inode table within a snapshot slot
+off_t snapshot_table_offset() {
+	off_t bitmap_size = superblock->d_bitmap_ptr - superblock->i_bitmap_ptr;
+	return BLOCK_SIZE + (bitmap_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+// Return -1 if there is no snapshot called name
+int find_snapshot(const char *name) {
+	for(int i = 0; i < superblock->snap_cnt; i++) {
+		struct wfs_snapshot *snap = (struct wfs_snapshot *)snapshot_slot(i);
+		if(snap->used && strcmp(snap->name, name) == 0) return i;
+	}
+	return -1;
+}
+
+// Return NULL if fail
+struct wfs_inode *get_snapshot_inode(int slot, int n) {
+	uint8_t *bitmap = (uint8_t *)snapshot_slot(slot) + BLOCK_SIZE;
+
+	if (bitmap[n / 8] & (1 << n % 8))
+		return (struct wfs_inode *)(snapshot_slot(slot) + snapshot_table_offset() + n * BLOCK_SIZE);
+
+	return NULL;
+}
+
+// Follow path from curr_inode through the live tree, or through snapshot slot if slot >= 0
+// Return NULL if fail
+struct wfs_inode *walk_path(int slot, struct wfs_inode *curr_inode, const char *path) {
+	char *path_copy = strdup(path);
+	if(path_copy == NULL) {
+		perror("strdup failure\n");
+		return NULL;
+	}
+	char *rem_path = path_copy;
+	char *tok = strtok(rem_path, "/");
+	struct wfs_dentry *dentry;
+	while(tok) {
+		// Check if curr inode is directory
+		if(!(S_IFDIR & curr_inode->mode)) {
+			free(path_copy);
+			printf("Not a directory\n");
+			return NULL;
+		}
+
+		// Find dentry in current inode and corresponding next inode
+		off_t blocknumber;
+		void *blockptr;
+		if((dentry = find_dentry(curr_inode, tok, &blocknumber, &blockptr)) == NULL) {
+			free(path_copy);
+			printf("Find dentry failed \n");
+			return NULL;
+		}
+		(void)blocknumber;
+		(void)blockptr;
+
+		curr_inode = slot < 0 ? get_inode(dentry->num) : get_snapshot_inode(slot, dentry->num);
+		if(curr_inode == NULL) {
+			free(path_copy);
+			printf("Get inode failed\n");
+			return NULL;
+		}
+
+		tok = strtok(NULL, "/");
+	}
+
+	free(path_copy);
+	return curr_inode;
+}
+
+// Return NULL if fail
+struct wfs_inode *get_inode_from_path(const char *path) {
+
+	struct wfs_inode *curr_inode = get_inode(0);
+
+	if(strcmp(path, "/") == 0) {
+		printf("root node: %p", (void *)curr_inode);
+		return curr_inode;
+	}
+
+	if(!in_snapshots(path)) return walk_path(-1, curr_inode, path);
+
+	// /.snapshots/<name>/... resolves inside the snapshot's copy of the inode table
+	const char *rest = path + strlen(SNAPSHOT_DIR);
+	if(rest[0] == '\0') return &snapshot_root;
+
+	char name[MAX_NAME];
+	size_t len = strcspn(rest + 1, "/");
+	if(len >= MAX_NAME) return NULL;
+	memcpy(name, rest + 1, len);
+	name[len] = '\0';
+
+	int slot = find_snapshot(name);
+	if(slot < 0 || (curr_inode = get_snapshot_inode(slot, 0)) == NULL) return NULL;
+	return walk_path(slot, curr_inode, rest + 1 + len);
+}
+
+// Freeze the live tree as snapshot name, only metadata is copied and every
+// block the live tree uses gains a reference
+// Return -EEXIST, -ENOSPC or -ENAMETOOLONG if fail
+int create_snapshot(const char *name) {
+	if(strlen(name) >= MAX_NAME) return -ENAMETOOLONG;
+	if(find_snapshot(name) >= 0) return -EEXIST;
+
+	// The snapshot has to hold what open files still buffer
+	wcache_flush_inode(NULL, 0, 0);
+
+	int slot = -1;
+	for(int i = 0; i < superblock->snap_cnt && slot < 0; i++) {
+		if(!((struct wfs_snapshot *)snapshot_slot(i))->used) slot = i;
+	}
+	if(slot < 0) return -ENOSPC;
+
+	uint8_t *bitmap = (uint8_t *)((char *)metadata + superblock->i_bitmap_ptr);
+	for(int n = 0; n < superblock->num_inodes; n++) {
+		if(!(bitmap[n / 8] & (1 << n % 8))) continue;
+
+		// Only read, not worth making every inode hot
+		struct wfs_inode *inode = inode_block(n);
+		for(int i = 0; i <= D_BLOCK; i++) {
+			if(inode->blocks[i] > -1) block_refs[inode->blocks[i]]++;
+		}
+		if(inode->blocks[IND_BLOCK] > -1) {
+			off_t *ind_block = (off_t *)get_block(inode->blocks[IND_BLOCK]);
+			for(int i = 0; ind_block != NULL && i < BLOCK_SIZE / sizeof(off_t); i++) {
+				if(ind_block[i] > -1) block_refs[ind_block[i]]++;
+			}
+			block_refs[inode->blocks[IND_BLOCK]]++;
+		}
+	}
+
+	struct wfs_snapshot header = {0};
+	strncpy(header.name, name, MAX_NAME - 1);
+	header.used = 1;
+	header.ctim = time(NULL);
+
+	for(int i = 0; i < disk_count; i++) {
+		if(regions[i] == NULL) continue;
+		char *dst = (char *)regions[i] + superblock->snap_ptr + slot * superblock->snap_size;
+		memcpy(dst + BLOCK_SIZE, (char *)metadata + superblock->i_bitmap_ptr, superblock->d_bitmap_ptr - superblock->i_bitmap_ptr);
+		memcpy(dst + snapshot_table_offset(), (char *)metadata + superblock->i_blocks_ptr, superblock->num_inodes * BLOCK_SIZE);
+		memcpy(dst, &header, sizeof(struct wfs_snapshot));
+	}
+	// Every block in use gained a reference
+	ref_ranges.all = 1;
+	update_metadata();
+	printf("Snapshot %s taken in slot %d\n", name, slot);
+	return 0;
+}
+
+// Drop the references snapshot name holds, freeing blocks nothing else uses
+// Return -ENOENT if fail
+int delete_snapshot(const char *name) {
+	int slot = find_snapshot(name);
+	if(slot < 0) return -ENOENT;
+
+	begin_parity_batch();
+	for(int n = 0; n < superblock->num_inodes; n++) {
+		struct wfs_inode *inode = get_snapshot_inode(slot, n);
+		if(inode != NULL) release_inode_blocks(inode);
+	}
+	end_parity_batch();
+
+	for(int i = 0; i < disk_count; i++) {
+		if(regions[i] == NULL) continue;
+		struct wfs_snapshot *snap = (struct wfs_snapshot *)((char *)regions[i] + superblock->snap_ptr + slot * superblock->snap_size);
+		snap->used = 0;
+	}
+	ref_ranges.all = 1;
+	update_metadata();
+	return 0;
+}
+
+// Move dentry into a copy of its directory block if a snapshot shares the block
+// Return NULL if fail
+struct wfs_dentry *writable_dentry(struct wfs_inode *dir, struct wfs_dentry *dentry, off_t *blocknumber, void **blockptr) {
+	if(!block_shared(*blocknumber)) return dentry;
+
+	for(int i = 0; i < D_BLOCK; i++) {
+		if(dir->blocks[i] != *blocknumber) continue;
+
+		off_t offset = (char *)dentry - (char *)*blockptr;
+		off_t copy = writable_datablock(dir, i);
+		if(copy < 0) return NULL;
+		if((*blockptr = get_block_for_write(copy)) == NULL) return NULL;
+		*blocknumber = copy;
+		return (struct wfs_dentry *)((char *)*blockptr + offset);
+	}
+	return NULL;
+}
+
+// Returns -ENOENT if fail
+int unlink_(struct wfs_inode *parent, char *filename) {
+	if(!(S_IFDIR & parent->mode)) {
+		perror("Trying to unlink from non-directory\n");
+		return -ENOENT;
+	}
+
+	struct wfs_dentry *dentry;
+	void *blockptr;
+	off_t blocknumber;
+	if((dentry = find_dentry(parent, filename, &blocknumber, &blockptr)) == NULL) {
+		return -ENOENT;
+	}
+	if((dentry = writable_dentry(parent, dentry, &blocknumber, &blockptr)) == NULL) {
+		return -ENOSPC;
+	}
+
+	struct wfs_inode *inode;
+	if((inode = get_inode(dentry->num)) == NULL) {
+		return -ENOENT;
+	}
+
+	if(S_IFDIR & inode->mode) {
+		// ENOENT because expecting file, not directory
+		return -ENOENT;
+	}
+
+	inode->nlinks--;
+	if(inode->nlinks <= 0) {
+		free_inode(dentry->num);
+	}
+	dentry->num = 0;
+
+	update_metadata();
+	update_all_datablocks(blocknumber, blockptr);
+	return 0;
+}
+
+// Returns -ENOENT if fail
+int separate_paths(char *path_copy1, char *path_copy2, char **parent_path, char **entry_name) {
+
+	int last_slash_index = -1;
+	for(int i = 0; i < strlen(path_copy1); i++) {
+		if(path_copy1[i] == '/') last_slash_index = i;
+	}
+
+	if(last_slash_index < 0 || last_slash_index == (strlen(path_copy1) - 1)) {
+		perror("Either no parent or child in path\n");
+		return -ENOENT;
+	}
+
+	*parent_path = path_copy1;
+	(*parent_path)[last_slash_index + 1] = '\0';
+	*entry_name = path_copy2 + (last_slash_index + 1);
+	return 0;
+}
+
+static int wfs_getattr(const char *path, struct stat *stbuf) {
+	struct wfs_inode *inode;
+	if((inode = get_inode_from_path(path)) == NULL) {
+		return -ENOENT;
+	}
+
+	stbuf->st_uid = inode->uid;
+	stbuf->st_gid = inode->gid;
+	stbuf->st_atime = inode->atim;
+	stbuf->st_mtime = inode->mtim;
+	stbuf->st_mode = inode->mode;
+	stbuf->st_size = wcache_file_size(inode);
+	if(in_snapshots(path)) stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+	return 0;
+}
+
+static int wfs_mknod(const char* path, mode_t mode, dev_t rdev) {
+	(void)rdev;
+	printf("wfs_mknod, path: (%s)\n", path);
+
+	if(in_snapshots(path)) return -EROFS;
+
+	// Make sure it doesn't exist
+	if(get_inode_from_path(path) != NULL) {
+		return -EEXIST;
+	}
+
+	char *path_copy1 = strdup(path);
+	char *path_copy2 = strdup(path);
+	if (!path_copy1 || !path_copy2) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOMEM;
+	}
+
+	// obtain parent path and created file name
+	char *parent_path;
+	char *entry_name;
+	if(separate_paths(path_copy1, path_copy2, &parent_path, &entry_name) < 0) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOENT;
+	}
+
+	// Dentries keep the terminating zero, statfs reports MAX_NAME - 1
+	if(strlen(entry_name) >= MAX_NAME) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENAMETOOLONG;
+	}
+
+	struct wfs_inode* parent = get_inode_from_path(parent_path);
+	if (parent == NULL) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOMEM;
+	}
+
+	if((parent->mode & S_IFDIR) == 0) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOENT;
+	}
+
+	off_t blk = allocate_inode(mode, parent);
+	if (blk < 0) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOSPC;
+	}
+
+	free(path_copy1);
+	if (alloc_dentry(parent, blk, entry_name) < 0){
+		free_inode(blk);
+		free(path_copy2);
+		return -ENOSPC;
+	} 
+	free(path_copy2);
+	get_inode(blk)->nlinks++;
+	update_metadata();
+	
+	return 0;
+
+}
+
+static int wfs_mkdir(const char* path, mode_t mode) {
+	printf("wfs_mkdir, path: (%s)\n", path);
+
+	// mkdir /.snapshots/<name> takes a snapshot, everything below it is read only
+	if(in_snapshots(path)) {
+		const char *name = path + strlen(SNAPSHOT_DIR);
+		if(name[0] == '\0') return -EEXIST;
+		if(strchr(name + 1, '/') != NULL) return -EROFS;
+		return create_snapshot(name + 1);
+	}
+
+	// Make sure it doesn't exist
+	if(get_inode_from_path(path) != NULL) {
+		return -EEXIST;
+	}
+
+	char *path_copy1 = strdup(path);
+	char *path_copy2 = strdup(path);
+	if (!path_copy1 || !path_copy2) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOMEM;
+	}
+
+	// obtain parent path and created directory name
+	char *parent_path;
+	char *entry_name;
+	if(separate_paths(path_copy1, path_copy2, &parent_path, &entry_name) < 0) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOENT;
+	}
+
+	// Dentries keep the terminating zero, statfs reports MAX_NAME - 1
+	if(strlen(entry_name) >= MAX_NAME) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENAMETOOLONG;
+	}
+
+	struct wfs_inode* parent = get_inode_from_path(parent_path);
+	if (parent == NULL) {
+		free(path_copy1);
+		free(path_copy2);
+		printf("Failed Here\n");
+		return -ENOMEM;
+	}
+
+	if((parent->mode & S_IFDIR) == 0) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOENT;
+	}
+
+	off_t blk = allocate_inode(mode | S_IFDIR, parent);
+	if (blk < 0) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOSPC;
+	}
+
+	free(path_copy1);
+	if (alloc_dentry(parent, blk, entry_name) < 0){
+		free_inode(blk);
+		free(path_copy2);
+		return -ENOSPC;
+	} 
+	free(path_copy2);
+	get_inode(blk)->nlinks++;
+	update_metadata();
+	
+	return 0;
+}
+
+static int wfs_unlink(const char* path) {
+	if(in_snapshots(path)) return -EROFS;
+
+	struct wfs_inode *inode_to_unlink;
+	if((inode_to_unlink = get_inode_from_path(path)) == 0) {
+		return -ENOENT;
+	}
+
+	char *path_copy1 = strdup(path);
+	char *path_copy2 = strdup(path);
+	if (!path_copy1 || !path_copy2) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOMEM;
+	}
+
+	// obtain parent path and created directory name
+	char *parent_path;
+	char *child_filename;
+	if(separate_paths(path_copy1, path_copy2, &parent_path, &child_filename) < 0) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOENT;
+	}
+
+	struct wfs_inode *parent;
+	if((parent = get_inode_from_path(parent_path)) == NULL) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOENT;
+	}
+
+	unlink_(parent, child_filename);
+	free(path_copy1);
+	free(path_copy2);
+	update_metadata();
+	return 0;
+}
+
+static int wfs_rmdir(const char* path) {
+	printf("wfs_rmdir, path: %s\n", path);
+
+	if (strcmp(path, "/") == 0) return -EPERM;
+
+	// rmdir /.snapshots/<name> deletes the snapshot
+	if (in_snapshots(path)) {
+		const char *name = path + strlen(SNAPSHOT_DIR);
+		if (name[0] == '\0') return -EPERM;
+		if (strchr(name + 1, '/') != NULL) return -EROFS;
+		return delete_snapshot(name + 1);
+	}
+
+	char *path_copy1 = strdup(path);
+	char *path_copy2 = strdup(path);
+	if (!path_copy1 || !path_copy2) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOMEM;
+	}
+
+	// obtain parent path and created directory name
+	char *parent_path;
+	char *entry_name;
+	if(separate_paths(path_copy1, path_copy2, &parent_path, &entry_name) < 0) return -ENOENT;
+
+	struct wfs_inode* parent = get_inode_from_path(parent_path);
+	if (parent == NULL) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOMEM;
+	}
+
+	struct wfs_inode* rem_dir = get_inode_from_path(path);
+	if (rem_dir == NULL) {
+		free(path_copy1);
+		free(path_copy2);
+		return -ENOMEM;
+	}
+
+	free(path_copy1);
+
+	// check if actually a directory
+	if (!(S_IFDIR & rem_dir->mode)){
+		free(path_copy2);
+		return -ENOTDIR;
+	}
+
+	// make sure directory empty
+	struct wfs_dentry *curr_dentry;
+	for (int i = 0; i < D_BLOCK; i++) {
+		if (rem_dir->blocks[i] != -1) {
+			if ((curr_dentry = (struct wfs_dentry*) get_block(rem_dir->blocks[i])) == NULL) return -1;
+			
+			for (int j = 0; j < BLOCK_SIZE / sizeof(struct wfs_dentry); j++)
+				if (curr_dentry[j].num != 0) {
+					free(path_copy2);
+					return -ENOTEMPTY; // dentry found, directory not empty
+				} 
+		}
+	}
+
+	off_t blk_index; 
+	void *blk_ptr;
+
+	struct wfs_dentry *dentry_to_clear = find_dentry(parent, entry_name, &blk_index, &blk_ptr);
+	free(path_copy2);
+	if(dentry_to_clear == NULL) return -ENOENT;
+	if((dentry_to_clear = writable_dentry(parent, dentry_to_clear, &blk_index, &blk_ptr)) == NULL) return -ENOSPC;
+
+	dentry_to_clear->num = 0;
+	update_all_datablocks(blk_index, blk_ptr);
+
+	// update parent metadata
+	parent->nlinks--;
+	parent->size -= sizeof(struct wfs_dentry);
+
+	// update meta data
+	update_metadata();
+	// free directory inode + all blocks
+	free_inode(rem_dir->num);
+	return 0;
+
+}
+
+// Handle wfs-clone uses to name a file, inodes of a snapshot are numbered
+// after the live ones, slot by slot
+int inode_handle(struct wfs_inode *inode) {
+	char *snaps = (char *)regions[primary_disk] + superblock->snap_ptr;
+	if(superblock->snap_ptr == 0 || (char *)inode < snaps) return inode->num;
+
+	int slot = ((char *)inode - snaps) / superblock->snap_size;
+	return (slot + 1) * superblock->num_inodes + inode->num;
+}
+
+// Return NULL if fail
+struct wfs_inode *inode_from_handle(int handle) {
+	if(handle < 0) return NULL;
+	if(handle < superblock->num_inodes) return get_inode(handle);
+
+	int slot = handle / superblock->num_inodes - 1;
+	if(slot >= superblock->snap_cnt || !((struct wfs_snapshot *)snapshot_slot(slot))->used) return NULL;
+	return get_snapshot_inode(slot, handle % superblock->num_inodes);
+}
+
+// Access pattern of an open file, wfs_open hangs one on fi->fh
+#define READAHEAD_MIN (16)    /* Blocks advised once a file reads sequentially */
+#define READAHEAD_MAX (512)   /* The window doubles up to this many blocks */
+#define RANDOM_READS (4)      /* Reads elsewhere before a file is treated as random */
+
+struct open_file {
+	int inode;        /* Inode number, the file may be unlinked before release */
+	off_t next;       /* Offset a sequential read starts at */
+	int sequential;   /* Reads in a row that started at next */
+	int random;       /* Reads in a row that did not */
+	off_t window;     /* Readahead window in blocks */
+	off_t advised;    /* Logical blocks before this one have been advised */
+	int is_random;    /* Blocks of the file are marked MADV_RANDOM */
+
+	struct open_file *next_open;  /* List of every open file */
+	char *wbuf;       /* Write-combining buffer, NULL while nothing is pending */
+	off_t wbase;      /* File offset of wbuf[0], a multiple of the buffer size */
+	off_t wlo;        /* Pending bytes are wbuf[wlo, whi) */
+	off_t whi;
+	time_t wtime;     /* When the buffer took its first byte */
+	int werror;       /* Error of a deferred write, returned by the next call */
+};
+
+struct open_file *open_files = NULL;
+
+// Pages of each disk waiting for one madvise call, contiguous blocks are merged
+struct advice {
+	int advice;
+	char *start[MAX_DISK];
+	char *end[MAX_DISK];
+};
+
+// No Return
+void advise_flush(struct advice *a, int disk) {
+	if(a->start[disk] == NULL) return;
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)a->start[disk] & ~(page - 1);
+	madvise((void *)start, (uintptr_t)a->end[disk] - start, a->advice);
+	a->start[disk] = NULL;
+}
+
+// No Return
+void advise_addr(struct advice *a, int disk, char *addr) {
+	if(addr == NULL) return;
+	if(a->start[disk] != NULL && a->end[disk] == addr) {
+		a->end[disk] += BLOCK_SIZE;
+		return;
+	}
+	advise_flush(a, disk);
+	a->start[disk] = addr;
+	a->end[disk] = addr + BLOCK_SIZE;
+}
+
+// Queue the copies of blk that reads use, the same disks get_block picks
+// No Return
+void advise_block(struct advice *a, off_t blk) {
+	off_t offset = superblock->d_blocks_ptr + blk * BLOCK_SIZE;
+	if(raid_mode == 0) {
+		advise_addr(a, blk % disk_count, (char *)regions[blk % disk_count] + superblock->d_blocks_ptr + (blk / disk_count) * BLOCK_SIZE);
+	} else if(raid_mode == 1) {
+		advise_addr(a, primary_disk, (char *)regions[primary_disk] + offset);
+	} else if(raid_mode == 2) {
+		// Every copy takes part in the vote
+		for(int i = 0; i < disk_count; i++) {
+			if(regions[i] != NULL) advise_addr(a, i, (char *)regions[i] + offset);
+		}
+	} else if(raid_mode == 10) {
+		int width = superblock->raid_width;
+		int first = raid10_first_disk(blk);
+		int pick = (blk / raid10_groups()) % width;
+		for(int i = 0; i < width; i++) {
+			int disk = first + (pick + i) % width;
+			if(regions[disk] == NULL) continue;
+			advise_addr(a, disk, raid10_addr(disk, blk));
+			break;
+		}
+	} else if(raid_mode == 5) {
+		// A missing data disk is rebuilt from the rest of the stripe
+		off_t stripe = blk / (disk_count - 1);
+		int disk = raid5_data_disk(blk);
+		if(regions[disk] != NULL) {
+			advise_addr(a, disk, raid5_addr(disk, stripe));
+		} else {
+			for(int i = 0; i < disk_count; i++) advise_addr(a, i, raid5_addr(i, stripe));
+		}
+	}
+}
+
+// Give advice on the blocks behind logical blocks [first, last] of inode
+// No Return
+void advise_blocks(struct wfs_inode *inode, off_t first, off_t last, int advice) {
+	struct advice a = {0};
+	a.advice = advice;
+	if(last > D_BLOCK && inode->blocks[IND_BLOCK] >= 0) advise_block(&a, inode->blocks[IND_BLOCK]);
+	for(off_t i = first; i <= last && i <= D_BLOCK + BLOCK_SIZE / sizeof(off_t); i++) {
+		off_t blk = get_datablock_index_from_inode(i, inode->blocks);
+		if(blk >= 0) advise_block(&a, blk);
+	}
+	for(int d = 0; d < disk_count; d++) advise_flush(&a, d);
+}
+
+// Prefetch ahead of sequential readers and stop the kernel reading around
+// the pages of files read at random
+// No Return
+void track_read(struct open_file *file, struct wfs_inode *inode, off_t offset, size_t size) {
+	off_t last = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE - 1;
+	if(offset == file->next) {
+		file->sequential++;
+		file->random = 0;
+	} else {
+		// A seek starts the window over
+		file->sequential = 0;
+		file->random++;
+		file->window = READAHEAD_MIN;
+		file->advised = 0;
+	}
+	file->next = offset + size;
+
+	if(file->random >= RANDOM_READS && !file->is_random) {
+		advise_blocks(inode, 0, last, MADV_RANDOM);
+		file->is_random = 1;
+	}
+	if(file->sequential < 2) return;
+	if(file->is_random) {
+		advise_blocks(inode, 0, last, MADV_NORMAL);
+		file->is_random = 0;
+	}
+
+	// Keep a window of advised blocks ahead of the reader, topped up once
+	// half of it has been read
+	off_t from = (offset + size) / BLOCK_SIZE;
+	if(file->advised > from + file->window / 2) return;
+	if(file->advised > from) from = file->advised;
+	off_t to = (offset + size) / BLOCK_SIZE + file->window;
+	if(to > last) to = last;
+	if(from <= to) advise_blocks(inode, from, to, MADV_WILLNEED);
+	file->advised = to + 1;
+	if(file->window < READAHEAD_MAX) file->window *= 2;
+}
+
+// Small writes through an open file collect in a buffer covering an aligned
+// window of the file, and reach the disks as whole blocks once the window
+// fills. Reads, truncates, clones and snapshots of the file flush it first,
+// and a timer thread flushes buffers that have waited WCACHE_TIMEOUT.
+#define WCACHE_BLOCKS (8)          /* Blocks a buffer covers */
+#define WCACHE_SIZE (WCACHE_BLOCKS * BLOCK_SIZE)
+#define WCACHE_BUDGET (1 << 20)    /* Bytes all buffers together may hold */
+#define WCACHE_TIMEOUT (1)         /* Seconds a pending write waits at most */
+
+size_t wcache_used = 0;
+
+// Every FUSE call and the timer thread hold fs_lock, so the timer never
+// runs in the middle of a call
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wcache_wake = PTHREAD_COND_INITIALIZER;
+pthread_t wcache_timer;
+int wcache_timer_started = 0;
+int wcache_timer_stop = 0;
+
+// Defined with the write path below
+int write_inode(struct wfs_inode *inode, const char *buf, size_t size, off_t offset);
+
+// Write out the pending bytes of file, a failure is kept for the next call on it
+// Return negative errno if fail
+int wcache_flush(struct open_file *file) {
+	if(file->wbuf == NULL) return 0;
+
+	int err = 0;
+	struct wfs_inode *inode = inode_from_handle(file->inode);
+	if(inode != NULL) {
+		begin_parity_batch();
+		int written = write_inode(inode, file->wbuf + file->wlo, file->whi - file->wlo, file->wbase + file->wlo);
+		end_parity_batch();
+		if(written < 0) err = written;
+		else if(written < file->whi - file->wlo) err = -ENOSPC;
+	}
+	free(file->wbuf);
+	file->wbuf = NULL;
+	wcache_used -= WCACHE_SIZE;
+	if(err < 0 && file->werror == 0) file->werror = err;
+	return err;
+}
+
+// Flush the buffers of inode that overlap [offset, offset + size), all of
+// them if size is 0, and every buffer if inode is NULL
+// No Return
+void wcache_flush_inode(struct wfs_inode *inode, off_t offset, size_t size) {
+	if(wcache_used == 0) return;
+	int handle = inode != NULL ? inode_handle(inode) : -1;
+	for(struct open_file *file = open_files; file != NULL; file = file->next_open) {
+		if(file->wbuf == NULL || (handle >= 0 && file->inode != handle)) continue;
+		if(size > 0 && (offset >= file->wbase + file->whi || offset + (off_t)size <= file->wbase + file->wlo)) continue;
+		wcache_flush(file);
+	}
+}
+
+// Pending writes to a removed inode have nowhere to go
+// No Return
+void wcache_drop_inode(int num) {
+	for(struct open_file *file = open_files; file != NULL; file = file->next_open) {
+		if(file->wbuf == NULL || file->inode != num) continue;
+		free(file->wbuf);
+		file->wbuf = NULL;
+		wcache_used -= WCACHE_SIZE;
+	}
+}
+
+// Flush buffers that have waited longer than WCACHE_TIMEOUT, callers hold fs_lock
+// No Return
+void wcache_expire() {
+	if(wcache_used == 0) return;
+	time_t now = time(NULL);
+	for(struct open_file *file = open_files; file != NULL; file = file->next_open) {
+		if(file->wbuf != NULL && now - file->wtime >= WCACHE_TIMEOUT) wcache_flush(file);
+	}
+}
+
+// Wake up every WCACHE_TIMEOUT, so a buffer on an idle mount does not wait
+// for the next call
+void *wcache_timer_main(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&fs_lock);
+	while(!wcache_timer_stop) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += WCACHE_TIMEOUT;
+		pthread_cond_timedwait(&wcache_wake, &fs_lock, &until);
+		if(!wcache_timer_stop) wcache_expire();
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return NULL;
+}
+
+// Stop the timer thread once FUSE is done with the mount
+// No Return
+void wcache_timer_join() {
+	if(!wcache_timer_started) return;
+	pthread_mutex_lock(&fs_lock);
+	wcache_timer_stop = 1;
+	pthread_cond_signal(&wcache_wake);
+	pthread_mutex_unlock(&fs_lock);
+	pthread_join(wcache_timer, NULL);
+	wcache_timer_started = 0;
+}
+
+// Size of inode counting bytes still buffered past its end
+off_t wcache_file_size(struct wfs_inode *inode) {
+	off_t size = inode->size;
+	if(wcache_used == 0) return size;
+	int handle = inode_handle(inode);
+	for(struct open_file *file = open_files; file != NULL; file = file->next_open) {
+		if(file->wbuf != NULL && file->inode == handle && file->wbase + file->whi > size) size = file->wbase + file->whi;
+	}
+	return size;
+}
+
+// Take a small write into the file's buffer. A write the buffer can not
+// extend without leaving a gap flushes what is pending first.
+// Return 1 if the write was buffered
+int wcache_write(struct open_file *file, const char *buf, size_t size, off_t offset) {
+	off_t cap = WCACHE_SIZE;
+	if(file->wbuf != NULL) {
+		off_t lo = offset - file->wbase;
+		if(lo < 0 || lo + (off_t)size > cap || lo > file->whi || lo + (off_t)size < file->wlo) wcache_flush(file);
+	}
+	if(size == 0 || (off_t)size >= cap || offset / cap != (offset + (off_t)size - 1) / cap) return 0;
+	if(offset + (off_t)size > MAX_FILE_SIZE) return 0;
+
+	if(file->wbuf == NULL) {
+		if(wcache_used + cap > WCACHE_BUDGET || (file->wbuf = malloc(cap)) == NULL) return 0;
+		wcache_used += cap;
+		file->wbase = offset - offset % cap;
+		file->wlo = offset - file->wbase;
+		file->whi = file->wlo;
+		file->wtime = time(NULL);
+	}
+
+	off_t lo = offset - file->wbase;
+	memcpy(file->wbuf + lo, buf, size);
+	if(lo < file->wlo) file->wlo = lo;
+	if(lo + (off_t)size > file->whi) file->whi = lo + size;
+
+	// A window written up to its end goes out as whole blocks
+	if(file->whi == cap) wcache_flush(file);
+	return 1;
+}
+
+static int wfs_open(const char *path, struct fuse_file_info *fi) {
+	struct wfs_inode *inode;
+	if((inode = get_inode_from_path(path)) == NULL) {
+		return -ENOENT;
+	}
+
+	struct open_file *file = calloc(1, sizeof(struct open_file));
+	if(file == NULL) return -ENOMEM;
+	file->inode = inode_handle(inode);
+	file->window = READAHEAD_MIN;
+	file->next_open = open_files;
+	open_files = file;
+	fi->fh = (uintptr_t)file;
+	return 0;
+}
+
+static int wfs_release(const char *path, struct fuse_file_info *fi) {
+	(void)path;
+	struct open_file *file = (struct open_file *)(uintptr_t)fi->fh;
+	if(file == NULL) return 0;
+	wcache_flush(file);
+
+	for(struct open_file **link = &open_files; *link != NULL; link = &(*link)->next_open) {
+		if(*link == file) {
+			*link = file->next_open;
+			break;
+		}
+	}
+
+	// Put the pages back to normal readahead unless the blocks went away with the file
+	struct wfs_inode *inode = inode_from_handle(file->inode);
+	if(file->is_random && inode != NULL) {
+		advise_blocks(inode, 0, (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE - 1, MADV_NORMAL);
+	}
+	free(file);
+	fi->fh = 0;
+	return 0;
+}
+
+static int wfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+	struct wfs_inode *inode;
+	if((inode = get_inode_from_path(path)) == 0) {
+		return -ENOENT;
+	}
+	wcache_expire();
+	wib_expire();
+	wcache_flush_inode(inode, offset, size);
+	// Buffers past the end on disk still make the file longer
+	if(wcache_file_size(inode) > inode->size) wcache_flush_inode(inode, 0, 0);
+
+	if(inode->flags & WFS_INODE_INLINE) {
+		if(offset >= inode->size) return 0;
+		if(offset + size > inode->size) size = inode->size - offset;
+		memcpy(buf, inline_data(inode) + offset, size);
+		return size;
+	}
+	if(readahead_hints && fi != NULL && fi->fh != 0) track_read((struct open_file *)(uintptr_t)fi->fh, inode, offset, size);
+
+	size_t curr_position = offset;
+	size_t read = 0;
+	size_t to_read;
+
+	int curr_block_index;
+	char *curr_block;
+	// Each compressed cluster the read touches is decompressed once
+	char cluster[CLUSTER_SIZE];
+	int cluster_index = -1;
+	int compressed = 0;
+	while((read < size) && (curr_position < inode->size)) {
+		// Calcuate size to read
+		to_read = BLOCK_SIZE - (curr_position % BLOCK_SIZE);
+		if(inode->size - curr_position < to_read) to_read = inode->size - curr_position;
+		if(size - read < to_read) to_read = size - read;
+
+		if(curr_position / CLUSTER_SIZE != cluster_index) {
+			cluster_index = curr_position / CLUSTER_SIZE;
+			compressed = cluster_compressed(inode, cluster_index);
+			if(compressed && read_cluster(inode, cluster_index, cluster) < 0) {
+				printf("cluster %d of %s is corrupt\n", cluster_index, path);
+				return -EIO;
+			}
+		}
+
+		// Retrieve block to read from
+		// get_block handles all raid 1v block selection on a per block basis if disk argument is -1
+		curr_block_index = get_datablock_index_from_inode(curr_position / BLOCK_SIZE, inode->blocks);
+		printf("Reading from %s, block %d\n", path, (int)curr_block_index);
+		if(compressed) {
+			memcpy(buf + read, cluster + curr_position % CLUSTER_SIZE, to_read);
+		} else if(curr_block_index < 0) {
+			// Holes read as zeros without allocating anything
+			memset(buf + read, 0, to_read);
+		} else {
+			if((curr_block = get_block(curr_block_index)) == NULL) {
+				printf("block to read from DNE\n");
+				return -ENOENT;
+			}
+
+			// Perform Read Operation
+			memcpy(buf + read, curr_block + (curr_position % BLOCK_SIZE), to_read);
+		}
+		
+		// Update indexing variables
+		read += to_read;
+		curr_position += to_read;
+	}
+
+	printf("Total read size from %s: %d\n", path, (int)read);
+	return read;
+}
+
+// Answer a read with slices of the disk images that FUSE splices to the
+// kernel, holes become zeroed memory. Reads needing a decompressed cluster
+// or a rebuilt raid 5 block go through wfs_read into one buffer instead.
+static int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct wfs_inode *inode;
+	if((inode = get_inode_from_path(path)) == NULL) {
+		return -ENOENT;
+	}
+	wcache_expire();
+	wib_expire();
+	wcache_flush_inode(inode, offset, size);
+	// Buffers past the end on disk still make the file longer
+	if(wcache_file_size(inode) > inode->size) wcache_flush_inode(inode, 0, 0);
+
+	if(offset >= inode->size) size = 0;
+	else if(offset + size > inode->size) size = inode->size - offset;
+
+	// At most one slice per block touched, adjacent ones are merged
+	size_t slots = size / BLOCK_SIZE + 2;
+	struct fuse_bufvec *vec = calloc(1, sizeof(struct fuse_bufvec) + slots * sizeof(struct fuse_buf));
+	if(vec == NULL) return -ENOMEM;
+	*bufp = vec;
+
+	int direct = !(inode->flags & WFS_INODE_INLINE) && size > 0;
+	off_t curr_position = offset;
+	while(direct && curr_position < offset + (off_t)size) {
+		size_t to_read = BLOCK_SIZE - curr_position % BLOCK_SIZE;
+		if(offset + size - curr_position < to_read) to_read = offset + size - curr_position;
+
+		if((inode->flags & WFS_INODE_COMPRESS) && cluster_compressed(inode, curr_position / CLUSTER_SIZE)) {
+			direct = 0;
+			break;
+		}
+
+		int fd = -1;
+		off_t pos = 0;
+		off_t blk = get_datablock_index_from_inode(curr_position / BLOCK_SIZE, inode->blocks);
+		if(blk >= 0) {
+			if((fd = block_fd(blk, &pos)) < 0) {
+				direct = 0;
+				break;
+			}
+			pos += curr_position % BLOCK_SIZE;
+		}
+
+		struct fuse_buf *last = vec->count > 0 ? &vec->buf[vec->count - 1] : NULL;
+		if(last != NULL && fd < 0 && !(last->flags & FUSE_BUF_IS_FD)) {
+			last->size += to_read;
+		} else if(last != NULL && fd >= 0 && (last->flags & FUSE_BUF_IS_FD) && last->fd == fd && last->pos + (off_t)last->size == pos) {
+			last->size += to_read;
+		} else {
+			struct fuse_buf *next = &vec->buf[vec->count++];
+			next->size = to_read;
+			if(fd >= 0) {
+				next->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+				next->fd = fd;
+				next->pos = pos;
+			}
+		}
+		curr_position += to_read;
+	}
+
+	// Holes get their zeros once the slices are final, FUSE frees them with the vector
+	for(size_t i = 0; direct && i < vec->count; i++) {
+		if(vec->buf[i].flags & FUSE_BUF_IS_FD) continue;
+		if((vec->buf[i].mem = calloc(1, vec->buf[i].size)) == NULL) direct = 0;
+	}
+
+	if(direct) {
+		if(readahead_hints && fi != NULL && fi->fh != 0) track_read((struct open_file *)(uintptr_t)fi->fh, inode, offset, size);
+		printf("Total read size from %s: %d in %d slices\n", path, (int)size, (int)vec->count);
+		return 0;
+	}
+
+	for(size_t i = 0; i < vec->count; i++) {
+		if(!(vec->buf[i].flags & FUSE_BUF_IS_FD)) free(vec->buf[i].mem);
+	}
+	memset(vec, 0, sizeof(struct fuse_bufvec));
+	vec->count = 1;
+	if((vec->buf[0].mem = malloc(size > 0 ? size : 1)) == NULL) return -ENOMEM;
+	int read = wfs_read(path, vec->buf[0].mem, size, offset, fi);
+	if(read < 0) return read;
+	vec->buf[0].size = read;
+	return 0;
+}
+
+// Copy size bytes from src, which may be a pipe handed over by FUSE, to dst
+// Return -EIO if fail
+int copy_from_buf(void *dst, struct fuse_bufvec *src, size_t size) {
+	struct fuse_bufvec to = FUSE_BUFVEC_INIT(size);
+	to.buf[0].mem = dst;
+	ssize_t copied = fuse_buf_copy(&to, src, 0);
+	if(copied != (ssize_t)size) return copied < 0 ? (int)copied : -EIO;
+	return 0;
+}
+
+// Write size bytes taken from src, which is advanced past them
+// Return -ENOSPC if nothing was written, writes past the indirect block
+// included, or the error of the block mapping or of src if the first block fails
+int write_inode_buf(struct wfs_inode *inode, struct fuse_bufvec *src, size_t size, off_t offset) {
+	if(inode->flags & WFS_INODE_INLINE) {
+		// Small files are written straight into their inode block
+		if(offset + size <= INLINE_SIZE) {
+			int err = copy_from_buf(inline_data(inode) + offset, src, size);
+			if(err < 0) return err;
+			if(offset + size > inode->size) inode->size = offset + size;
+			update_metadata();
+			return size;
+		}
+		if(migrate_inline(inode) < 0) return -ENOSPC;
+	}
+
+	// Compressed clusters under the write go back to plain blocks first
+	int expanded = expand_range(inode, offset, size);
+	if(expanded < 0) return expanded;
+
+	size_t written = 0;
+	size_t to_write;
+	size_t curr_position = offset;
+	off_t old_size = inode->size;
+
+	int curr_block_index;
+	char *curr_block;
+	while(written < size) {
+		// Find index in data block array of inode, blocks shared with a snapshot are copied first
+		curr_block_index = writable_datablock(inode, curr_position / BLOCK_SIZE);
+		if(curr_block_index < -1) {
+			if(written == 0) return curr_block_index;
+			break;
+		}
+
+		// Make sure there is an existing entry, alloc if not
+		if(curr_block_index == -1) {
+			if(curr_position / BLOCK_SIZE > D_BLOCK + BLOCK_SIZE / sizeof(off_t)) {
+				// Index out of bounds
+				break;
+			}
+			if((curr_block_index = allocate_block(inode, curr_position / BLOCK_SIZE)) < 0) {
+				perror("write:Allocate block failed\n");
+				break;
+			}
+
+			int err = set_datablock_index(inode, curr_position / BLOCK_SIZE, curr_block_index);
+			if(err < 0) {
+				free_block(curr_block_index);
+				if(written == 0) return err;
+				break;
+			}
+		}
+
+		// Calculate size to write
+		to_write = BLOCK_SIZE - (curr_position % BLOCK_SIZE);
+		if(size - written < to_write) to_write = size - written;
+
+		// Retrieve corresponding data block in memory
+		if((curr_block = get_block_for_write(curr_block_index)) == NULL) {
+			perror("write:get_block failed 1\n");
+			return -ENOENT;
+		}
+		printf("Writing to inode %d to block %d\n", inode->num, (int)curr_block_index);
+		// Perform write Operation
+		int err = copy_from_buf(curr_block + (curr_position % BLOCK_SIZE), src, to_write);
+		if(err < 0) {
+			if(written == 0) return err;
+			break;
+		}
+
+		update_all_datablocks(curr_block_index, (void*)curr_block);
+
+		// Update indexing variables
+		written += to_write;
+		curr_position += to_write;
+		if(curr_position > inode->size) inode->size = curr_position;
+	}
+
+	// Blocks that were already allocated are pure data copies, metadata
+	// only changes when the file grows
+	if(inode->size != old_size) update_metadata();
+	compress_range(inode, offset, written);
+
+	if(written == 0 && size > 0) return -ENOSPC;
+
+	printf("Total write size to inode %d: %d. Total size: %d\n", inode->num, (int)written, (int)inode->size);
+	return written;
+}
+
+// Return -ENOSPC if nothing was written, like write_inode_buf
+int write_inode(struct wfs_inode *inode, const char *buf, size_t size, off_t offset) {
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	src.buf[0].mem = (void *)buf;
+	return write_inode_buf(inode, &src, size, offset);
+}
+
+// Writes arrive in memory, or with splice as a pipe that is read straight
+// into the mapped blocks
+static int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	struct open_file *file = fi != NULL ? (struct open_file *)(uintptr_t)fi->fh : NULL;
+	size_t size = fuse_buf_size(buf) - buf->off;
+	int spliced = buf->count != 1 || (buf->buf[0].flags & FUSE_BUF_IS_FD);
+	wcache_expire();
+	wib_expire();
+	if(file != NULL && file->werror < 0) {
+		int err = file->werror;
+		file->werror = 0;
+		return err;
+	}
+
+	if(in_snapshots(path)) return -EROFS;
+	struct wfs_inode *inode;
+	if((inode = get_inode_from_path(path)) == NULL) {
+		perror("write:file from path DNE\n");
+		return -ENOENT;
+	}
+
+	// Other handles' buffers of the file go out first so writes land in order,
+	// and so does this one's when the write can not join it
+	int handle = inode_handle(inode);
+	for(struct open_file *other = open_files; other != NULL && wcache_used > 0; other = other->next_open) {
+		if((other != file || spliced) && other->wbuf != NULL && other->inode == handle) wcache_flush(other);
+	}
+	if(write_combine && !spliced && file != NULL && file->inode == handle &&
+		wcache_write(file, (char *)buf->buf[0].mem + buf->off, size, offset)) return size;
+
+	// Raid 5 parity is written once per stripe touched by this write
+	begin_parity_batch();
+	int written = write_inode_buf(inode, buf, size, offset);
+	end_parity_batch();
+	return written;
+}
+
+static int wfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	src.buf[0].mem = (void *)buf;
+	return wfs_write_buf(path, &src, offset, fi);
+}
+
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	(void)path;
+	(void)datasync;
+	struct open_file *file = (struct open_file *)(uintptr_t)fi->fh;
+	if(file == NULL) return 0;
+
+	wcache_flush(file);
+	int err = file->werror;
+	file->werror = 0;
+	return err;
+}
+
+// close() reports what the buffer could not write
+static int wfs_flush(const char *path, struct fuse_file_info *fi) {
+	return wfs_fsync(path, 0, fi);
+}
+
+// Return -EFBIG if size is past the largest file, -ENOSPC if fail
+int truncate_(struct wfs_inode *inode, off_t size) {
+	if(size < 0) return -EINVAL;
+	if(size > MAX_FILE_SIZE) return -EFBIG;
+
+	if(inode->flags & WFS_INODE_INLINE) {
+		if(size <= INLINE_SIZE) {
+			if(size < inode->size) memset(inline_data(inode) + size, 0, inode->size - size);
+			inode->size = size;
+			update_metadata();
+			return 0;
 		}
+		if(migrate_inline(inode) < 0) return -ENOSPC;
 	}
 
-	off_t blk_index; 
-	void *blk_ptr;
+	if(size < inode->size) {
+		// A cluster cut in the middle is stored plain again, the cut off part
+		// of it is zeroed below
+		if(size % CLUSTER_SIZE != 0 && expand_cluster(inode, size / CLUSTER_SIZE) < 0) return -ENOSPC;
+
+		// Zero the cut off part of the last block so growing again reads zeros
+		if(size % BLOCK_SIZE != 0) {
+			off_t last = writable_datablock(inode, size / BLOCK_SIZE);
+			if(last < -1) return last;
+			char *block = last >= 0 ? get_block_for_write(last) : NULL;
+			if(block != NULL) {
+				memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+				update_all_datablocks(last, block);
+			}
+		}
 
-	struct wfs_dentry *dentry_to_clear = find_dentry(parent, entry_name, &blk_index, &blk_ptr);
-	free(path_copy2);
-	if(dentry_to_clear == NULL) return -ENOENT;
+		// Free every block past the new end, all under one metadata update
+		int keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if(keep > D_BLOCK + 1 && unshare_indirect(inode) < 0) return -ENOSPC;
+		for(int i = keep; i <= D_BLOCK; i++) {
+			if(inode->blocks[i] != -1) {
+				if(inode->blocks[i] > -1) release_block(inode->blocks[i]);
+				inode->blocks[i] = -1;
+			}
+		}
 
-	dentry_to_clear->num = 0;
-	update_all_datablocks(blk_index, blk_ptr);
+		if(inode->blocks[IND_BLOCK] > -1) {
+			// Work on a copy, a snapshot may still share the indirect block when it is dropped whole
+			off_t ind_block[BLOCK_SIZE / sizeof(off_t)];
+			char *ind = get_block_for_write(inode->blocks[IND_BLOCK]);
+			int used = 0;
+			if(ind != NULL) {
+				memcpy(ind_block, ind, BLOCK_SIZE);
+				for(int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
+					if(ind_block[i] == -1) continue;
+					if(i + D_BLOCK + 1 >= keep) {
+						if(ind_block[i] > -1) release_block(ind_block[i]);
+						ind_block[i] = -1;
+					} else {
+						used++;
+					}
+				}
+			}
 
-	// update parent metadata
-	parent->nlinks--;
-	parent->size -= sizeof(struct wfs_dentry);
+			if(used == 0) {
+				release_block(inode->blocks[IND_BLOCK]);
+				inode->blocks[IND_BLOCK] = -1;
+			} else {
+				memcpy(ind, ind_block, BLOCK_SIZE);
+				update_all_datablocks(inode->blocks[IND_BLOCK], ind);
+			}
+		}
+	}
 
-	// update meta data
+	// Growing only moves the size, the new range is a hole
+	inode->size = size;
 	update_metadata();
-	// free directory inode + all blocks
-	free_inode(rem_dir->num);
 	return 0;
-
 }
 
-static int wfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-	(void)fi;
+static int wfs_truncate(const char *path, off_t size) {
+	printf("wfs_truncate, path: %s, size: %ld\n", path, (long)size);
+	if(in_snapshots(path)) return -EROFS;
 	struct wfs_inode *inode;
-	if((inode = get_inode_from_path(path)) == 0) {
+	if((inode = get_inode_from_path(path)) == NULL) {
 		return -ENOENT;
 	}
+	if(S_ISDIR(inode->mode)) return -EISDIR;
+	wcache_flush_inode(inode, 0, 0);
 
-	size_t curr_position = offset;
-	size_t read = 0;
-	size_t to_read;
-
-	int curr_block_index;
-	char *curr_block;
-	while((read < size) && (curr_position < inode->size)) {
-		// Retrieve block to read from
-		// get_block handles all raid 1v block selection on a per block basis if disk argument is -1
-		curr_block_index = get_datablock_index_from_inode(curr_position / BLOCK_SIZE, inode->blocks);
-		printf("Reading from %s, block %d\n", path, (int)curr_block_index);
-		if(curr_block_index <= 0) {
-			perror("Inode does not contain this block\n");
-			return -ENOENT;
-		}
-		if((curr_block = get_block(curr_block_index)) == NULL) {
-			printf("block to read from DNE\n");
-			 return -ENOENT;
-		}
-
-		// Calcuate size to read
-		to_read = BLOCK_SIZE - (curr_position % BLOCK_SIZE);
-		if(inode->size - curr_position < to_read) to_read = inode->size - curr_position;
-
-		// Perform Read Operation
-		memcpy(buf + read, curr_block + (curr_position % BLOCK_SIZE), to_read);
-		
-		// Update indexing variables
-		read += to_read;
-		curr_position += to_read;
-	}
+	begin_parity_batch();
+	int err = truncate_(inode, size);
+	end_parity_batch();
+	return err;
+}
 
-	printf("Total read size from %s: %d\n", path, (int)read);
-	return read;
+static int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	(void)fi;
+	return wfs_truncate(path, size);
 }
 
-static int wfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+static int wfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
 	(void)fi;
+	printf("wfs_fallocate, path: %s, offset: %ld, length: %ld\n", path, (long)offset, (long)length);
+
+	if(mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+	if(in_snapshots(path)) return -EROFS;
+	if(offset < 0 || length <= 0) return -EINVAL;
+	if(offset + length > MAX_FILE_SIZE) return -EFBIG;
+
 	struct wfs_inode *inode;
 	if((inode = get_inode_from_path(path)) == NULL) {
-		perror("write:file from path DNE\n");
 		return -ENOENT;
 	}
+	if(S_ISDIR(inode->mode)) return -EISDIR;
+	wcache_flush_inode(inode, 0, 0);
+
+	if(inode->flags & WFS_INODE_INLINE) {
+		if(offset + length > INLINE_SIZE) {
+			if(migrate_inline(inode) < 0) return -ENOSPC;
+		} else if(!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > inode->size) {
+			inode->size = offset + length;
+			update_metadata();
+			return 0;
+		} else {
+			return 0;
+		}
+	}
 
-	size_t written = 0;
-	size_t to_write;
-	size_t curr_position = offset;
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + length - 1) / BLOCK_SIZE;
+	int holes = 0;
+	for(int i = first; i <= last; i++) {
+		if(get_datablock_index_from_inode(i, inode->blocks) == -1) holes++;
+	}
 
-	int curr_block_index;
-	char *curr_block;
-	while(written < size) {
-		// Find index in data block array of inode
-		curr_block_index = get_datablock_index_from_inode(curr_position / BLOCK_SIZE, inode->blocks);
+	// Hand out one contiguous run so later writes stream through it, fall
+	// back to block at a time when the free space is fragmented
+	off_t run = -ENOSPC;
+	if(holes > 0 && raid_mode != 0) run = allocate_run(holes);
+	off_t run_end = run + holes;
 
-		// Make sure there is an existing entry, alloc if not
-		if(curr_block_index == -1) {
-			if((curr_block_index = allocate_block()) < 0) {
-				perror("write:Allocate block failed\n");
-				return -ENOSPC;
-			}
+	begin_parity_batch();
+	int err = 0;
+	for(int i = first; i <= last && err == 0; i++) {
+		if(get_datablock_index_from_inode(i, inode->blocks) != -1) continue;
 
-			if(curr_position / BLOCK_SIZE >= 0 && curr_position / BLOCK_SIZE <= D_BLOCK) {
-				// If index is one of the D blocks
-				inode->blocks[curr_position / BLOCK_SIZE] = curr_block_index;
-			} else if(curr_position / BLOCK_SIZE <= D_BLOCK + BLOCK_SIZE / sizeof(off_t)) {
-				// If index is in the IND block
-				
-				// Create new ind block if needed
-				if(inode->blocks[IND_BLOCK] == -1) {
-					off_t ind_block;
-					if((ind_block = allocate_block()) < 0) return -ENOSPC;
-					off_t *block = get_block(ind_block);
-					inode->blocks[IND_BLOCK] = ind_block;
-					for(int i = 0; i < BLOCK_SIZE / sizeof(off_t); i++) {
-						block[i] = -1;
-					}
+		off_t blk = run >= 0 ? run++ : allocate_block(inode, i);
+		if(blk < 0) {
+			err = -ENOSPC;
+			break;
+		}
+		if((err = set_datablock_index(inode, i, blk)) < 0) free_block(blk);
+	}
 
-					update_all_datablocks(inode->blocks[IND_BLOCK], block);
-	    				update_metadata();
-				}
+	// Release whatever part of the run was not used
+	while(err < 0 && run >= 0 && run < run_end) free_block(run++);
+	end_parity_batch();
 
-				// Insert block pointer into ind block
-				off_t *block = get_block(inode->blocks[IND_BLOCK]);
-				if(block == NULL) {
-					perror("write:getblock failed\n");
-					return -ENOENT;
-				}
-				block[(curr_position / BLOCK_SIZE) - (D_BLOCK + 1)] = curr_block_index;
-				update_all_datablocks(inode->blocks[IND_BLOCK], block);
-			} else {
-				// Index out of bounds
-				return -ENOSPC;
+	if(!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > inode->size) {
+		inode->size = offset + length;
+	}
+	update_metadata();
+	return err;
+}
+
+// Make dst's blocks from dst_off on the blocks of src from src_off on. With
+// reference counts the block pointers are shared, otherwise every block is
+// copied region to region without passing through FUSE buffers.
+// Return -EINVAL for unaligned or overlapping ranges, -ENOSPC or -EFBIG if fail
+int clone_range(struct wfs_inode *dst, struct wfs_inode *src, off_t src_off, off_t dst_off, off_t length) {
+	if(!S_ISREG(src->mode) || !S_ISREG(dst->mode)) return -EINVAL;
+	if(src_off < 0 || dst_off < 0 || src_off % BLOCK_SIZE != 0 || dst_off % BLOCK_SIZE != 0) return -EINVAL;
+	if(length == 0 || src_off + length > src->size) length = src->size - src_off;
+	if(length <= 0) return 0;
+	if(dst_off + length > MAX_FILE_SIZE) return -EFBIG;
+	if(src == dst && src_off < dst_off + length && dst_off < src_off + length) return -EINVAL;
+
+	// Inline contents have no blocks to share
+	if(src->flags & WFS_INODE_INLINE) {
+		char buf[BLOCK_SIZE];
+		memcpy(buf, inline_data(src) + src_off, length);
+		int written = write_inode(dst, buf, length, dst_off);
+		return written < 0 ? written : 0;
+	}
+
+	// A partial last block would overwrite dst data past the range
+	if(length % BLOCK_SIZE != 0 && dst_off + length < dst->size) return -EINVAL;
+	if((dst->flags & WFS_INODE_INLINE) && migrate_inline(dst) < 0) return -ENOSPC;
+
+	int count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	begin_parity_batch();
+	int err = expand_range(dst, dst_off, length);
+
+	// Compressed clusters of src are copied from their decompressed data,
+	// each one decompressed once
+	char cluster[CLUSTER_SIZE];
+	int cluster_index = -1;
+	for(int k = 0; k < count && err == 0; k++) {
+		int lblk = src_off / BLOCK_SIZE + k;
+		int to = dst_off / BLOCK_SIZE + k;
+		off_t from = get_datablock_index_from_inode(lblk, src->blocks);
+		off_t old = get_datablock_index_from_inode(to, dst->blocks);
+
+		int compressed = cluster_compressed(src, lblk / CLUSTER_BLOCKS);
+		if(compressed && lblk / CLUSTER_BLOCKS != cluster_index) {
+			if(read_cluster(src, lblk / CLUSTER_BLOCKS, cluster) < 0) {
+				err = -EIO;
+				break;
 			}
+			cluster_index = lblk / CLUSTER_BLOCKS;
 		}
 
-		// Calculate size to write
-		to_write = BLOCK_SIZE - (curr_position % BLOCK_SIZE);
-		if(size - written < to_write) to_write = size - written;
-		
-		inode->size += to_write;
-		update_metadata();
+		if(!compressed && (block_refs != NULL || from < 0)) {
+			// Share the block, or punch a hole where src has one
+			if(from == old) continue;
+			if(from >= 0) count_ref(from, 1);
+			if((err = set_datablock_index(dst, to, from)) < 0) {
+				if(from >= 0) count_ref(from, -1);
+				break;
+			}
+			if(old >= 0) release_block(old);
+			continue;
+		}
 
-		// Retrieve corresponding data block in memory
-		if((curr_block = get_block(curr_block_index)) == NULL) {
-			perror("write:get_block failed 1\n");
-			return -ENOENT;
+		off_t blk = writable_datablock(dst, to);
+		if(blk == -1) {
+			if((blk = allocate_block(dst, to)) < 0) {
+				err = -ENOSPC;
+				break;
+			}
+			if((err = set_datablock_index(dst, to, blk)) < 0) {
+				free_block(blk);
+				break;
+			}
+		} else if(blk < 0) {
+			err = blk;
+			break;
 		}
-		printf("Writing to %s to block %d\n", path, (int)curr_block_index);
-		// Perform write Operation
-		memcpy(curr_block + (curr_position % BLOCK_SIZE), buf + written, to_write);
 
-		update_all_datablocks(curr_block_index, (void*)curr_block);
+		char copy[BLOCK_SIZE];
+		char *block = compressed ? cluster + lblk % CLUSTER_BLOCKS * BLOCK_SIZE : get_block(from);
+		if(block == NULL) {
+			err = -ENOENT;
+			break;
+		}
+		memcpy(copy, block, BLOCK_SIZE);
+		block = get_block_for_write(blk);
+		memcpy(block, copy, BLOCK_SIZE);
+		update_all_datablocks(blk, block);
+	}
 
-		// Update indexing variables
-		written += to_write;
-		curr_position += to_write;
+	if(err == 0 && dst_off + length > dst->size) dst->size = dst_off + length;
+	if(err == 0) compress_range(dst, dst_off, length);
+	end_parity_batch();
+
+	time(&dst->mtim);
+	update_metadata();
+	return err;
+}
+
+static int wfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+	(void)arg;
+	(void)fi;
+	printf("wfs_ioctl, path: %s, cmd: %x\n", path, (unsigned int)cmd);
+	if(flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+
+	struct wfs_inode *inode;
+	if((inode = get_inode_from_path(path)) == NULL) {
+		return -ENOENT;
 	}
 
-	printf("Total write size to %s: %d. Total size: %d\n", path, (int)written, (int)inode->size);
-	return written;
+	switch((unsigned int)cmd) {
+	case WFS_IOC_GETINO:
+		*(int *)data = inode_handle(inode);
+		return 0;
+	case WFS_IOC_CLONE_RANGE: {
+		if(in_snapshots(path)) return -EROFS;
+		struct wfs_clone_range *range = data;
+		struct wfs_inode *src = inode_from_handle(range->src_ino);
+		if(src == NULL) return -EBADF;
+		wcache_flush_inode(src, 0, 0);
+		wcache_flush_inode(inode, 0, 0);
+		return clone_range(inode, src, range->src_offset, range->dest_offset, range->length);
+	}
+	case FS_IOC_GETFLAGS:
+		// The command is declared with a long, only the low int is the flags
+		memset(data, 0, _IOC_SIZE(cmd));
+		*(unsigned int *)data = (inode->flags & WFS_INODE_COMPRESS) ? FS_COMPR_FL : 0;
+		return 0;
+	case FS_IOC_SETFLAGS: {
+		// chattr +c, files and directories created below inherit the flag
+		unsigned int attr = *(unsigned int *)data;
+		if(attr & ~FS_COMPR_FL) return -EOPNOTSUPP;
+		if(in_snapshots(path)) return -EROFS;
+		if(attr & FS_COMPR_FL) inode->flags |= WFS_INODE_COMPRESS;
+		else inode->flags &= ~WFS_INODE_COMPRESS;
+		time(&inode->ctim);
+		update_metadata();
+		return 0;
+	}
+	default:
+		return -ENOTTY;
+	}
 }
 
 static int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
 	filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
 
+	if(in_snapshots(path) && strcmp(path, SNAPSHOT_DIR) == 0) {
+		for(int i = 0; i < superblock->snap_cnt; i++) {
+			struct wfs_snapshot *snap = (struct wfs_snapshot *)snapshot_slot(i);
+			if(snap->used) filler(buf, snap->name, NULL, 0);
+		}
+		return 0;
+	}
+
 	struct wfs_inode *inode;
 	if((inode = get_inode_from_path(path)) == NULL || !(S_IFDIR & inode->mode)) {
 		return -ENOENT;
@@ -836,25 +3601,277 @@ static int wfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_
 	return 0;
 }
 
+// Answered from the group counters without scanning the bitmaps
+static int wfs_statfs(const char* path, struct statvfs* stbuf) {
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = superblock->num_data_blocks;
+	stbuf->f_bfree = free_blocks_total;
+	stbuf->f_bavail = free_blocks_total;
+	stbuf->f_files = superblock->num_inodes;
+	stbuf->f_ffree = free_inodes_total;
+	stbuf->f_favail = free_inodes_total;
+	stbuf->f_namemax = MAX_NAME - 1;
+	return 0;
+}
+
+// libfuse 2.9 reads requests into 128 KiB buffers, the most a single call can carry
+#define MAX_REQUEST (128 * 1024)
+
+// Ask for big requests and for splice in both directions, so data moves
+// between the kernel and the images without passing through wfs buffers
+static void *wfs_init(struct fuse_conn_info *conn) {
+	// Started here rather than in main, threads do not survive FUSE daemonizing
+	if(write_combine && pthread_create(&wcache_timer, NULL, wcache_timer_main, NULL) == 0) wcache_timer_started = 1;
+	int wanted = FUSE_CAP_BIG_WRITES;
+	if(zero_copy) wanted |= FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE;
+	conn->want |= conn->capable & wanted;
+	conn->max_write = MAX_REQUEST;
+	if(conn->max_readahead < MAX_REQUEST) conn->max_readahead = MAX_REQUEST;
+	printf("Negotiated max_write %u, max_readahead %u, splice%s%s\n", conn->max_write, conn->max_readahead,
+		(conn->want & FUSE_CAP_SPLICE_READ) ? " read" : "", (conn->want & FUSE_CAP_SPLICE_WRITE) ? " write" : "");
+	return NULL;
+}
+
+// Run wfs_name under fs_lock
+#define LOCKED(name, params, args) \
+static int locked_##name params { \
+	pthread_mutex_lock(&fs_lock); \
+	int ret = wfs_##name args; \
+	pthread_mutex_unlock(&fs_lock); \
+	return ret; \
+}
+
+LOCKED(getattr, (const char *path, struct stat *stbuf), (path, stbuf))
+LOCKED(mknod, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev))
+LOCKED(mkdir, (const char *path, mode_t mode), (path, mode))
+LOCKED(unlink, (const char *path), (path))
+LOCKED(rmdir, (const char *path), (path))
+LOCKED(open, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(release, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+LOCKED(read, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+LOCKED(read_buf, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi), (path, bufp, size, offset, fi))
+LOCKED(write, (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+LOCKED(write_buf, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi), (path, buf, offset, fi))
+LOCKED(readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+LOCKED(truncate, (const char *path, off_t size), (path, size))
+LOCKED(ftruncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi))
+LOCKED(fallocate, (const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi), (path, mode, offset, length, fi))
+LOCKED(statfs, (const char *path, struct statvfs *stbuf), (path, stbuf))
+LOCKED(ioctl, (const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data), (path, cmd, arg, fi, flags, data))
 
 static struct fuse_operations ops = {
-  .getattr = wfs_getattr,
-  .mknod   = wfs_mknod,
-  .mkdir   = wfs_mkdir,
-  .unlink  = wfs_unlink,
-  .rmdir   = wfs_rmdir,
-  .read	= wfs_read,
-  .write   = wfs_write,
-  .readdir = wfs_readdir,
+  .init    = wfs_init,
+  .getattr = locked_getattr,
+  .mknod   = locked_mknod,
+  .mkdir   = locked_mkdir,
+  .unlink  = locked_unlink,
+  .rmdir   = locked_rmdir,
+  .open    = locked_open,
+  .release = locked_release,
+  .flush   = locked_flush,
+  .fsync   = locked_fsync,
+  .read	= locked_read,
+  .read_buf  = locked_read_buf,
+  .write   = locked_write,
+  .write_buf = locked_write_buf,
+  .readdir = locked_readdir,
+  .truncate  = locked_truncate,
+  .ftruncate = locked_ftruncate,
+  .fallocate = locked_fallocate,
+  .statfs  = locked_statfs,
+  .ioctl   = locked_ioctl,
+};
+
+
+// Bytes of each disk image used by the filesystem
+off_t image_size() {
+	if(superblock->wib_ptr != 0) return superblock->wib_ptr + (wib_regions() + 8) / 8;
+	if(superblock->snap_ptr != 0) return superblock->snap_ptr + superblock->snap_cnt * superblock->snap_size;
+	if(superblock->refs_ptr != 0) return superblock->refs_ptr + superblock->num_data_blocks * sizeof(uint32_t);
+	return superblock->groups_ptr + superblock->group_cnt * sizeof(struct wfs_group);
+}
+
+struct resilver_job {
+	int disk;         /* Index of the disk being rebuilt */
+	void *target;     /* Mapping of the disk being rebuilt */
+	off_t start;      /* First data block index (inclusive) */
+	off_t end;        /* Last data block index (exclusive) */
+	off_t copied;     /* Number of blocks copied by this job */
 };
 
+// Copy blocks [start, start + count) from the surviving mirrors into target
+void resilver_run(int disk, void *target, off_t start, off_t count) {
+	char *dst = (char *)target + superblock->d_blocks_ptr + start * BLOCK_SIZE;
+
+	if(raid_mode == 10) {
+		// Only every groups'th block belongs to this disk's group, and those
+		// are stored back to back, so the run maps to one contiguous copy
+		off_t groups = raid10_groups();
+		off_t group = disk / superblock->raid_width;
+		off_t first = (start + groups - 1 - group) / groups;
+		off_t last = (start + count - 1 - group) / groups;
+		if(start + count - 1 < group || first > last) return;
+
+		int partner = group * superblock->raid_width;
+		while(regions[partner] == NULL) partner++;
+		memcpy((char *)target + superblock->d_blocks_ptr + first * BLOCK_SIZE,
+			(char *)regions[partner] + superblock->d_blocks_ptr + first * BLOCK_SIZE, (last - first + 1) * BLOCK_SIZE);
+	} else if(raid_mode == 5) {
+		// Rebuild every stripe the run touches from the other members, this
+		// covers both the data and the parity blocks the disk held
+		for(off_t stripe = start / (disk_count - 1); stripe <= (start + count - 1) / (disk_count - 1); stripe++) {
+			raid5_rebuild(stripe, disk, (char *)target + superblock->d_blocks_ptr + stripe * BLOCK_SIZE);
+		}
+	} else if(raid_mode == 1) {
+		// Mirrors are identical, copy the whole run at once
+		memcpy(dst, (char *)regions[primary_disk] + superblock->d_blocks_ptr + start * BLOCK_SIZE, count * BLOCK_SIZE);
+	} else {
+		// Raid 1v, let get_block pick the majority copy of every block
+		for(off_t i = 0; i < count; i++) {
+			memcpy(dst + i * BLOCK_SIZE, get_block(start + i), BLOCK_SIZE);
+		}
+	}
+}
+
+// Walk one slice of the data bitmap and copy every allocated run of blocks
+void *resilver_worker(void *arg) {
+	struct resilver_job *job = (struct resilver_job *)arg;
+	uint8_t *bitmap = (uint8_t *)((char *)metadata + superblock->d_bitmap_ptr);
+
+	off_t i = job->start;
+	while(i < job->end) {
+		// Skip empty bitmap bytes without testing each bit
+		if(i % 8 == 0 && bitmap[i / 8] == 0) {
+			i += 8;
+			continue;
+		}
+		if(!(bitmap[i / 8] & (1 << i % 8))) {
+			i++;
+			continue;
+		}
+
+		off_t run_end = i;
+		while(run_end < job->end && (bitmap[run_end / 8] & (1 << run_end % 8))) run_end++;
+
+		resilver_run(job->disk, job->target, i, run_end - i);
+		job->copied += run_end - i;
+		i = run_end;
+	}
+	return NULL;
+}
+
+// Return -1 if fail
+int resilver(int index, void *target) {
+	struct timespec begin, finish;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	// Superblock keeps the identity of the disk it replaces
+	memcpy(target, superblock, sizeof(struct wfs_sb));
+	((struct wfs_sb *)target)->mount_index = index;
+
+	// Bitmaps and inodes are identical on every mirror
+	memcpy((char *)target + superblock->i_bitmap_ptr, (char *)metadata + superblock->i_bitmap_ptr, superblock->d_blocks_ptr - superblock->i_bitmap_ptr);
+
+	// So are the tables and snapshots after the data region
+	off_t tail = tables_ptr();
+	memcpy((char *)target + tail, (char *)regions[primary_disk] + tail, image_size() - tail);
+
+	// Split the data bitmap into byte aligned slices, one per thread
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads < 1) nthreads = 1;
+	if(nthreads > RESILVER_MAX_THREADS) nthreads = RESILVER_MAX_THREADS;
+
+	off_t slice = ((superblock->num_data_blocks / nthreads) + 7) & ~7;
+	if(slice == 0) slice = 8;
+
+	pthread_t threads[RESILVER_MAX_THREADS];
+	struct resilver_job jobs[RESILVER_MAX_THREADS];
+	int started = 0;
+	for(off_t start = 0; start < superblock->num_data_blocks && started < nthreads; start += slice) {
+		jobs[started].disk = index;
+		jobs[started].target = target;
+		jobs[started].start = start;
+		jobs[started].end = start + slice;
+		if(started == nthreads - 1 || jobs[started].end > superblock->num_data_blocks)
+			jobs[started].end = superblock->num_data_blocks;
+		jobs[started].copied = 0;
+
+		if(pthread_create(&threads[started], NULL, resilver_worker, &jobs[started]) != 0) {
+			perror("resilver: pthread_create failed\n");
+			return -1;
+		}
+		started++;
+	}
+
+	off_t copied = 0;
+	for(int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+		copied += jobs[i].copied;
+	}
+
+	if(msync(target, image_size(), MS_SYNC) < 0) {
+		perror("resilver: msync failed\n");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	printf("Resilvered disk %d: %ld of %ld blocks in %.3fs with %d threads\n", index, (long)copied,
+		(long)superblock->num_data_blocks,
+		(finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9, started);
+	return 0;
+}
+
+// Keep the offline tools off a mounted disk, waiting for a wfs that is still exiting
+// Return -1 if fail
+int lock_disk(int fd) {
+	for(int tries = 0; flock(fd, LOCK_EX | LOCK_NB) < 0; tries++) {
+		if(errno != EWOULDBLOCK || tries == LOCK_WAIT * 10) return -1;
+		usleep(100000);
+	}
+	return 0;
+}
+
+// Strip wfs options out of argv so only FUSE options reach fuse_main
+// Return -1 if fail
+int parse_wfs_options(int *argc, char *argv[]) {
+	int out = disk_count + 1;
+	for(int i = disk_count + 1; i < *argc; i++) {
+		if(strcmp(argv[i], "--degraded") == 0) {
+			allow_degraded = 1;
+		} else if(strcmp(argv[i], "--no-readahead") == 0) {
+			readahead_hints = 0;
+		} else if(strcmp(argv[i], "--no-write-combine") == 0) {
+			write_combine = 0;
+		} else if(strcmp(argv[i], "--no-zero-copy") == 0) {
+			zero_copy = 0;
+		} else if(strcmp(argv[i], "--discard") == 0) {
+			discard = 1;
+		} else if(strncmp(argv[i], "--cache=", 8) == 0) {
+			cache_path = argv[i] + 8;
+		} else if(strncmp(argv[i], "--replace=", 10) == 0) {
+			if(replace_count >= MAX_DISK) return -1;
+			replace_paths[replace_count++] = argv[i] + 10;
+		} else {
+			argv[out++] = argv[i];
+		}
+	}
+	*argc = out;
+	argv[out] = NULL;
+	return 0;
+}
 
 int main(int argc, char *argv[]) {
 	int fd[MAX_DISK];
 	void *tmp_region[MAX_DISK];
+	int opened = 0;
 	struct stat stats;
 	int unique_run_id = -1;
 	int present[MAX_DISK] = {0};
+	char *names[MAX_DISK];
 	
 	// Count disks
 	for(int i = 1; i < argc; i++) {
@@ -862,8 +3879,13 @@ int main(int argc, char *argv[]) {
 		disk_count++;
 	}
 
-	if(disk_count < 2) {
-		perror("Not enough disks, need at least 2\n");
+	if(disk_count < 1 || disk_count > MAX_DISK) {
+		perror("Need between 1 and MAX_DISK disks\n");
+		exit(1);
+	}
+
+	if(parse_wfs_options(&argc, argv) < 0) {
+		perror("Too many replacement disks\n");
 		exit(1);
 	}
 
@@ -873,6 +3895,10 @@ int main(int argc, char *argv[]) {
 			printf("open failed on %s\n", argv[i + 1]);
 			exit(-ENOENT);
 		}
+		if(lock_disk(fd[i]) < 0) {
+			printf("%s is in use, is the array mounted already?\n", argv[i + 1]);
+			exit(1);
+		}
 
 		if(fstat(fd[i], &stats) < 0) {
 			perror("fstat failed\n");
@@ -884,11 +3910,23 @@ int main(int argc, char *argv[]) {
 			perror("mmap failed\n");
 			exit(-1);
 		}
+		opened++;
 	}
 
 	// Reorder disks based on index in superblock
 	for(int i = 0; i < disk_count; i++) {
-		regions[((struct wfs_sb *)tmp_region[i])->mount_index] = tmp_region[i];
+		if(((struct wfs_sb *)tmp_region[i])->magic != WFS_MAGIC || ((struct wfs_sb *)tmp_region[i])->version != WFS_VERSION) {
+			printf("%s is not a version %d wfs disk, re-run mkfs on the array\n", argv[i + 1], WFS_VERSION);
+			exit(1);
+		}
+		int index = ((struct wfs_sb *)tmp_region[i])->mount_index;
+		if(index < 0 || index >= MAX_DISK || present[index]) {
+			printf("invalid or duplicate disk %s\n", argv[i + 1]);
+			exit(1);
+		}
+		regions[index] = tmp_region[i];
+		disk_fds[index] = fd[i];
+		names[index] = argv[i + 1];
 
 		// make sure all disks are from same mkfs run
 		if(unique_run_id == -1) unique_run_id = ((struct wfs_sb *)tmp_region[i])->timestamp;
@@ -897,7 +3935,7 @@ int main(int argc, char *argv[]) {
 			exit(1);
 		}
 
-		present[((struct wfs_sb *)tmp_region[i])->mount_index] = 1;
+		present[index] = 1;
 	}
 
 	// Update argc and remove disk arguments in argv
@@ -905,21 +3943,128 @@ int main(int argc, char *argv[]) {
 	argv[disk_count] = argv[0];
 	argv += disk_count;
 
-	superblock = ((struct wfs_sb *)regions[0]);
+	// Every mount raises the generation of the disks it had, a disk that
+	// missed one holds stale data and has to be rebuilt
+	int newest = 0;
+	for(int i = 0; i < MAX_DISK; i++) {
+		if(present[i] && ((struct wfs_sb *)regions[i])->generation > newest) newest = ((struct wfs_sb *)regions[i])->generation;
+	}
+	for(int i = 0; i < MAX_DISK; i++) {
+		if(present[i] && ((struct wfs_sb *)regions[i])->generation < newest) {
+			printf("%s is stale, generation %d of %d, pass it with --replace=%s to rebuild it\n",
+				names[i], ((struct wfs_sb *)regions[i])->generation, newest, names[i]);
+			exit(1);
+		}
+	}
+
+	while(!present[primary_disk]) primary_disk++;
+	superblock = ((struct wfs_sb *)regions[primary_disk]);
 	raid_mode = superblock->raid_mode;
 
-	// Make sure all disks are accounted for
+	if(superblock->disk_cnt > MAX_DISK) {
+		perror("superblock disk count is invalid\n");
+		exit(1);
+	}
+
+	// Every disk must be accounted for unless the array has redundancy to cover it
+	int missing = 0;
 	for(int i = 0; i < superblock->disk_cnt; i++) {
-		if(present[i] != 1) exit(1);
+		if(present[i] != 1) missing++;
+	}
+
+	if(missing > 0 && raid_mode == 0) {
+		printf("raid 0 array is missing %d of %d disks, it can not be mounted or rebuilt\n", missing, superblock->disk_cnt);
+		exit(1);
+	}
+	if(missing > 1 && raid_mode == 5) {
+		printf("raid 5 array is missing %d of %d disks, parity can only cover one\n", missing, superblock->disk_cnt);
+		exit(1);
+	}
+	if(raid_mode == 10) {
+		for(int g = 0; g < superblock->disk_cnt; g += superblock->raid_width) {
+			int copies = 0;
+			for(int i = g; i < g + superblock->raid_width; i++) copies += present[i];
+			if(copies == 0) {
+				printf("raid 10 mirror group of disks %d-%d is missing entirely\n", g, g + superblock->raid_width - 1);
+				exit(1);
+			}
+		}
+	}
+	if(replace_count > missing) {
+		printf("%d replacement disks given but only %d disks are missing\n", replace_count, missing);
+		exit(1);
+	}
+	if(missing > replace_count && !allow_degraded) {
+		printf("array is missing %d disks, pass --degraded to mount without them\n", missing - replace_count);
+		exit(1);
 	}
 
 	disk_count = superblock->disk_cnt;
+	missing_disks = missing;
+	if(raid_mode == 5) init_raid5();
 
-	metadata = malloc(superblock->d_blocks_ptr);
-	if(!metadata) {
-		return -ENOMEM;
+	// Bitmaps and inodes are read from the mapping as they are used
+	metadata = regions[primary_disk];
+
+	// Rebuild replacement disks into the missing slots
+	off_t disk_size = image_size();
+	for(int r = 0; r < replace_count; r++) {
+		if((fd[opened] = open(replace_paths[r], O_RDWR)) <= 0) {
+			printf("open failed on %s\n", replace_paths[r]);
+			exit(-ENOENT);
+		}
+		if(lock_disk(fd[opened]) < 0) {
+			printf("%s is in use, is the array mounted already?\n", replace_paths[r]);
+			exit(1);
+		}
+		if(fstat(fd[opened], &stats) < 0) {
+			perror("fstat failed\n");
+			exit(-1);
+		}
+		if(stats.st_size < disk_size) {
+			printf("replacement %s is too small, need %ld bytes\n", replace_paths[r], (long)disk_size);
+			exit(1);
+		}
+
+		tmp_region[opened] = mmap(NULL, stats.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd[opened], 0);
+		if(tmp_region[opened] == MAP_FAILED) {
+			perror("mmap failed\n");
+			exit(-1);
+		}
+
+		// Refuse to overwrite a disk that is already part of this array
+		struct wfs_sb *old = (struct wfs_sb *)tmp_region[opened];
+		if(old->timestamp == unique_run_id && old->mount_index >= 0 && old->mount_index < MAX_DISK && present[old->mount_index]) {
+			printf("%s is already a member of this array\n", replace_paths[r]);
+			exit(1);
+		}
+
+		// A stale member goes back into its own slot, a new disk into the first missing one
+		int i = 0;
+		if(old->timestamp == unique_run_id && old->mount_index >= 0 && old->mount_index < disk_count && !present[old->mount_index]) {
+			i = old->mount_index;
+		} else {
+			while(present[i]) i++;
+		}
+
+		// Blank the replacement so blocks the resilver skips read as zeros
+		if(ftruncate(fd[opened], 0) < 0 || ftruncate(fd[opened], stats.st_size) < 0) {
+			perror("ftruncate failed\n");
+			exit(-1);
+		}
+
+		if(resilver(i, tmp_region[opened]) < 0) exit(1);
+
+		regions[i] = tmp_region[opened];
+		disk_fds[i] = fd[opened];
+		present[i] = 1;
+		missing_disks--;
+		opened++;
+	}
+
+	for(int i = 0; i < disk_count; i++) {
+		if(present[i] != 1) printf("Mounting degraded, disk %d is missing\n", i);
 	}
-	memcpy(metadata, regions[0], superblock->d_blocks_ptr);
 
 	//for (int i = 1; i < disk_count; i++)
 	//	if (memcmp((char *)regions[0] + superblock->i_bitmap_ptr, (char *)regions[i] + superblock->i_bitmap_ptr, superblock->d_blocks_ptr - superblock->i_bitmap_ptr) != 0) {
@@ -927,10 +4072,49 @@ int main(int argc, char *argv[]) {
 	//		exit(-1);
 	//	}
 
+	wib_resync();
+
+	if(init_groups() < 0) {
+		perror("Failed to load allocation groups\n");
+		exit(-1);
+	}
+	if(init_snapshots() < 0) {
+		perror("Failed to load snapshot reference counts\n");
+		exit(-1);
+	}
+	init_allocator();
+	if(discard && (discard_pending = calloc((superblock->num_data_blocks + 7) / 8, 1)) == NULL) {
+		perror("Failed to allocate the discard bitmap\n");
+		exit(-1);
+	}
+	if(cache_path != NULL && cache_open(cache_path) < 0) exit(1);
+	if(cache_path != NULL) {
+		madvise(metadata, superblock->d_blocks_ptr, MADV_WILLNEED);
+	}
+
+	// Whatever this mount changes, a cache image closed before it and a
+	// disk missing from it are stale
+	int generation = superblock->generation + 1;
+	for(int i = 0; i < disk_count; i++) {
+		if(regions[i] == NULL) continue;
+		((struct wfs_sb *)regions[i])->generation = generation;
+		sync_range(regions[i], sizeof(struct wfs_sb));
+	}
+
+	// Without the buffer callbacks FUSE copies through read and write
+	if(!zero_copy) {
+		ops.read_buf = NULL;
+		ops.write_buf = NULL;
+	}
+
 	int fuse_out = fuse_main(argc, argv, &ops, NULL);
+	wcache_timer_join();
+	if(discard_count > 0) discard_flush();
+	wib_clear(1);
+	cache_close();
 
 	// Unmap all regions
-	for(int i = 0; i < disk_count; i++) {
+	for(int i = 0; i < opened; i++) {
 		if(fstat(fd[i], &stats) < 0) {
 			perror("fstat failed\n");
 			exit(-1);
@@ -940,7 +4124,8 @@ int main(int argc, char *argv[]) {
 		munmap(tmp_region[i], stats.st_size);
 		close(fd[i]);
 	}
-	free(metadata);
+	free(group_table);
+	free(block_refs);
 
 	return fuse_out;
 }
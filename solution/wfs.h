@@ -1,5 +1,6 @@
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 
 #define BLOCK_SIZE (512)
 #define MAX_NAME   (28)
@@ -9,6 +10,25 @@
 #define IND_BLOCK  (D_BLOCK+1)
 #define N_BLOCKS   (IND_BLOCK+1)
 
+#define GROUP_BLOCKS (256)   /* Data blocks per allocation group */
+#define MAX_SNAPSHOTS (8)
+
+#define WIB_CHUNK (128)          /* Data blocks covered by one write-intent bit */
+#define LOCK_WAIT (5)            /* Seconds to wait for another process to let go of a disk */
+
+#define CLUSTER_BLOCKS (4)       /* Blocks compressed together */
+#define COMPRESSED_BLOCK (-2)    /* Block pointer of a slot a compressed cluster freed */
+
+// Optional features, chosen with mkfs -O
+#define WFS_FEATURE_INLINE (1 << 0)   /* Small files live in their inode block */
+#define WFS_FEATURE_SNAPSHOT (1 << 1) /* Copy-on-write snapshots under /.snapshots */
+#define WFS_FEATURE_REFLINK  (1 << 2) /* Block reference counts without snapshots */
+#define WFS_FEATURE_COMPRESS (1 << 3) /* Compress every file, not only in chattr +c directories */
+
+// Inode flags
+#define WFS_INODE_INLINE   (1 << 0)   /* Contents stored after the inode */
+#define WFS_INODE_COMPRESS (1 << 1)   /* Full clusters are compressed, inherited from the directory */
+
 /*
   The fields in the superblock should reflect the structure of the filesystem.
   `mkfs` writes the superblock to offset 0 of the disk image. 
@@ -22,6 +42,53 @@
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
+  magic and version identify the layout below. Images made by another
+  version of mkfs are refused and have to be made again.
+
+  Raid 5 keeps disk_cnt - 1 data blocks and their parity in each slot of
+  the data region, so the region only holds num_data_blocks / (disk_cnt - 1)
+  blocks rounded up. It is followed by a table of one crc32 per data block
+  (csum_ptr), mirrored on every disk like the rest of the metadata.
+
+  Raid 10 splits the disks into groups of raid_width consecutive disks that
+  mirror each other, and stripes data blocks across the groups. The data
+  region of each disk holds num_data_blocks / groups blocks rounded up.
+
+  Data blocks and inodes are split into group_cnt allocation groups of
+  group_blocks blocks and group_inodes inodes. A table of struct wfs_group
+  holding each group's free counts follows the data region (groups_ptr) and
+  is mirrored on every disk.
+
+  Files written with compression on group their logical blocks into
+  clusters of CLUSTER_BLOCKS. A full cluster that compresses into fewer
+  blocks keeps a 2 byte length and the LZ4 stream in its first pointers
+  and marks the rest COMPRESSED_BLOCK.
+
+  With snapshots or reflinks enabled a table of one uint32_t per data
+  block (refs_ptr) counts the extra references snapshots and clones hold
+  on it. Snapshots add snap_cnt slots of snap_size bytes (snap_ptr). A
+  slot is a struct wfs_snapshot in its first block, then a copy of the
+  inode bitmap, then a copy of the inode table starting at the next block
+  boundary.
+
+  Arrays with redundancy end with a write-intent bitmap (wib_ptr), one bit
+  per wib_chunk data blocks and a last bit for the metadata, identical on
+  every disk. A set bit marks a region whose copies may differ.
+
+  generation is raised by every mount and by offline tools that change
+  the array, so a cache image can tell whether it is still current.
+
+  wfs holds an exclusive flock on every disk image while it is mounted,
+  and so do the offline tools that write to the images. A wfs that was
+  just unmounted may still be exiting, so the lock is waited for up to
+  LOCK_WAIT seconds before a disk is reported as in use.
+
+  A cache image given to wfs with --cache=path keeps copies of hot data
+  blocks. Its first block is a struct wfs_cache, the next one starts a
+  table of one struct wfs_cache_slot per slot, and the slots' blocks
+  follow from data_ptr. The table is written on unmount, and only trusted
+  while clean is set and generation matches the array's.
+
 */
 
 // Superblock
@@ -38,6 +105,60 @@ struct wfs_sb {
     int mount_index;
     int timestamp;
     int disk_cnt;
+    int magic;
+    int version;
+    off_t csum_ptr;
+    int raid_width;
+    int features;
+    off_t groups_ptr;
+    int group_cnt;
+    int group_blocks;
+    int group_inodes;
+    off_t refs_ptr;
+    off_t snap_ptr;
+    off_t snap_size;
+    int snap_cnt;
+    off_t wib_ptr;
+    int wib_chunk;
+    int generation;
+};
+
+// Allocation group counters
+struct wfs_group {
+    int free_blocks;
+    int free_inodes;
+    int dirs;
+};
+
+// Snapshot slot header
+struct wfs_snapshot {
+    char name[MAX_NAME];
+    int used;
+    time_t ctim;      /* Time the snapshot was taken */
+};
+
+#define WFS_MAGIC (0x42534657)         /* "WFSB" */
+#define WFS_VERSION (1)
+
+#define WFS_CACHE_MAGIC (0x43534657)   /* "WFSC" */
+
+// Cache image header
+struct wfs_cache {
+    int magic;
+    int timestamp;    /* Of the array it caches */
+    int generation;   /* Array generation it was closed at */
+    int clean;        /* Closed by an unmount, the slot table is valid */
+    int slots;
+    off_t data_ptr;
+};
+
+// Cache slot table entry
+struct wfs_cache_slot {
+    off_t block;          /* Data block held, -1 if none */
+    int slot;
+    int list;             /* 2Q queue it was on */
+    unsigned int crc;     /* crc32 of the slot's block */
+    unsigned long stamp;  /* Order it was last used in */
 };
 
 // Inode
@@ -54,8 +175,32 @@ struct wfs_inode {
     time_t ctim;      /* Time of last status change */
 
     off_t blocks[N_BLOCKS];
+    int     flags;    /* WFS_INODE_* flags */
 };
 
+// Bytes of file data that fit in the rest of an inode's block
+#define INLINE_SIZE (BLOCK_SIZE - sizeof(struct wfs_inode))
+
+// File clones, issued by wfs-clone on files inside the mount.
+// WFS_IOC_GETINO returns a handle for the source file that
+// WFS_IOC_CLONE_RANGE on the destination takes as src_ino.
+struct wfs_clone_range {
+    int   src_ino;
+    off_t src_offset;
+    off_t dest_offset;
+    off_t length;     /* 0 clones up to the end of the source */
+};
+
+#define WFS_IOC_GETINO      _IOR('W', 1, int)
+#define WFS_IOC_CLONE_RANGE _IOW('W', 2, struct wfs_clone_range)
+
+// chattr +c / lsattr, linux/fs.h clashes with BLOCK_SIZE above
+#ifndef FS_IOC_GETFLAGS
+#define FS_IOC_GETFLAGS     _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS     _IOW('f', 2, long)
+#define FS_COMPR_FL         0x00000004
+#endif
+
 // Directory entry
 struct wfs_dentry {
     char name[MAX_NAME];
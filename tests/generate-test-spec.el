@@ -402,6 +402,72 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 		      testlist))
 		 raidconfigs)))
 
+(defun tool-test (desc raid numdisks mkfs-extra run output &optional unmounted)
+  "Test template for the offline tools.
+
+The filesystem is made and mounted like for the other filesystem
+tests. RUN unmounts it before running a tool on the disks, and mounts
+it again to read back what the tool left.
+
+DESC description of the test
+RAID raid mode as string
+NUMDISKS the number of disks
+MKFS-EXTRA more mkfs arguments, like mkfs features
+RUN the commands to run
+OUTPUT the expected output
+UNMOUNTED leave the fresh filesystem unmounted for RUN"
+  (define-test
+   desc
+   (string-join
+    (append
+     (list
+      "mkdir -p mnt; mkdir -p /tmp/$(whoami)"
+      (create-disk-cmd numdisks "1M")
+      (concat "../solution/mkfs " (default-fs-mkfs-args raid numdisks) mkfs-extra))
+     (if unmounted nil (list (mount-cmd numdisks "mnt"))))
+    " && ")
+   (teardown-cmd)
+   run
+   output
+   "0" "0" ""))
+
+(defun fsck-cmd (numdisks &optional args)
+  "Run wfs-fsck with ARGS on NUMDISKS disks.
+
+One thread keeps the problems in order. The disk directory and the run
+time are cut from the output, and the exit status is printed after it."
+  (format "../solution/wfs-fsck -t 1%s %s | sed -e \"s|/tmp/$(whoami)/||g\" -e 's/, [0-9.]*s$//'; echo \"exit ${PIPESTATUS[0]}\""
+	  (if args (concat " " args) "")
+	  (string-join (gen-disks numdisks) " ")))
+
+(defun import-cmd (numdisks)
+  "Run wfs-import from the import source directory on NUMDISKS disks."
+  (format "../solution/wfs-import %s %s" (disk-path "import-src") (string-join (gen-disks numdisks) " ")))
+
+(defun disk-blocks-cmd ()
+  "Print how many blocks the first test disk takes up on the host."
+  (format "stat -c %%b %s" (disk-path "test-disk1")))
+
+(defun trim-run (numdisks)
+  "Free a file on NUMDISKS disks, trim them and read back the file left.
+
+The first disk has to take up fewer host blocks after wfs-trim."
+  (string-join
+   (list "./read-write.py 2 80"
+	 "rm mnt/file2"
+	 "cat mnt/file1 > file1.test"
+	 "fusermount -u mnt"
+	 (format "before=$(%s)" (disk-blocks-cmd))
+	 (format "../solution/wfs-trim %s > /dev/null" (string-join (gen-disks numdisks) " "))
+	 (format "[ $(%s) -lt $before ]" (disk-blocks-cmd))
+	 "echo Correct"
+	 (mount-cmd numdisks "mnt")
+	 "diff mnt/file1 file1.test"
+	 "echo Correct"
+	 "fusermount -u mnt"
+	 (fsck-cmd numdisks))
+   " && "))
+
 ; returns (filesystem-init-success 2 "1" "desc" '(())
 (generate-tests
  `(((testcase . ,#'mkfs-test)
@@ -503,4 +569,470 @@ POST-BLOCKS additional blocks we should expect (e.g. no cleaning dir blocks)"
 			  (mount-cmd 3 "mnt")
 			  "diff mnt/file1 file1.test")
 		    "; ")
-		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0))))))
+		  ,'(("file1" . 1000)) 0 "1v" 3 "Correct\nCorrect\nCorrect" 0)
+		 ("raid0 -- truncate: keep part of the indirect block" ,'(("file1" . 8192))
+		  ,(string-join
+		    (list "head -c 5000 mnt/file1 > file1.test" ; expected contents
+			  "truncate -s 5000 mnt/file1" ; frees data blocks behind the indirect block
+			  "fusermount -u mnt"
+			  (mount-cmd 3 "mnt")
+			  "diff mnt/file1 file1.test")
+		    "; ")
+		  ,'(("file1" . 5000)) 0 "0" 3 "Correct\nCorrect" 0))))
+   ((testcase . ,#'tool-test)
+;;    (desc raid numdisks mkfs-extra run output)
+    (configs . (("raid1 -- fsck: clean array" "1" 2 ""
+		 ,(string-join
+		   (list "./read-write.py 2 40"
+			 "mkdir mnt/d1"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\n4/32 inodes, 19/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("raid1 -- fsck: repair a scribbled mirror" "1" 2 ""
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (format "./scribble-disk.py --inode 1 --disks %s" (disk-path "test-disk2"))
+			 (fsck-cmd 2)
+			 (fsck-cmd 2 "-r")
+			 (fsck-cmd 2)
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file1 file1.test")
+		   "; ")
+		 ,(string-join
+		   (list "Correct"
+			 "mirrors: inodes of test-disk2 differs from test-disk1 in 1 blocks"
+			 "2/32 inodes, 10/224 blocks, 1 problems, 0 repaired"
+			 "exit 4"
+			 "mirrors: inodes of test-disk2 differs from test-disk1 in 1 blocks (repaired)"
+			 "2/32 inodes, 10/224 blocks, 1 problems, 1 repaired"
+			 "exit 1"
+			 "2/32 inodes, 10/224 blocks, 0 problems, 0 repaired"
+			 "exit 0")
+		   "\n"))
+		("raid5 -- fsck: repair scribbled data and parity blocks" "5" 3 ""
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 ; stripe 1 keeps data on the third disk, stripe 3 its parity
+			 (format "./scribble-disk.py --slots 1 3 --disks %s" (disk-path "test-disk3"))
+			 (fsck-cmd 3)
+			 (fsck-cmd 3 "-r")
+			 (fsck-cmd 3)
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file1 file1.test")
+		   "; ")
+		 ,(string-join
+		   (list "Correct"
+			 "parity: stripe 1: block on test-disk3 fails its checksum"
+			 "parity: stripe 3: parity does not match its data"
+			 "2/32 inodes, 10/224 blocks, 2 problems, 0 repaired"
+			 "exit 4"
+			 "parity: stripe 1: block on test-disk3 fails its checksum (repaired)"
+			 "parity: stripe 3: parity does not match its data (repaired)"
+			 "2/32 inodes, 10/224 blocks, 2 problems, 2 repaired"
+			 "exit 1"
+			 "2/32 inodes, 10/224 blocks, 0 problems, 0 repaired"
+			 "exit 0")
+		   "\n"))
+		("raid1 -- fsck: repair the block bitmap and reference counts" "1" 2 " -O reflink"
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (format "./scribble-disk.py --bitmap 150 --refs 1 --disks %s"
+				 (string-join (gen-disks 2) " "))
+			 (fsck-cmd 2)
+			 (fsck-cmd 2 "-r")
+			 (fsck-cmd 2)
+			 (mount-cmd 2 "mnt")
+			 "diff mnt/file1 file1.test")
+		   "; ")
+		 ,(string-join
+		   (list "Correct"
+			 "refs: block 1 has 3 extra references, 0 are held"
+			 "bitmaps: block 150 is allocated but nothing points at it"
+			 "groups: group 0 counts 214 free blocks 30 free inodes 1 dirs, bitmaps say 213 30 1"
+			 "2/32 inodes, 10/224 blocks, 3 problems, 0 repaired"
+			 "exit 4"
+			 "refs: block 1 has 3 extra references, 0 are held (repaired)"
+			 "bitmaps: block 150 is allocated but nothing points at it (repaired)"
+			 "2/32 inodes, 10/224 blocks, 2 problems, 2 repaired"
+			 "exit 1"
+			 "2/32 inodes, 10/224 blocks, 0 problems, 0 repaired"
+			 "exit 0")
+		   "\n"))
+		("raid5 -- import: tree with indirect and inline files" "5" 3 " -O inline"
+		 ,(concat
+		   (format "rm -rf %s; " (disk-path "import-src"))
+		   (string-join
+		    (list (format "mkdir -p %s/d1/d2" (disk-path "import-src"))
+			  (format "head -c 5000 /dev/urandom > %s/d1/d2/big" (disk-path "import-src")) ; indirect block
+			  (format "head -c 700 /dev/urandom > %s/d1/two" (disk-path "import-src"))
+			  (format "echo inline > %s/small" (disk-path "import-src")) ; fits in the inode
+			  (concat (import-cmd 3) " > /dev/null")
+			  (mount-cmd 3 "mnt")
+			  (format "diff -r %s mnt" (disk-path "import-src"))
+			  "echo Correct"
+			  "fusermount -u mnt"
+			  (fsck-cmd 3))
+		    " && ")
+		   (format "; rm -rf %s" (disk-path "import-src")))
+		 "Correct\n6/32 inodes, 16/224 blocks, 0 problems, 0 repaired\nexit 0" t)
+		("raid1 -- import: refuse a file over the largest size" "1" 2 ""
+		 ,(concat
+		   (format "rm -rf %s; " (disk-path "import-src"))
+		   (string-join
+		    (list (format "mkdir -p %s/d1" (disk-path "import-src"))
+			  (format "head -c 36353 /dev/zero > %s/d1/huge" (disk-path "import-src"))
+			  (format "echo a > %s/ok" (disk-path "import-src"))
+			  (concat (import-cmd 2) " 2>&1 | sed \"s|/tmp/$(whoami)/||\"; echo \"exit ${PIPESTATUS[0]}\""))
+		    " && ")
+		   "; " (fsck-cmd 2)
+		   (format "; rm -rf %s" (disk-path "import-src")))
+		 ,(string-join
+		   (list "import-src/d1/huge: 36353 bytes, wfs files hold at most 36352"
+			 "exit 1"
+			 "1/32 inodes, 0/224 blocks, 0 problems, 0 repaired"
+			 "exit 0")
+		   "\n")
+		 t)
+		("raid1 -- import: run out of inodes" "1" 2 ""
+		 ,(concat
+		   (format "rm -rf %s; " (disk-path "import-src"))
+		   (string-join
+		    (list (format "mkdir -p %s/d1" (disk-path "import-src"))
+			  (format "for i in $(seq 1 40); do echo $i > %s/d1/f$i; done" (disk-path "import-src"))
+			  (concat (import-cmd 2) " 2>&1 | sed \"s|/tmp/$(whoami)/||\"; echo \"exit ${PIPESTATUS[0]}\""))
+		    " && ")
+		   "; " (fsck-cmd 2)
+		   (format "; rm -rf %s" (disk-path "import-src")))
+		 ,(string-join
+		   (list "out of inodes, 32 are not enough"
+			 "exit 1"
+			 "1/32 inodes, 0/224 blocks, 0 problems, 0 repaired"
+			 "exit 0")
+		   "\n")
+		 t)
+		("raid1 -- trim: freed blocks become holes" "1" 2 ""
+		 ,(trim-run 2)
+		 "Correct\nCorrect\nCorrect\n2/32 inodes, 18/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("raid5 -- trim: freed blocks become holes" "5" 3 ""
+		 ,(trim-run 3)
+		 "Correct\nCorrect\nCorrect\n2/32 inodes, 18/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("raid5 -- discard: punch freed blocks on unmount" "5" 3 ""
+		 ,(string-join
+		   (list (format "before=$(%s)" (disk-blocks-cmd))
+			 (concat (mount-cmd 3 "mnt") " --discard")
+			 "./read-write.py 2 80"
+			 "rm mnt/file2"
+			 "cat mnt/file1 > file1.test"
+			 ; freed blocks are punched when wfs exits, after fusermount returns
+			 "pid=$(pgrep -n -x wfs)"
+			 "fusermount -u mnt"
+			 "tail --pid=$pid -f /dev/null"
+			 (format "[ $(%s) -lt $before ]" (disk-blocks-cmd))
+			 "echo Correct"
+			 (mount-cmd 3 "mnt")
+			 "diff mnt/file1 file1.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 3))
+		   " && ")
+		 "Correct\nCorrect\nCorrect\n2/32 inodes, 18/224 blocks, 0 problems, 0 repaired\nexit 0"
+		 t)
+		("raid1 -- resync: catch up a mirror a crash left behind" "1" 2 ""
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 ; the intent bit of region 0 says slot 3 may differ
+			 (format "./scribble-disk.py --slots 3 --wib 0 --disks %s" (disk-path "test-disk2"))
+			 (concat (mount-cmd 2 "mnt") " > /dev/null")
+			 "diff mnt/file1 file1.test"
+			 "fusermount -u mnt"
+			 (format "./wfs-check-metadata.py --mode raid1 --blocks 10 --dirs 1 --files 1 --disks %s"
+				 (string-join (gen-disks 2) " ")))
+		   " && ")
+		 "Correct\nCorrect")
+		("raid5 -- resync: rebuild members that fail their checksum" "5" 3 ""
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (format "./scribble-disk.py --slots 0 1 2 3 --wib 0 1 --disks %s" (disk-path "test-disk1"))
+			 (concat (mount-cmd 3 "mnt") " > /dev/null")
+			 "diff mnt/file1 file1.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 3))
+		   " && ")
+		 "Correct\nCorrect\n2/32 inodes, 10/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("raid5 -- round trip files through the parity stripes" "5" 3 ""
+		 ,(string-join
+		   (list "./read-write.py 2 80"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (concat (mount-cmd 3 "mnt") " > /dev/null")
+			 "diff mnt/file2 file1.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 3))
+		   " && ")
+		 "Correct\nCorrect\n3/32 inodes, 35/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("raid5 -- degraded: rebuild reads from parity with a member deleted" "5" 3 ""
+		 ,(string-join
+		   (list "./read-write.py 1 80"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (format "rm %s" (disk-path "test-disk2"))
+			 (format "../solution/wfs %s %s -s mnt --degraded > /dev/null" (disk-path "test-disk1") (disk-path "test-disk3"))
+			 "diff mnt/file1 file1.test"
+			 "echo Correct")
+		   " && ")
+		 "Correct\nCorrect")
+		("raid5 -- checksum: repair scribbled data blocks on read" "5" 3 ""
+		 ,(string-join
+		   (list "./read-write.py 1 80"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 ; slot 1 of the second disk holds parity, the others data
+			 (format "./scribble-disk.py --slots 0 2 3 --disks %s" (disk-path "test-disk2"))
+			 (concat (mount-cmd 3 "mnt") " > /dev/null")
+			 "diff mnt/file1 file1.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 3))
+		   " && ")
+		 "Correct\nCorrect\n2/32 inodes, 18/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("raid10 -- width: stripe blocks across mirror groups of three" "10" 6 " -w 3"
+		 ,(string-join
+		   (list "./read-write.py 1 80"
+			 "fusermount -u mnt"
+			 (format "./wfs-check-metadata.py --mode raid10 --width 3 --blocks 18 --dirs 1 --files 1 --disks %s"
+				 (string-join (gen-disks 6) " ")))
+		   " && ")
+		 "Correct\nCorrect")
+		("raid10 -- degraded: read with one mirror of a group deleted" "10" 4 " -w 2"
+		 ,(string-join
+		   (list "./read-write.py 1 80"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (format "rm %s" (disk-path "test-disk2"))
+			 (format "../solution/wfs %s %s %s -s mnt --degraded > /dev/null"
+				 (disk-path "test-disk1") (disk-path "test-disk3") (disk-path "test-disk4"))
+			 "diff mnt/file1 file1.test"
+			 "echo Correct")
+		   " && ")
+		 "Correct\nCorrect")
+		("raid10 -- degraded: refuse a mirror group missing entirely" "10" 4 " -w 2"
+		 ,(string-join
+		   (list "fusermount -u mnt"
+			 (format "rm %s %s" (disk-path "test-disk1") (disk-path "test-disk2"))
+			 (concat (format "../solution/wfs %s %s -s mnt --degraded"
+					 (disk-path "test-disk3") (disk-path "test-disk4"))
+				 "; echo \"exit $?\""))
+		   " && ")
+		 "raid 10 mirror group of disks 0-1 is missing entirely\nexit 1")
+		("snapshot -- keep the old bytes of an overwritten and truncated file" "1" 2 " -O snapshot"
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "cat mnt/file1 > file1.test"
+			 "mkdir mnt/.snapshots/s"
+			 "dd if=/dev/urandom of=mnt/file1 bs=100 count=40 conv=notrunc status=none"
+			 "truncate -s 1000 mnt/file1"
+			 "diff mnt/.snapshots/s/file1 file1.test"
+			 "echo Correct"
+			 "stat -c %s mnt/file1 mnt/.snapshots/s/file1"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\nCorrect\n1000\n4000\n2/32 inodes, 12/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("snapshot -- refuse writes below a snapshot" "1" 2 " -O snapshot"
+		 ,(string-join
+		   (list "./read-write.py 1 10"
+			 "cat mnt/file1 > file1.test"
+			 "mkdir mnt/.snapshots/s"
+			 (concat "(touch mnt/.snapshots/s/new; printf x >> mnt/.snapshots/s/file1; "
+				 "truncate -s 0 mnt/.snapshots/s/file1; rm -f mnt/.snapshots/s/file1; "
+				 "mkdir mnt/.snapshots/s/d) 2>&1 | sed 's/.*: //'")
+			 "diff mnt/.snapshots/s/file1 file1.test"
+			 "echo Correct")
+		   " && ")
+		 "Correct\nRead-only file system\nRead-only file system\nRead-only file system\nRead-only file system\nRead-only file system\nCorrect")
+		("snapshot -- rmdir frees the blocks only the snapshot held" "1" 2 " -O snapshot"
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "mkdir mnt/.snapshots/s"
+			 "dd if=/dev/urandom of=mnt/file1 bs=100 count=40 conv=notrunc status=none"
+			 "rmdir mnt/.snapshots/s"
+			 "ls mnt/.snapshots"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\n2/32 inodes, 10/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("compress -- store a compressible file in fewer blocks" "1" 2 " -O compress"
+		 ,(string-join
+		   (list "yes 'wfs compresses repeated lines' | head -c 16384 > file.test"
+			 "cat file.test > mnt/f"
+			 "diff mnt/f file.test"
+			 "echo Correct"
+			 ; read from the middle of the second cluster
+			 "dd if=mnt/f bs=1 skip=3000 count=500 status=none > part.test"
+			 "dd if=file.test bs=1 skip=3000 count=500 status=none | cmp - part.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\nCorrect\n2/32 inodes, 10/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("compress -- overwrite the middle of a compressed cluster" "1" 2 " -O compress"
+		 ,(string-join
+		   (list "yes 'wfs compresses repeated lines' | head -c 16384 > file.test"
+			 "cat file.test > mnt/f"
+			 "printf XXXX | dd of=mnt/f bs=1 seek=2100 conv=notrunc status=none"
+			 "printf XXXX | dd of=file.test bs=1 seek=2100 conv=notrunc status=none"
+			 "diff mnt/f file.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (concat (mount-cmd 2 "mnt") " > /dev/null")
+			 "diff mnt/f file.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\nCorrect\n2/32 inodes, 10/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("compress -- chattr +c on a directory compresses new files below it" "1" 2 ""
+		 ,(string-join
+		   (list "yes 'wfs compresses repeated lines' | head -c 16384 > file.test"
+			 "mkdir mnt/d"
+			 "chattr +c mnt/d"
+			 "cat file.test > mnt/d/f"
+			 "cat file.test > mnt/g"
+			 "diff mnt/d/f file.test"
+			 "diff mnt/g file.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 ; g takes 33 blocks, f only 9
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\n4/32 inodes, 44/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("raid1 -- degraded: write without a deleted member, rebuild it with --replace" "1" 2 ""
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "fusermount -u mnt"
+			 (format "rm %s" (disk-path "test-disk2"))
+			 (format "../solution/wfs %s -s mnt --degraded > /dev/null" (disk-path "test-disk1"))
+			 "./read-write.py 2 40"
+			 "fusermount -u mnt"
+			 (format "truncate -s 1M %s" (disk-path "test-disk2"))
+			 (format "../solution/wfs %s --replace=%s -s mnt > /dev/null" (disk-path "test-disk1") (disk-path "test-disk2"))
+			 "fusermount -u mnt"
+			 (format "./wfs-check-metadata.py --mode raid1 --blocks 19 --dirs 1 --files 2 --disks %s"
+				 (string-join (gen-disks 2) " ")))
+		   " && ")
+		 "Correct\nCorrect\nCorrect")
+		("raid1 -- degraded: refuse a stale member until it is replaced" "1" 2 ""
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "cat mnt/file1 > file1.test"
+			 "fusermount -u mnt"
+			 (format "../solution/wfs %s -s mnt --degraded > /dev/null" (disk-path "test-disk1"))
+			 "fusermount -u mnt"
+			 (concat (mount-cmd 2 "mnt") " | sed \"s|/tmp/$(whoami)/||g\"; echo \"exit ${PIPESTATUS[0]}\"")
+			 (format "../solution/wfs %s --replace=%s -s mnt > /dev/null" (disk-path "test-disk1") (disk-path "test-disk2"))
+			 "diff mnt/file1 file1.test"
+			 "fusermount -u mnt"
+			 (format "./wfs-check-metadata.py --mode raid1 --blocks 10 --dirs 1 --files 1 --disks %s"
+				 (string-join (gen-disks 2) " ")))
+		   " && ")
+		 "Correct\ntest-disk2 is stale, generation 1 of 2, pass it with --replace=test-disk2 to rebuild it\nexit 1\nCorrect")
+		("inline -- keep small files in the inode" "1" 2 " -O inline"
+		 ,(string-join
+		   (list "head -c 300 /dev/urandom > s.test"
+			 "head -c 384 /dev/urandom > t.test"
+			 "cat s.test > mnt/s"
+			 "cat t.test > mnt/t"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2)
+			 (concat (mount-cmd 2 "mnt") " > /dev/null")
+			 "diff mnt/s s.test"
+			 "diff mnt/t t.test"
+			 "echo Correct")
+		   " && ")
+		 "3/32 inodes, 1/224 blocks, 0 problems, 0 repaired\nexit 0\nCorrect")
+		("inline -- move a file into blocks once it grows past 384 bytes" "1" 2 " -O inline"
+		 ,(string-join
+		   (list "head -c 300 /dev/urandom > s.test"
+			 "head -c 384 /dev/urandom > t.test"
+			 "cat s.test > mnt/s"
+			 "cat t.test > mnt/t"
+			 "head -c 200 /dev/urandom | tee -a s.test >> mnt/s"
+			 "printf x | tee -a t.test >> mnt/t"
+			 "diff mnt/s s.test"
+			 "diff mnt/t t.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2)
+			 (concat (mount-cmd 2 "mnt") " > /dev/null")
+			 "diff mnt/s s.test"
+			 "diff mnt/t t.test"
+			 "echo Correct")
+		   " && ")
+		 "Correct\n3/32 inodes, 3/224 blocks, 0 problems, 0 repaired\nexit 0\nCorrect")
+		("holes -- read zeros before the only written block" "1" 2 ""
+		 ,(string-join
+		   (list "printf abc | dd of=mnt/h bs=1 seek=20000 status=none"
+			 "printf abc | dd of=h.test bs=1 seek=20000 status=none"
+			 "diff mnt/h h.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 ; the root directory, the indirect block and the written block
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\n2/32 inodes, 3/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("fallocate -- reserve zeroed blocks, past the end with --keep-size" "1" 2 ""
+		 ,(string-join
+		   (list "fallocate -l 8192 mnt/f"
+			 "fallocate -n -o 8192 -l 4096 mnt/f"
+			 "stat -c %s mnt/f"
+			 "head -c 8192 /dev/zero | cmp - mnt/f"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2))
+		   " && ")
+		 "8192\nCorrect\n2/32 inodes, 26/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("truncate -- shrink a file then grow it back with a hole" "1" 2 ""
+		 ,(string-join
+		   (list "./read-write.py 1 80"
+			 "cat mnt/file1 > file1.test"
+			 "truncate -s 1000 mnt/file1 file1.test"
+			 "truncate -s 6000 mnt/file1 file1.test"
+			 "diff mnt/file1 file1.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\nCorrect\n2/32 inodes, 3/224 blocks, 0 problems, 0 repaired\nexit 0")
+		("clone -- share a file's blocks and copy one on the first write" "1" 2 " -O reflink"
+		 ,(string-join
+		   (list "./read-write.py 1 40"
+			 "cat mnt/file1 > file1.test"
+			 "../solution/wfs-clone -r always mnt/file1 mnt/c"
+			 "diff mnt/c file1.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 ; only the clone's indirect block is new
+			 (fsck-cmd 2)
+			 (concat (mount-cmd 2 "mnt") " > /dev/null")
+			 "printf XXXX | dd of=mnt/c bs=1 seek=100 conv=notrunc status=none"
+			 "diff mnt/file1 file1.test"
+			 "printf XXXX | dd of=file1.test bs=1 seek=100 conv=notrunc status=none"
+			 "diff mnt/c file1.test"
+			 "echo Correct"
+			 "fusermount -u mnt"
+			 (fsck-cmd 2))
+		   " && ")
+		 "Correct\nCorrect\n3/32 inodes, 11/224 blocks, 0 problems, 0 repaired\nexit 0\nCorrect\n3/32 inodes, 12/224 blocks, 0 problems, 0 repaired\nexit 0"))))))
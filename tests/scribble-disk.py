@@ -0,0 +1,65 @@
+#!/usr/bin/python3
+
+# damage single structures on the disks to test wfs-fsck
+
+import argparse
+import wfsverify
+
+# superblock fields after the ones WfsState knows, up to wib_chunk
+extra_superblock = [('raid_mode', 4), ('mount_index', 4), ('timestamp', 4),
+                    ('disk_cnt', 4), ('magic', 4), ('version', 4),
+                    ('csum_ptr', 8), ('raid_width', 4), ('features', 4),
+                    ('groups_ptr', 8), ('group_cnt', 4), ('group_blocks', 4),
+                    ('group_inodes', 4), ('pad', 4), ('refs_ptr', 8),
+                    ('snap_ptr', 8), ('snap_size', 8), ('snap_cnt', 4),
+                    ('pad2', 4), ('wib_ptr', 8), ('wib_chunk', 4)]
+
+def write_at(disk, pos, data):
+    with open(disk, "r+b") as diskf:
+        diskf.seek(pos)
+        diskf.write(data)
+
+def read_at(disk, pos, size):
+    with open(disk, "rb") as diskf:
+        diskf.seek(pos)
+        return diskf.read(size)
+
+def scribble(disk, args):
+    fs = wfsverify.WfsState(disk)
+    junk = b'\xff' * fs.blksize
+    for slot in args.slots or []:
+        # slots of this disk's data region are not block numbers on raid 0 or 5
+        write_at(disk, fs.get_dblock_region() + slot * fs.blksize, junk)
+    if args.inode is not None:
+        write_at(disk, fs.get_iblock_region() + args.inode * fs.blksize, junk)
+    if args.bitmap is not None:
+        pos = fs.get_dbit() + args.bitmap // 8
+        byte = read_at(disk, pos, 1)[0]
+        write_at(disk, pos, bytes([byte | (1 << (args.bitmap % 8))]))
+    if args.refs is not None:
+        refs_ptr = fs.read_struct(fs.get_sb_size(), extra_superblock)['refs_ptr']
+        if refs_ptr == 0:
+            print(f"{disk} has no reference counts")
+            exit(1)
+        write_at(disk, refs_ptr + args.refs * 4, (3).to_bytes(4, 'little'))
+    for bit in args.wib or []:
+        wib_ptr = fs.read_struct(fs.get_sb_size(), extra_superblock)['wib_ptr']
+        if wib_ptr == 0:
+            print(f"{disk} has no write-intent bitmap")
+            exit(1)
+        byte = read_at(disk, wib_ptr + bit // 8, 1)[0]
+        write_at(disk, wib_ptr + bit // 8, bytes([byte | (1 << (bit % 8))]))
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--slots", type=int, nargs="+", help="overwrite these slots of the data region")
+    parser.add_argument("--inode", type=int, help="overwrite the block of this inode")
+    parser.add_argument("--bitmap", type=int, help="mark this data block allocated")
+    parser.add_argument("--refs", type=int, help="give this data block 3 extra references")
+    parser.add_argument("--wib", type=int, nargs="+", help="set these write-intent bits, as an unclean shutdown leaves them")
+    parser.add_argument("--disks", nargs="+", help="list of disks")
+
+    args = parser.parse_args()
+
+    for disk in args.disks:
+        scribble(disk, args)
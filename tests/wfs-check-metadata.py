@@ -140,6 +140,46 @@ def verify_raid1(disks, expected_dirs, expected_files, expected_blocks):
 
     print("Correct")
 
+def verify_raid10(disks, width, expected_dirs, expected_files, expected_blocks):
+    """Verify wfs formatted as raid10 with mirror groups of 'width' disks."""
+    filesystems = [wfsverify.WfsState(disk) for disk in disks]
+    test_eq("disks form whole mirror groups", len(filesystems) % width, 0)
+    groups = len(filesystems) // width
+
+    # metadata is mirrored on every disk like raid1
+    ref_fs = filesystems[0]
+    for fs in filesystems:
+        test_eq(f"allocated inodes on {fs.diskname()}",
+                len(fs.list_allocated_inodes()), (expected_files + expected_dirs))
+        test_eq(f"allocated datablocks on {fs.diskname()}",
+                len(fs.list_allocated_datablocks()), expected_blocks)
+        if fs.read_inode_region() != ref_fs.read_inode_region():
+            print(f"raid10 inode regions must be identical {ref_fs.diskname()} {fs.diskname()}")
+            exit(1)
+
+    (dirs, files) = verify_inodes(ref_fs.list_allocated_inodes(), ref_fs)
+    test_eq(f"wfs directory inodes", dirs, expected_dirs)
+    test_eq(f"wfs regular file inodes", files, expected_files)
+
+    # block b lives on group b % groups, so each disk holds 1/groups of the data
+    slots = (ref_fs.get_sb_datablocks() + groups - 1) // groups
+    for g in range(groups):
+        members = filesystems[g * width:(g + 1) * width]
+        regions = []
+        for fs in members:
+            with open(fs.disk, "rb") as diskf:
+                diskf.seek(fs.get_dblock_region())
+                regions.append(diskf.read(slots * fs.blksize))
+        for (fs, region) in zip(members[1:], regions[1:]):
+            if region != regions[0]:
+                print(f"raid10 mirrors must be identical {members[0].diskname()} {fs.diskname()}")
+                exit(1)
+        if expected_blocks >= groups and regions[0].count(0) == len(regions[0]):
+            print(f"raid10 mirror group {g} holds no data")
+            exit(1)
+
+    print("Correct")
+
 def verify_raid0(disks, expected_dirs, expected_files, expected_blocks, altblocks):
     """Verify wfs formatted as raid1."""
     filesystems = [wfsverify.WfsState(disk) for disk in disks]
@@ -184,12 +224,13 @@ def unimplemented(mode):
     
 if __name__ == '__main__':
     parser = argparse.ArgumentParser()
-    parser.add_argument("--mode", help="verify mode: mkfs, raid0, raid1, raid1v")
+    parser.add_argument("--mode", help="verify mode: mkfs, raid0, raid1, raid1v, raid10")
     parser.add_argument("--inodes", help="expected number of inodes")
     parser.add_argument("--blocks", help="expected number of data blocks")
     parser.add_argument("--altblocks", help="some tests have an alternate number of acceptable data blocks")
     parser.add_argument("--dirs", help="expected number of directories")
     parser.add_argument("--files", help="expected number of regular files")
+    parser.add_argument("--width", help="raid10 mirror group width")
     parser.add_argument("--disks", nargs="+", help="list of disks")
 
     args = parser.parse_args()
@@ -200,6 +241,8 @@ if __name__ == '__main__':
         verify_raid1(args.disks, int(args.dirs), int(args.files), int(args.blocks))
     elif args.mode == 'raid0':
         verify_raid0(args.disks, int(args.dirs), int(args.files), int(args.blocks), int(args.altblocks))
+    elif args.mode == 'raid10':
+        verify_raid10(args.disks, int(args.width), int(args.dirs), int(args.files), int(args.blocks))
     elif args.mode == 'raid1v':
         verify_raid1v(args.disks, int(args.dirs), int(args.files), int(args.blocks))
     else: